@@ -0,0 +1,44 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "benchmark.h"
+
+// Count allocations of the benchmark, fcitx and keyman core, the shared
+// libraries resolve operator new to this definition.
+
+namespace {
+
+std::atomic<uint64_t> allocationCount{0};
+
+} // namespace
+
+uint64_t fcitx::keymanAllocationCount() {
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (auto *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
@@ -0,0 +1,131 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_BENCHMARK_BENCHMARK_H_
+#define _FCITX5_KEYMAN_BENCHMARK_BENCHMARK_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "stats.h"
+
+namespace fcitx {
+
+// Number of operator new calls so far, in any thread.
+uint64_t keymanAllocationCount();
+
+struct KeymanBenchmarkResult {
+    std::string name;
+    uint64_t allocations = 0;
+    KeymanLatencyHistogram latency;
+
+    double nsPerOp() const {
+        return latency.count()
+                   ? static_cast<double>(latency.sum()) / latency.count()
+                   : 0;
+    }
+    double allocationsPerOp() const {
+        return latency.count()
+                   ? static_cast<double>(allocations) / latency.count()
+                   : 0;
+    }
+};
+
+// Run each operation separately and time it, so the untimed setup of an
+// operation (e.g. typing a character before a backspace) is not counted.
+// The clock is read twice per operation, which adds a few dozen nanoseconds
+// to every result.
+class KeymanBenchmarkRunner {
+public:
+    static constexpr uint64_t warmUpIterations = 100;
+    static constexpr uint64_t minIterations = 1000;
+
+    // Only run benchmarks whose name contains filter.
+    KeymanBenchmarkRunner(std::string filter, uint64_t minTime)
+        : filter_(std::move(filter)), minTime_(minTime) {}
+
+    bool enabled(const std::string &name) const {
+        return name.find(filter_) != std::string::npos;
+    }
+
+    // Call setup(i) and op(i) until op has run for minTime nanoseconds.
+    template <typename Setup, typename Op>
+    void run(const std::string &name, Setup setup, Op op) {
+        if (!enabled(name)) {
+            return;
+        }
+        for (uint64_t i = 0; i < warmUpIterations; i++) {
+            setup(i);
+            op(i);
+        }
+        KeymanBenchmarkResult result;
+        result.name = name;
+        uint64_t spent = 0;
+        for (uint64_t i = 0; spent < minTime_ || i < minIterations; i++) {
+            setup(i);
+            const auto allocations = keymanAllocationCount();
+            const auto start = keymanNow();
+            op(i);
+            const auto end = keymanNow();
+            result.allocations += keymanAllocationCount() - allocations;
+            result.latency.record(end - start);
+            spent += end - start;
+        }
+        results_.push_back(std::move(result));
+    }
+
+    template <typename Op>
+    void run(const std::string &name, Op op) {
+        run(name, [](uint64_t) {}, op);
+    }
+
+    const auto &results() const { return results_; }
+
+    void print(FILE *file) const {
+        std::fprintf(file, "%-44s %10s %10s %10s %10s %10s\n", "benchmark",
+                     "iterations", "ns/op", "p50", "p99", "allocs/op");
+        for (const auto &result : results_) {
+            std::fprintf(
+                file, "%-44s %10llu %10.0f %10llu %10llu %10.2f\n",
+                result.name.data(),
+                static_cast<unsigned long long>(result.latency.count()),
+                result.nsPerOp(),
+                static_cast<unsigned long long>(
+                    result.latency.percentile(50)),
+                static_cast<unsigned long long>(
+                    result.latency.percentile(99)),
+                result.allocationsPerOp());
+        }
+    }
+
+    // One JSON object per line, to be saved as a baseline.
+    void printJson(FILE *file) const {
+        for (const auto &result : results_) {
+            std::fprintf(
+                file,
+                "{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.1f,"
+                "\"p50\":%llu,\"p99\":%llu,\"allocs_per_op\":%.2f}\n",
+                result.name.data(),
+                static_cast<unsigned long long>(result.latency.count()),
+                result.nsPerOp(),
+                static_cast<unsigned long long>(
+                    result.latency.percentile(50)),
+                static_cast<unsigned long long>(
+                    result.latency.percentile(99)),
+                result.allocationsPerOp());
+        }
+    }
+
+private:
+    std::string filter_;
+    uint64_t minTime_;
+    std::vector<KeymanBenchmarkResult> results_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_BENCHMARK_BENCHMARK_H_
@@ -0,0 +1,395 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx-utils/unixfd.h>
+#include "engine.h"
+#include "environment.h"
+#include "procstats.h"
+
+// Generate synthetic keyboard packages in several XDG data directories, and
+// measure KeymanEngine::listInputMethods on them. Every run is done in a new
+// process, so the peak RSS and the caches of fcitx are not shared.
+
+using namespace fcitx;
+
+namespace {
+
+struct CatalogOptions {
+    unsigned packages = 1000;
+    unsigned keyboards = 2;
+    unsigned languages = 3;
+    unsigned roots = 3;
+    // Percent of packages that also exist in another root.
+    unsigned duplicates = 10;
+    // Percent of keyboards that are not in the package file list.
+    unsigned missingKmx = 5;
+    // Percent of keyboards that have an icon.
+    unsigned icons = 50;
+    unsigned runs = 5;
+    unsigned seed = 1;
+    // Only generate the tree under this directory.
+    std::string generate;
+};
+
+struct CatalogSample {
+    uint64_t wallNs = 0;
+    uint64_t readCalls = 0;
+    uint64_t writeCalls = 0;
+    uint64_t readBytes = 0;
+    uint64_t minorFaults = 0;
+    uint64_t majorFaults = 0;
+    uint64_t peakRssKb = 0;
+    int64_t rssGrowthKb = 0;
+    uint64_t entries = 0;
+};
+
+void writeFile(const std::string &path, const std::string &content) {
+    UnixFD fd = UnixFD::own(
+        open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd.isValid() || fs::safeWrite(fd.fd(), content.data(),
+                                       content.size()) !=
+                             static_cast<ssize_t>(content.size())) {
+        std::fprintf(stderr, "Failed to write %s\n", path.data());
+        std::exit(1);
+    }
+}
+
+std::string kmpJson(const std::string &package, const std::string &version,
+                    const std::vector<std::string> &listed,
+                    const CatalogOptions &options, unsigned keyboards) {
+    std::string json = stringutils::concat(
+        "{\"system\":{\"keymanDeveloperVersion\":\"17.0.0\","
+        "\"fileVersion\":\"7.0\"},\"options\":{\"readmeFile\":\"readme.htm\"},"
+        "\"info\":{\"name\":{\"description\":\"",
+        package, "\"},\"version\":{\"description\":\"", version,
+        "\"},\"author\":{\"description\":\"Synthetic\"}},\"files\":[");
+    json.append("{\"name\":\"readme.htm\",\"description\":\"Readme\"}");
+    for (const auto &file : listed) {
+        json.append(stringutils::concat(",{\"name\":\"", file,
+                                        "\",\"description\":\"Keyboard\"}"));
+    }
+    json.append("],\"keyboards\":[");
+    for (unsigned i = 0; i < keyboards; i++) {
+        const auto id = stringutils::concat(package, "_", i);
+        json.append(stringutils::concat(i ? "," : "", "{\"name\":\"", id,
+                                        "\",\"id\":\"", id,
+                                        "\",\"version\":\"", version,
+                                        "\",\"languages\":["));
+        for (unsigned j = 0; j < options.languages; j++) {
+            json.append(stringutils::concat(j ? "," : "",
+                                            "{\"name\":\"Language ", j,
+                                            "\",\"id\":\"x-l", i, "-", j,
+                                            "\"}"));
+        }
+        json.append("]}");
+    }
+    json.append("]}");
+    return json;
+}
+
+void generatePackage(const std::string &root, const std::string &package,
+                     const std::string &version,
+                     const CatalogOptions &options, std::mt19937 &random) {
+    const auto dir = stringutils::joinPath(root, "keyman", package);
+    fs::makePath(dir);
+    std::vector<std::string> listed;
+    for (unsigned i = 0; i < options.keyboards; i++) {
+        const auto id = stringutils::concat(package, "_", i);
+        if (random() % 100 < options.missingKmx) {
+            continue;
+        }
+        listed.push_back(id + ".kmx");
+        writeFile(stringutils::joinPath(dir, id + ".kmx"), "");
+        if (random() % 100 < options.icons) {
+            writeFile(stringutils::joinPath(dir, id + ".bmp.png"), "");
+        }
+    }
+    writeFile(stringutils::joinPath(dir, "kmp.json"),
+              kmpJson(package, version, listed, options, options.keyboards));
+}
+
+// Return the data directories, the first one is XDG_DATA_HOME.
+std::vector<std::string> generateTree(const std::string &base,
+                                      const CatalogOptions &options) {
+    std::vector<std::string> roots;
+    for (unsigned i = 0; i < options.roots; i++) {
+        roots.push_back(stringutils::joinPath(base, stringutils::concat(
+                                                        "root", i)));
+        fs::makePath(stringutils::joinPath(roots.back(), "keyman"));
+    }
+    std::mt19937 random(options.seed);
+    for (unsigned i = 0; i < options.packages; i++) {
+        char package[32];
+        std::snprintf(package, sizeof(package), "pkg%06u", i);
+        const auto root = i % roots.size();
+        generatePackage(roots[root], package, "1.0", options, random);
+        if (roots.size() > 1 && random() % 100 < options.duplicates) {
+            // A newer or older version of the same package.
+            const auto other = (root + 1 + random() % (roots.size() - 1)) %
+                               roots.size();
+            generatePackage(roots[other], package,
+                            random() % 2 ? "2.0" : "0.9", options, random);
+        }
+    }
+    return roots;
+}
+
+int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+    return std::remove(path);
+}
+
+void removeTree(const std::string &path) {
+    nftw(path.data(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Drop the page, dentry and inode caches. Only works as root, there is no
+// cold run otherwise, since files that are just written or copied are
+// cached.
+bool dropCaches() {
+    sync();
+    UnixFD fd = UnixFD::own(open("/proc/sys/vm/drop_caches", O_WRONLY));
+    return fd.isValid() && fs::safeWrite(fd.fd(), "3", 1) == 1;
+}
+
+CatalogSample measure(const std::vector<std::string> &roots,
+                      bool traceSyscalls) {
+    KeymanBenchmarkEnvironment environment(roots[0]);
+    if (roots.size() > 1) {
+        const std::vector<std::string> dataDirs(roots.begin() + 1,
+                                                roots.end());
+        setenv("XDG_DATA_DIRS", stringutils::join(dataDirs, ":").data(), 1);
+    }
+    environment.createEngine("fcitx5-keyman-catalog-benchmark");
+
+    CatalogSample sample;
+    struct rusage before;
+    struct rusage after;
+    if (traceSyscalls) {
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    }
+    const auto io = KeymanIoStats::current();
+    const auto rss = keymanResidentKb();
+    getrusage(RUSAGE_SELF, &before);
+    const auto start = keymanNow();
+    // Stop right around the listing, so the tracer does not count the
+    // system calls of the measurement itself.
+    if (traceSyscalls) {
+        raise(SIGSTOP);
+    }
+    const auto &entries = environment.listInputMethods();
+    if (traceSyscalls) {
+        raise(SIGSTOP);
+    }
+    const auto end = keymanNow();
+    getrusage(RUSAGE_SELF, &after);
+    const auto ioAfter = KeymanIoStats::current();
+    sample.wallNs = end - start;
+    sample.readCalls = ioAfter.readCalls - io.readCalls;
+    sample.writeCalls = ioAfter.writeCalls - io.writeCalls;
+    sample.readBytes = ioAfter.readBytes - io.readBytes;
+    sample.minorFaults = after.ru_minflt - before.ru_minflt;
+    sample.majorFaults = after.ru_majflt - before.ru_majflt;
+    sample.peakRssKb = after.ru_maxrss;
+    sample.rssGrowthKb = static_cast<int64_t>(keymanResidentKb()) - rss;
+    sample.entries = entries.size();
+    return sample;
+}
+
+// Count the system calls made by listInputMethods in the child, between the
+// two SIGSTOP. The time of the traced run is not used.
+uint64_t countSyscalls(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) {
+        return 0;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+           reinterpret_cast<void *>(PTRACE_O_TRACESYSGOOD));
+    uint64_t stops = 0;
+    while (ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr) == 0 &&
+           waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            stops++;
+        } else if (WSTOPSIG(status) == SIGSTOP) {
+            ptrace(PTRACE_DETACH, pid, nullptr, nullptr);
+            break;
+        }
+    }
+    // Every system call stops on entry and exit. The exit of the first raise
+    // and the entry of the second one are not made by the listing.
+    return stops >= 2 ? stops / 2 - 1 : 0;
+}
+
+bool runChild(const std::vector<std::string> &roots, bool traceSyscalls,
+              CatalogSample &sample, uint64_t *syscalls = nullptr) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return false;
+    }
+    const auto pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        const auto result = measure(roots, traceSyscalls);
+        fs::safeWrite(fds[1], &result, sizeof(result));
+        _exit(0);
+    }
+    close(fds[1]);
+    if (traceSyscalls && syscalls) {
+        *syscalls = countSyscalls(pid);
+    }
+    const bool success =
+        fs::safeRead(fds[0], &sample, sizeof(sample)) == sizeof(sample);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return success && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void printSamples(const char *mode, std::vector<CatalogSample> samples,
+                  uint64_t syscalls) {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end(),
+              [](const CatalogSample &lhs, const CatalogSample &rhs) {
+                  return lhs.wallNs < rhs.wallNs;
+              });
+    const auto &median = samples[samples.size() / 2];
+    uint64_t peakRssKb = 0;
+    for (const auto &sample : samples) {
+        peakRssKb = std::max(peakRssKb, sample.peakRssKb);
+    }
+    std::printf("%-5s %8llu %10.2f %10.2f %9llu %9llu %9llu %9llu %10llu "
+                "%9lld\n",
+                mode, static_cast<unsigned long long>(median.entries),
+                median.wallNs / 1e6, samples.front().wallNs / 1e6,
+                static_cast<unsigned long long>(syscalls),
+                static_cast<unsigned long long>(median.readCalls),
+                static_cast<unsigned long long>(median.minorFaults),
+                static_cast<unsigned long long>(median.majorFaults),
+                static_cast<unsigned long long>(peakRssKb),
+                static_cast<long long>(median.rssGrowthKb));
+}
+
+void usage(const char *name) {
+    std::fprintf(
+        stderr,
+        "Usage: %s [--packages=N] [--keyboards=N] [--languages=N] "
+        "[--roots=N]\n"
+        "    [--duplicates=PERCENT] [--missing-kmx=PERCENT] "
+        "[--icons=PERCENT]\n"
+        "    [--runs=N] [--seed=N] [--generate=DIR]\n"
+        "Cold runs drop the page cache first, so they are only done as "
+        "root.\n"
+        "Syscalls are counted with ptrace in a separate run.\n",
+        name);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    CatalogOptions options;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (keymanParseOption(arg, "--packages", options.packages) ||
+            keymanParseOption(arg, "--keyboards", options.keyboards) ||
+            keymanParseOption(arg, "--languages", options.languages) ||
+            keymanParseOption(arg, "--roots", options.roots) ||
+            keymanParseOption(arg, "--duplicates", options.duplicates) ||
+            keymanParseOption(arg, "--missing-kmx", options.missingKmx) ||
+            keymanParseOption(arg, "--icons", options.icons) ||
+            keymanParseOption(arg, "--runs", options.runs) ||
+            keymanParseOption(arg, "--seed", options.seed)) {
+            continue;
+        }
+        if (std::strncmp(arg, "--generate=", 11) == 0) {
+            options.generate = arg + 11;
+            continue;
+        }
+        usage(argv[0]);
+        return 1;
+    }
+    options.roots = std::max(options.roots, 1U);
+
+    if (!options.generate.empty()) {
+        generateTree(options.generate, options);
+        return 0;
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    auto base = stringutils::joinPath(tmpdir && tmpdir[0] ? tmpdir : "/tmp",
+                                      "fcitx5-keyman-catalog-XXXXXX");
+    if (!mkdtemp(base.data())) {
+        std::fprintf(stderr, "Failed to create %s\n", base.data());
+        return 1;
+    }
+    const auto tree = stringutils::joinPath(base, "tree");
+    const auto roots = generateTree(tree, options);
+
+    CatalogSample sample;
+    uint64_t syscalls = 0;
+    bool success = runChild(roots, true, sample, &syscalls);
+
+    std::vector<CatalogSample> warm;
+    // The first run warms up the caches.
+    success = success && runChild(roots, false, sample);
+    for (unsigned i = 0; success && i < options.runs; i++) {
+        success = runChild(roots, false, sample);
+        warm.push_back(sample);
+    }
+
+    std::vector<CatalogSample> cold;
+    bool coldAvailable = true;
+    for (unsigned i = 0; success && i < options.runs; i++) {
+        if (!dropCaches()) {
+            coldAvailable = false;
+            break;
+        }
+        success = runChild(roots, false, sample);
+        cold.push_back(sample);
+    }
+    removeTree(base);
+    if (!success) {
+        std::fprintf(stderr, "Benchmark failed.\n");
+        return 1;
+    }
+
+    std::printf("packages: %u, keyboards per package: %u, languages: %u, "
+                "roots: %u, duplicates: %u%%, missing kmx: %u%%\n",
+                options.packages, options.keyboards, options.languages,
+                options.roots, options.duplicates, options.missingKmx);
+    std::printf("%-5s %8s %10s %10s %9s %9s %9s %9s %10s %9s\n", "cache",
+                "entries", "median ms", "min ms", "syscalls", "reads",
+                "minflt", "majflt", "peak KiB", "rss+ KiB");
+    printSamples("warm", warm, syscalls);
+    if (coldAvailable) {
+        printSamples("cold", cold, syscalls);
+    } else {
+        std::printf("%-5s unavailable, dropping the caches requires root\n",
+                    "cold");
+    }
+    return 0;
+}
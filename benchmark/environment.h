@@ -0,0 +1,180 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_BENCHMARK_ENVIRONMENT_H_
+#define _FCITX5_KEYMAN_BENCHMARK_ENVIRONMENT_H_
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx/inputmethodentry.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+
+namespace fcitx {
+
+// Returned by the tests and benchmarks that are skipped, e.g. if the fixture
+// keyboards are not built.
+constexpr int keymanSkipReturnCode = 77;
+
+// Parse arg if it is "name=N", return false if it is a different argument.
+template <typename T>
+bool keymanParseOption(const char *arg, const char *name, T &value) {
+    const auto length = std::strlen(name);
+    if (std::strncmp(arg, name, length) != 0 || arg[length] != '=') {
+        return false;
+    }
+    value = static_cast<T>(std::strtoull(arg + length + 1, nullptr, 10));
+    return true;
+}
+
+// Point XDG directories to the fixtures and a temporary config directory, so
+// the installed keyboards and the user config do not affect the results.
+// It must be created before StandardPath is used.
+class KeymanBenchmarkEnvironment {
+public:
+    // Keyboards are loaded from dataDir/keyman, or from a temporary
+    // directory that addKeyboard() writes to if dataDir is empty.
+    explicit KeymanBenchmarkEnvironment(std::string dataDir = {}) {
+        char tempDir[] = "/tmp/fcitx5-keyman-benchmark-XXXXXX";
+        if (!mkdtemp(tempDir)) {
+            throw std::runtime_error("Failed to create temporary directory");
+        }
+        tempDir_ = tempDir;
+        configDir_ = stringutils::joinPath(tempDir_, "config");
+        dataDir_ = dataDir.empty() ? stringutils::joinPath(tempDir_, "data")
+                                   : std::move(dataDir);
+        fs::makePath(configDir_);
+        fs::makePath(dataDir_);
+        setenv("XDG_DATA_HOME", dataDir_.data(), 1);
+        setenv("XDG_DATA_DIRS", dataDir_.data(), 1);
+        setenv("XDG_CONFIG_HOME", configDir_.data(), 1);
+        setenv("XDG_CONFIG_DIRS", configDir_.data(), 1);
+    }
+    ~KeymanBenchmarkEnvironment() {
+        // The engine may write its config on exit.
+        engine_.reset();
+        instance_.reset();
+        nftw(
+            tempDir_.data(),
+            [](const char *path, const struct stat *, int, struct FTW *) {
+                return std::remove(path);
+            },
+            16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    const auto &configDir() const { return configDir_; }
+    const auto &dataDir() const { return dataDir_; }
+
+    // Kmx file of a fixture keyboard under dataDir.
+    std::string fixtureKmx(const std::string &id) const {
+        return stringutils::joinPath(dataDir_, "keyman", id,
+                                     stringutils::concat(id, ".kmx"));
+    }
+    // Whether the fixture keyboard is compiled, kmc may not be installed.
+    bool fixtureBuilt(const std::string &id) const {
+        return fs::isreg(fixtureKmx(id));
+    }
+
+    // Create an instance named name and the engine, keyboards are listed by
+    // listInputMethods().
+    KeymanEngine &createEngine(std::string name) {
+        arg0_ = std::move(name);
+        argv_[0] = arg0_.data();
+        instance_ = std::make_unique<Instance>(1, argv_);
+        engine_ = std::make_unique<KeymanEngine>(instance_.get());
+        return *engine_;
+    }
+    Instance &instance() { return *instance_; }
+    KeymanEngine &engine() { return *engine_; }
+
+    // List the keyboards, entries of the previous listing become invalid.
+    const std::vector<InputMethodEntry> &listInputMethods() {
+        entries_ = engine_->listInputMethods();
+        return entries_;
+    }
+    const auto &entries() const { return entries_; }
+    // Entry of keyboard id, nullptr if it is not listed.
+    const InputMethodEntry *findEntry(const std::string &id) const {
+        const auto name = stringutils::concat("keyman:", id);
+        for (const auto &entry : entries_) {
+            if (entry.uniqueName() == name) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Install a kmx file as a package with a minimal kmp.json, return the
+    // keyboard id, which is the file name without .kmx.
+    std::string addKeyboard(const std::string &kmxPath) {
+        auto id = fs::baseName(kmxPath);
+        if (stringutils::endsWith(id, ".kmx")) {
+            id.resize(id.size() - 4);
+        }
+        const auto dir = stringutils::joinPath(dataDir_, "keyman", id);
+        fs::makePath(dir);
+        const auto kmx = stringutils::joinPath(dir, id + ".kmx");
+        char *absolutePath = realpath(kmxPath.data(), nullptr);
+        if (!absolutePath || symlink(absolutePath, kmx.data()) != 0) {
+            free(absolutePath);
+            throw std::runtime_error("Failed to install " + kmxPath);
+        }
+        free(absolutePath);
+        const auto json = stringutils::concat(
+            "{\"files\":[{\"name\":\"", id,
+            ".kmx\",\"description\":\"\"}],\"keyboards\":[{\"name\":\"", id,
+            "\",\"id\":\"", id, "\",\"version\":\"1.0\",\"languages\":[]}]}");
+        auto *file =
+            std::fopen(stringutils::joinPath(dir, "kmp.json").data(), "w");
+        if (!file) {
+            throw std::runtime_error("Failed to install " + kmxPath);
+        }
+        std::fputs(json.data(), file);
+        std::fclose(file);
+        return id;
+    }
+
+    // Install a package directory that contains kmp.json, return the
+    // directory name.
+    std::string addPackage(const std::string &packageDir) {
+        auto name = fs::baseName(fs::cleanPath(packageDir));
+        const auto keymanDir = stringutils::joinPath(dataDir_, "keyman");
+        fs::makePath(keymanDir);
+        char *absolutePath = realpath(packageDir.data(), nullptr);
+        if (!absolutePath ||
+            symlink(absolutePath,
+                    stringutils::joinPath(keymanDir, name).data()) != 0) {
+            free(absolutePath);
+            throw std::runtime_error("Failed to install " + packageDir);
+        }
+        free(absolutePath);
+        return name;
+    }
+
+private:
+    std::string tempDir_;
+    std::string configDir_;
+    std::string dataDir_;
+    std::string arg0_;
+    char *argv_[2] = {nullptr, nullptr};
+    std::unique_ptr<Instance> instance_;
+    std::unique_ptr<KeymanEngine> engine_;
+    std::vector<InputMethodEntry> entries_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_BENCHMARK_ENVIRONMENT_H_
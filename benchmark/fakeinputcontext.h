@@ -0,0 +1,101 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_BENCHMARK_FAKEINPUTCONTEXT_H_
+#define _FCITX5_KEYMAN_BENCHMARK_FAKEINPUTCONTEXT_H_
+
+#include <string>
+#include <fcitx-utils/capabilityflags.h>
+#include <fcitx-utils/keysym.h>
+#include <fcitx-utils/utf8.h>
+#include <fcitx/event.h>
+#include <fcitx/inputcontext.h>
+#include <fcitx/inputcontextmanager.h>
+#include <fcitx/surroundingtext.h>
+
+namespace fcitx {
+
+// Input context without a frontend. With surrounding text, it edits the text
+// like an application would, and keeps only the text close to the cursor.
+class FakeInputContext : public InputContext {
+public:
+    static constexpr size_t maxSurroundingText = 256;
+
+    FakeInputContext(InputContextManager &manager, bool surroundingText)
+        : InputContext(manager, "fcitx5-keyman-benchmark") {
+        created();
+        if (surroundingText) {
+            setCapabilityFlags(CapabilityFlag::SurroundingText);
+            this->surroundingText().setText("", 0, 0);
+        }
+    }
+    ~FakeInputContext() { destroy(); }
+
+    const char *frontend() const override { return "benchmark"; }
+
+    const std::string &committed() const { return committed_; }
+    size_t forwardedKeys() const { return forwardedKeys_; }
+    // Handle a key that is not filtered by the input method, like an
+    // application would.
+    void applyKey(const KeyEvent &event) {
+        if (event.filtered() || event.isRelease() ||
+            !capabilityFlags().test(CapabilityFlag::SurroundingText)) {
+            return;
+        }
+        auto &surrounding = surroundingText();
+        const auto cursor = surrounding.cursor();
+        if (cursor == 0) {
+            return;
+        }
+        if (event.key().check(FcitxKey_BackSpace)) {
+            surrounding.deleteText(-1, 1);
+        } else if (event.key().check(FcitxKey_Left)) {
+            surrounding.setCursor(cursor - 1, cursor - 1);
+        }
+    }
+    void clearCommitted() { committed_.clear(); }
+    void clear() {
+        committed_.clear();
+        forwardedKeys_ = 0;
+        if (capabilityFlags().test(CapabilityFlag::SurroundingText)) {
+            surroundingText().setText("", 0, 0);
+        }
+    }
+
+protected:
+    void commitStringImpl(const std::string &text) override {
+        committed_.append(text);
+        if (!capabilityFlags().test(CapabilityFlag::SurroundingText)) {
+            return;
+        }
+        auto &surrounding = surroundingText();
+        auto current = surrounding.text();
+        auto cursor = surrounding.cursor();
+        current.insert(utf8::ncharByteLength(current.begin(), cursor), text);
+        cursor += utf8::length(text);
+        if (cursor > maxSurroundingText) {
+            const auto drop = cursor - maxSurroundingText;
+            current.erase(0, utf8::ncharByteLength(current.begin(), drop));
+            cursor -= drop;
+        }
+        surrounding.setText(current, cursor, cursor);
+    }
+    void deleteSurroundingTextImpl(int offset, unsigned int size) override {
+        surroundingText().deleteText(offset, size);
+    }
+    void forwardKeyImpl(const ForwardKeyEvent &) override {
+        forwardedKeys_++;
+    }
+    void updatePreeditImpl() override {}
+
+private:
+    std::string committed_;
+    size_t forwardedKeys_ = 0;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_BENCHMARK_FAKEINPUTCONTEXT_H_
@@ -0,0 +1,257 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "keymanmemory.h"
+#include "procstats.h"
+
+// Measure the memory of loading each kmx file under a directory, and of 1, 10,
+// 100 and 1000 KeymanStates of it. Every keyboard is measured in a new
+// process. The cost of the input contexts themselves is measured without a
+// keyboard and subtracted from the cost per state.
+
+using namespace fcitx;
+
+namespace {
+
+constexpr size_t stateCounts[] = {1, 10, 100, 1000};
+constexpr size_t numStateCounts = std::size(stateCounts);
+
+struct FootprintSample {
+    bool loaded = false;
+    uint64_t loadHeap = 0;
+    int64_t loadRssKb = 0;
+    // Growth since the keyboard is loaded, for each of stateCounts.
+    uint64_t stateHeap[numStateCounts] = {};
+    int64_t stateRssKb[numStateCounts] = {};
+};
+
+std::vector<std::string> kmxFiles;
+
+int collectKmx(const char *path, const struct stat *, int type,
+               struct FTW *) {
+    if (type == FTW_F && stringutils::endsWith(path, ".kmx")) {
+        kmxFiles.push_back(path);
+    }
+    return 0;
+}
+
+// Create input contexts, and a KeymanState for each of them if the keyboard
+// is loaded. An empty id measures the input contexts only.
+FootprintSample measure(KeymanBenchmarkEnvironment &environment,
+                        const std::string &id) {
+    FootprintSample sample;
+    auto &engine =
+        environment.createEngine("fcitx5-keyman-footprint-benchmark");
+    auto &instance = environment.instance();
+    environment.listInputMethods();
+
+    malloc_trim(0);
+    auto heap = keymanHeapUsage();
+    auto rss = static_cast<int64_t>(keymanResidentKb());
+    if (!id.empty()) {
+        auto iter = engine.keyboards().find(id);
+        if (iter == engine.keyboards().end()) {
+            return sample;
+        }
+        iter->second->load();
+        if (!iter->second->ready()) {
+            return sample;
+        }
+        const auto loadedHeap = keymanHeapUsage();
+        const auto loadedRss = static_cast<int64_t>(keymanResidentKb());
+        sample.loadHeap = keymanHeapDelta(heap, loadedHeap);
+        sample.loadRssKb = loadedRss - rss;
+        heap = loadedHeap;
+        rss = loadedRss;
+    }
+    sample.loaded = true;
+
+    std::vector<std::unique_ptr<FakeInputContext>> ics;
+    for (size_t i = 0; i < numStateCounts; i++) {
+        while (ics.size() < stateCounts[i]) {
+            // Registered properties, including KeymanState, are created with
+            // the input context.
+            ics.push_back(std::make_unique<FakeInputContext>(
+                instance.inputContextManager(), false));
+        }
+        sample.stateHeap[i] = keymanHeapDelta(heap, keymanHeapUsage());
+        sample.stateRssKb[i] =
+            static_cast<int64_t>(keymanResidentKb()) - rss;
+    }
+    return sample;
+}
+
+bool runChild(KeymanBenchmarkEnvironment &environment, const std::string &id,
+              FootprintSample &sample) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return false;
+    }
+    const auto pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        const auto result = measure(environment, id);
+        fs::safeWrite(fds[1], &result, sizeof(result));
+        _exit(0);
+    }
+    close(fds[1]);
+    const bool success =
+        fs::safeRead(fds[0], &sample, sizeof(sample)) == sizeof(sample);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return success && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+           sample.loaded;
+}
+
+struct FootprintRow {
+    std::string id;
+    FootprintSample sample;
+};
+
+// Bytes per state after subtracting the input contexts.
+double heapPerState(const FootprintSample &sample,
+                    const FootprintSample &baseline, size_t i) {
+    return (static_cast<double>(sample.stateHeap[i]) -
+            static_cast<double>(baseline.stateHeap[i])) /
+           stateCounts[i];
+}
+
+double rssPerState(const FootprintSample &sample,
+                   const FootprintSample &baseline, size_t i) {
+    return static_cast<double>(sample.stateRssKb[i] - baseline.stateRssKb[i]) *
+           1024 / stateCounts[i];
+}
+
+void printTable(const std::vector<FootprintRow> &rows,
+                const FootprintSample &baseline) {
+    std::printf("%-32s %6s %12s %10s %12s %12s\n", "keyboard", "states",
+                "heap", "rss_kb", "heap/state", "rss/state");
+    for (size_t i = 0; i < numStateCounts; i++) {
+        std::printf("%-32s %6zu %12llu %10lld %12s %12s\n", "(input context)",
+                    stateCounts[i],
+                    static_cast<unsigned long long>(baseline.stateHeap[i]),
+                    static_cast<long long>(baseline.stateRssKb[i]), "-", "-");
+    }
+    for (const auto &row : rows) {
+        std::printf("%-32s %6s %12llu %10lld %12s %12s\n", row.id.data(),
+                    "load",
+                    static_cast<unsigned long long>(row.sample.loadHeap),
+                    static_cast<long long>(row.sample.loadRssKb), "-", "-");
+        for (size_t i = 0; i < numStateCounts; i++) {
+            std::printf(
+                "%-32s %6zu %12llu %10lld %12.0f %12.0f\n", row.id.data(),
+                stateCounts[i],
+                static_cast<unsigned long long>(row.sample.stateHeap[i]),
+                static_cast<long long>(row.sample.stateRssKb[i]),
+                heapPerState(row.sample, baseline, i),
+                rssPerState(row.sample, baseline, i));
+        }
+    }
+}
+
+// One JSON object per keyboard and line.
+void printJson(const std::vector<FootprintRow> &rows,
+               const FootprintSample &baseline) {
+    for (const auto &row : rows) {
+        std::printf("{\"keyboard\":\"%s\",\"load_heap\":%llu,"
+                    "\"load_rss_kb\":%lld,\"states\":[",
+                    row.id.data(),
+                    static_cast<unsigned long long>(row.sample.loadHeap),
+                    static_cast<long long>(row.sample.loadRssKb));
+        for (size_t i = 0; i < numStateCounts; i++) {
+            std::printf(
+                "%s{\"count\":%zu,\"heap\":%llu,\"rss_kb\":%lld,"
+                "\"heap_per_state\":%.0f,\"rss_per_state\":%.0f}",
+                i ? "," : "", stateCounts[i],
+                static_cast<unsigned long long>(row.sample.stateHeap[i]),
+                static_cast<long long>(row.sample.stateRssKb[i]),
+                heapPerState(row.sample, baseline, i),
+                rssPerState(row.sample, baseline, i));
+        }
+        std::printf("]}\n");
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    bool json = false;
+    std::string dir;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (argv[i][0] == '-' || !dir.empty()) {
+            std::fprintf(stderr, "Usage: %s [--json] DIR\n", argv[0]);
+            return 1;
+        } else {
+            dir = argv[i];
+        }
+    }
+    if (dir.empty()) {
+        std::fprintf(stderr, "Usage: %s [--json] DIR\n", argv[0]);
+        return 1;
+    }
+    nftw(dir.data(), collectKmx, 16, FTW_PHYS);
+    std::sort(kmxFiles.begin(), kmxFiles.end());
+
+    KeymanBenchmarkEnvironment environment;
+    std::vector<FootprintRow> rows;
+    for (const auto &kmx : kmxFiles) {
+        auto id = fs::baseName(kmx);
+        id.resize(id.size() - 4);
+        if (fs::isdir(
+                stringutils::joinPath(environment.dataDir(), "keyman", id))) {
+            std::fprintf(stderr, "Skipping %s, %s is already measured.\n",
+                         kmx.data(), id.data());
+            continue;
+        }
+        rows.push_back({environment.addKeyboard(kmx), {}});
+    }
+
+    FootprintSample baseline;
+    if (!runChild(environment, "", baseline)) {
+        std::fprintf(stderr, "Failed to measure input contexts.\n");
+        return 1;
+    }
+    std::vector<FootprintRow> measured;
+    for (auto &row : rows) {
+        if (!runChild(environment, row.id, row.sample)) {
+            std::fprintf(stderr, "Failed to load %s.\n", row.id.data());
+            continue;
+        }
+        measured.push_back(std::move(row));
+    }
+
+    if (json) {
+        printJson(measured, baseline);
+    } else {
+        printTable(measured, baseline);
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx/event.h>
+#include <fcitx/instance.h>
+#include "benchmark.h"
+#include "coreutils.h"
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "fixturekeys.h"
+
+using namespace fcitx;
+
+namespace {
+
+// Minimum time spent in each benchmark, in nanoseconds.
+constexpr uint64_t defaultMinTime = 200000000ULL;
+// Keep the committed text small, so growing it does not allocate.
+constexpr size_t maxCommittedText = 4096;
+
+volatile size_t benchmarkSink;
+
+struct KeymanBenchmarkFixture {
+    // Keyboard id, also the directory and kmx file name.
+    const char *id;
+    // Typed repeatedly by the benchmarks.
+    const char *sequence;
+};
+
+// Sources are under fixtures.
+const KeymanBenchmarkFixture fixtures[] = {
+    // One character to one character.
+    {"fixture_simple", "asdfjkl"},
+    // A dead key followed by a vowel.
+    {"fixture_deadkey", "`a`e`i`o`u"},
+    // Rules that match up to 12 characters of context.
+    {"fixture_longcontext", "abcdefghijkl"},
+};
+
+void benchmarkUTF(KeymanBenchmarkRunner &runner) {
+    // ASCII, BMP and supplementary characters, about the size of a context.
+    const std::string text =
+        "keyman ஆங்கிலம் 한국어 ᐃᓄᒃᑎᑐᑦ 𝒳𝒴𝒵 𐌰𐌱𐌲 ab";
+    const auto utf16 = utf8ToUTF16(text);
+    runner.run("utf8ToUTF16",
+               [&text](uint64_t) { benchmarkSink = utf8ToUTF16(text).size(); });
+    runner.run("utf16ToUTF8", [&utf16](uint64_t) {
+        benchmarkSink =
+            utf16ToUTF8(utf16.begin(), std::prev(utf16.end())).size();
+    });
+}
+
+void benchmarkKeyEvent(KeymanBenchmarkRunner &runner, Instance &instance,
+                       KeymanEngine &engine, const InputMethodEntry &entry,
+                       const KeymanBenchmarkFixture &fixture,
+                       bool surroundingText) {
+    const auto prefix = stringutils::concat(
+        fixture.id, surroundingText ? "/surrounding/" : "/plain/");
+    std::vector<Key> keys;
+    for (const char *c = fixture.sequence; *c; c++) {
+        keys.push_back(keymanFixtureKey(*c));
+    }
+    const auto backspace = keymanFixtureKey('\b');
+    const auto left = keymanFixtureKey('<');
+
+    FakeInputContext ic(instance.inputContextManager(), surroundingText);
+    InputContextEvent activateEvent(&ic,
+                                    EventType::InputContextSwitchInputMethod);
+    engine.activate(entry, activateEvent);
+
+    auto send = [&](const Key &key, bool isRelease) {
+        KeyEvent event(&ic, key, isRelease);
+        engine.keyEvent(entry, event);
+        ic.applyKey(event);
+    };
+    auto type = [&](uint64_t i) {
+        if (ic.committed().size() > maxCommittedText) {
+            ic.clearCommitted();
+        }
+        send(keys[i % keys.size()], false);
+    };
+
+    runner.run(
+        prefix + "press",
+        [&](uint64_t) {
+            if (ic.committed().size() > maxCommittedText) {
+                ic.clearCommitted();
+            }
+        },
+        [&](uint64_t i) { send(keys[i % keys.size()], false); });
+    runner.run(prefix + "release", type, [&](uint64_t i) {
+        send(keys[i % keys.size()], true);
+    });
+    runner.run(prefix + "backspace", type,
+               [&](uint64_t) { send(backspace, false); });
+    runner.run(prefix + "cursor-move", type,
+               [&](uint64_t) { send(left, false); });
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::string filter;
+    bool json = false;
+    uint64_t minTime = defaultMinTime;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (std::strncmp(argv[i], "--min-time=", 11) == 0) {
+            minTime = std::strtoull(argv[i] + 11, nullptr, 10) * 1000000;
+        } else if (argv[i][0] == '-') {
+            std::fprintf(stderr,
+                         "Usage: %s [--json] [--min-time=MS] [FILTER]\n",
+                         argv[0]);
+            return 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    KeymanBenchmarkEnvironment environment(KEYMAN_BENCHMARK_DATA_DIR);
+    KeymanBenchmarkRunner runner(filter, minTime);
+    benchmarkUTF(runner);
+
+    auto &engine = environment.createEngine("fcitx5-keyman-benchmark");
+    auto &instance = environment.instance();
+    environment.listInputMethods();
+    for (const auto &fixture : fixtures) {
+        const auto *entry = environment.findEntry(fixture.id);
+        if (!entry || !environment.fixtureBuilt(fixture.id)) {
+            std::fprintf(stderr, "Skipping %s, %s is not built.\n",
+                         fixture.id, environment.fixtureKmx(fixture.id).data());
+            continue;
+        }
+        for (const bool surroundingText : {false, true}) {
+            benchmarkKeyEvent(runner, instance, engine, *entry, fixture,
+                              surroundingText);
+        }
+    }
+
+    if (json) {
+        runner.printJson(stdout);
+    } else {
+        runner.print(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,382 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx-utils/utf8.h>
+#include <fcitx/event.h>
+#include <fcitx/instance.h>
+#include <keyman_core_api.h>
+#include "benchmark.h"
+#include "coreutils.h"
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "fixturekeys.h"
+#include "kmpdata.h"
+#include "transliterator.h"
+#include "worker.h"
+
+// Compare the cost of a key in KeymanEngine::keyEvent with the cost of the
+// bare km_core_process_event and km_core_state_get_actions, for the same key
+// sequences. The outputs of both paths are checked to be the same before
+// timing. KeymanTransliterator, used by the Transliterate D-Bus method, is
+// compared with the bare core typing a whole sequence.
+
+using namespace fcitx;
+
+namespace {
+
+// Minimum time spent in each benchmark, in nanoseconds.
+constexpr uint64_t defaultMinTime = 200000000ULL;
+// Fail if the engine is slower than the bare core by more than this.
+constexpr double defaultMaxRatio = 3.0;
+constexpr size_t maxCommittedText = 4096;
+
+volatile size_t benchmarkSink;
+
+struct KeymanOverheadFixture {
+    const char *id;
+    // Typed repeatedly by the benchmarks.
+    const char *sequence;
+    // Typed once to check that both paths give the same output.
+    const char *check;
+};
+
+const KeymanOverheadFixture fixtures[] = {
+    {"fixture_simple", "asdfjkl", "asdf\b\bjkl"},
+    {"fixture_deadkey", "`a`e`i`o`u", "`a``e`\b`u\b\bo"},
+    {"fixture_longcontext", "abcdefghijkl", "abcdefghijklabcdefhlxxq\b"},
+};
+
+// A key with press and release.
+struct KeymanOverheadKey {
+    Key key;
+    bool isRelease;
+};
+
+std::vector<KeymanOverheadKey> keySequence(const char *sequence) {
+    std::vector<KeymanOverheadKey> keys;
+    for (const char *c = sequence; *c; c++) {
+        keys.push_back({keymanFixtureKey(*c), false});
+        keys.push_back({keymanFixtureKey(*c), true});
+    }
+    return keys;
+}
+
+std::vector<KeymanKeyStroke> strokeSequence(const char *sequence) {
+    std::vector<KeymanKeyStroke> keys;
+    for (const char *c = sequence; *c; c++) {
+        const auto key = keymanFixtureKey(*c);
+        keys.push_back({keycode_to_vk[key.code() - 8], 0});
+    }
+    return keys;
+}
+
+// Bare keyman core, with the text of the application modelled the same way as
+// FakeInputContext does with surrounding text.
+class KeymanCoreSession {
+public:
+    KeymanCoreSession(km_core_keyboard *keyboard) {
+        keymanCreateState(keyboard, &state_);
+    }
+    ~KeymanCoreSession() {
+        if (state_) {
+            km_core_state_dispose(state_);
+        }
+    }
+
+    bool valid() const { return state_; }
+
+    void clear() { km_core_state_context_clear(state_); }
+
+    // The part of engine that this replaces.
+    const km_core_actions *process(const Key &key, bool isRelease) {
+        km_core_process_event(state_, keycode_to_vk[key.code() - 8], 0,
+                              !isRelease, 0);
+        return km_core_state_get_actions(state_);
+    }
+
+    void type(const Key &key, bool isRelease) {
+        actions_.assign(process(key, isRelease));
+        const bool backspace = key.check(FcitxKey_BackSpace);
+        auto deleteCount = actions_.deleteCount;
+        if (deleteCount == 1 && backspace) {
+            // Passed to the application by the engine.
+            actions_.emitKeystroke = true;
+            deleteCount = 0;
+        }
+        text_.resize(text_.size() -
+                     std::min<size_t>(deleteCount, text_.size()));
+        for (auto c : actions_.output) {
+            text_.push_back(c);
+            committed_.append(utf8::UCS4ToUTF8(c));
+        }
+        if (actions_.emitKeystroke && backspace && !isRelease &&
+            !text_.empty()) {
+            text_.pop_back();
+        }
+    }
+
+    std::string text() const {
+        std::string result;
+        for (auto c : text_) {
+            result.append(utf8::UCS4ToUTF8(c));
+        }
+        return result;
+    }
+    const std::string &committed() const { return committed_; }
+
+private:
+    km_core_state *state_ = nullptr;
+    KeymanActions actions_;
+    std::vector<uint32_t> text_;
+    std::string committed_;
+};
+
+void sendKey(KeymanEngine &engine, const InputMethodEntry &entry,
+             FakeInputContext &ic, const Key &key, bool isRelease) {
+    KeyEvent event(&ic, key, isRelease);
+    engine.keyEvent(entry, event);
+    ic.applyKey(event);
+}
+
+// Return false if the output of engine and core differ.
+bool checkOutput(Instance &instance, KeymanEngine &engine,
+                 const InputMethodEntry &entry, km_core_keyboard *keyboard,
+                 const KeymanOverheadFixture &fixture) {
+    const auto keys = keySequence(fixture.check);
+    bool result = true;
+    for (const bool surroundingText : {false, true}) {
+        FakeInputContext ic(instance.inputContextManager(), surroundingText);
+        InputContextEvent event(&ic, EventType::InputContextSwitchInputMethod);
+        engine.activate(entry, event);
+        KeymanCoreSession core(keyboard);
+        if (!core.valid()) {
+            return false;
+        }
+        for (const auto &key : keys) {
+            sendKey(engine, entry, ic, key.key, key.isRelease);
+            core.type(key.key, key.isRelease);
+        }
+        if (ic.committed() != core.committed()) {
+            std::fprintf(stderr, "%s: committed \"%s\", expected \"%s\"\n",
+                         fixture.id, ic.committed().data(),
+                         core.committed().data());
+            result = false;
+        }
+        if (surroundingText && ic.surroundingText().text() != core.text()) {
+            std::fprintf(stderr, "%s: text \"%s\", expected \"%s\"\n",
+                         fixture.id, ic.surroundingText().text().data(),
+                         core.text().data());
+            result = false;
+        }
+    }
+    KeymanCoreSession core(keyboard);
+    KeymanTransliterator transliterator(keyboard, nullptr);
+    if (!core.valid() || !transliterator.valid()) {
+        return false;
+    }
+    for (const auto &key : keys) {
+        core.type(key.key, key.isRelease);
+    }
+    const auto strokes = strokeSequence(fixture.check);
+    const auto &text = transliterator.run("", strokes.data(), strokes.size());
+    if (text != core.text()) {
+        std::fprintf(stderr, "%s: transliterated \"%s\", expected \"%s\"\n",
+                     fixture.id, text.data(), core.text().data());
+        result = false;
+    }
+    return result;
+}
+
+void benchmarkEngine(KeymanBenchmarkRunner &runner, Instance &instance,
+                     KeymanEngine &engine, const InputMethodEntry &entry,
+                     const KeymanOverheadFixture &fixture,
+                     bool surroundingText) {
+    const auto prefix = stringutils::concat(
+        fixture.id, surroundingText ? "/surrounding/" : "/plain/");
+    const auto keys = keySequence(fixture.sequence);
+    const auto backspace = keymanFixtureKey('\b');
+
+    FakeInputContext ic(instance.inputContextManager(), surroundingText);
+    InputContextEvent event(&ic, EventType::InputContextSwitchInputMethod);
+    engine.activate(entry, event);
+    auto type = [&](uint64_t i) {
+        if (ic.committed().size() > maxCommittedText) {
+            ic.clearCommitted();
+        }
+        const auto &key = keys[i % keys.size()];
+        sendKey(engine, entry, ic, key.key, key.isRelease);
+    };
+    runner.run(prefix + "type", type);
+    runner.run(prefix + "backspace", type, [&](uint64_t) {
+        sendKey(engine, entry, ic, backspace, false);
+    });
+}
+
+void benchmarkCore(KeymanBenchmarkRunner &runner, km_core_keyboard *keyboard,
+                   const KeymanOverheadFixture &fixture) {
+    const auto prefix = stringutils::concat(fixture.id, "/core/");
+    const auto keys = keySequence(fixture.sequence);
+    const auto backspace = keymanFixtureKey('\b');
+
+    KeymanCoreSession core(keyboard);
+    if (!core.valid()) {
+        return;
+    }
+    auto type = [&](uint64_t i) {
+        const auto &key = keys[i % keys.size()];
+        benchmarkSink =
+            core.process(key.key, key.isRelease)->code_points_to_delete;
+    };
+    runner.run(prefix + "type", type);
+    runner.run(prefix + "backspace", type, [&](uint64_t) {
+        benchmarkSink =
+            core.process(backspace, false)->code_points_to_delete;
+    });
+    // The whole sequence from an empty context, as the transliterator does.
+    runner.run(prefix + "sequence", [&](uint64_t) {
+        core.clear();
+        for (const auto &key : keys) {
+            benchmarkSink =
+                core.process(key.key, key.isRelease)->code_points_to_delete;
+        }
+    });
+}
+
+void benchmarkTransliterator(KeymanBenchmarkRunner &runner,
+                             km_core_keyboard *keyboard,
+                             const KeymanOverheadFixture &fixture) {
+    const auto strokes = strokeSequence(fixture.sequence);
+    KeymanTransliterator transliterator(keyboard, nullptr);
+    if (!transliterator.valid()) {
+        return;
+    }
+    runner.run(stringutils::concat(fixture.id, "/transliterate/sequence"),
+               [&](uint64_t) {
+                   benchmarkSink =
+                       transliterator.run("", strokes.data(), strokes.size())
+                           .size();
+               });
+}
+
+const KeymanBenchmarkResult *findResult(const KeymanBenchmarkRunner &runner,
+                                        const std::string &name) {
+    for (const auto &result : runner.results()) {
+        if (result.name == name) {
+            return &result;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::string filter;
+    bool json = false;
+    uint64_t minTime = defaultMinTime;
+    double maxRatio = defaultMaxRatio;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (std::strncmp(argv[i], "--min-time=", 11) == 0) {
+            minTime = std::strtoull(argv[i] + 11, nullptr, 10) * 1000000;
+        } else if (std::strncmp(argv[i], "--max-ratio=", 12) == 0) {
+            maxRatio = std::strtod(argv[i] + 12, nullptr);
+        } else if (argv[i][0] == '-') {
+            std::fprintf(stderr,
+                         "Usage: %s [--json] [--min-time=MS] "
+                         "[--max-ratio=RATIO] [FILTER]\n",
+                         argv[0]);
+            return 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    KeymanBenchmarkEnvironment environment(KEYMAN_BENCHMARK_DATA_DIR);
+    KeymanBenchmarkRunner runner(filter, minTime);
+
+    auto &engine =
+        environment.createEngine("fcitx5-keyman-overhead-benchmark");
+    auto &instance = environment.instance();
+    environment.listInputMethods();
+    bool failed = false;
+    std::vector<const KeymanOverheadFixture *> measured;
+    for (const auto &fixture : fixtures) {
+        const auto kmx = environment.fixtureKmx(fixture.id);
+        const auto *entry = environment.findEntry(fixture.id);
+        km_core_keyboard *keyboard = nullptr;
+        if (!entry || !environment.fixtureBuilt(fixture.id) ||
+            km_core_keyboard_load(kmx.data(), &keyboard) != KM_CORE_STATUS_OK) {
+            std::fprintf(stderr, "Skipping %s, %s is not built.\n",
+                         fixture.id, kmx.data());
+            continue;
+        }
+        if (checkOutput(instance, engine, *entry, keyboard, fixture)) {
+            benchmarkCore(runner, keyboard, fixture);
+            benchmarkTransliterator(runner, keyboard, fixture);
+            for (const bool surroundingText : {false, true}) {
+                benchmarkEngine(runner, instance, engine, *entry, fixture,
+                                surroundingText);
+            }
+            measured.push_back(&fixture);
+        } else {
+            failed = true;
+        }
+        km_core_keyboard_dispose(keyboard);
+    }
+
+    if (json) {
+        runner.printJson(stdout);
+    } else {
+        runner.print(stdout);
+        std::fprintf(stdout, "\n%-44s %10s %10s %10s\n", "scenario",
+                     "engine", "core", "ratio");
+    }
+    auto report = [&](const std::string &name, const std::string &coreName) {
+        const auto *engineResult = findResult(runner, name);
+        const auto *coreResult = findResult(runner, coreName);
+        if (!engineResult || !coreResult || !coreResult->nsPerOp()) {
+            return;
+        }
+        const auto ratio = engineResult->nsPerOp() / coreResult->nsPerOp();
+        const bool regressed = ratio > maxRatio;
+        failed = failed || regressed;
+        if (json) {
+            std::fprintf(stdout,
+                         "{\"name\":\"%s\",\"overhead_ratio\":%.2f,"
+                         "\"regressed\":%s}\n",
+                         name.data(), ratio, regressed ? "true" : "false");
+        } else {
+            std::fprintf(stdout, "%-44s %10.0f %10.0f %9.2fx%s\n",
+                         name.data(), engineResult->nsPerOp(),
+                         coreResult->nsPerOp(), ratio,
+                         regressed ? " REGRESSED" : "");
+        }
+    };
+    for (const auto *fixture : measured) {
+        for (const char *mode : {"plain", "surrounding"}) {
+            for (const char *scenario : {"type", "backspace"}) {
+                report(
+                    stringutils::concat(fixture->id, "/", mode, "/", scenario),
+                    stringutils::concat(fixture->id, "/core/", scenario));
+            }
+        }
+        report(stringutils::concat(fixture->id, "/transliterate/sequence"),
+               stringutils::concat(fixture->id, "/core/sequence"));
+    }
+    return failed ? 1 : 0;
+}
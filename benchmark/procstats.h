@@ -0,0 +1,70 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_BENCHMARK_PROCSTATS_H_
+#define _FCITX5_KEYMAN_BENCHMARK_PROCSTATS_H_
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+namespace fcitx {
+
+// Resident set size of the process in KiB, 0 if unknown.
+inline uint64_t keymanResidentKb() {
+    auto *file = std::fopen("/proc/self/statm", "r");
+    if (!file) {
+        return 0;
+    }
+    unsigned long long size = 0, resident = 0;
+    const auto read = std::fscanf(file, "%llu %llu", &size, &resident);
+    std::fclose(file);
+    if (read != 2) {
+        return 0;
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Peak resident set size of the process in KiB.
+inline uint64_t keymanPeakResidentKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// I/O counters from /proc/self/io.
+struct KeymanIoStats {
+    uint64_t readBytes = 0;
+    uint64_t readCalls = 0;
+    uint64_t writeCalls = 0;
+
+    static KeymanIoStats current() {
+        KeymanIoStats stats;
+        auto *file = std::fopen("/proc/self/io", "r");
+        if (!file) {
+            return stats;
+        }
+        char name[32];
+        unsigned long long value;
+        while (std::fscanf(file, "%31s %llu", name, &value) == 2) {
+            if (std::strcmp(name, "rchar:") == 0) {
+                stats.readBytes = value;
+            } else if (std::strcmp(name, "syscr:") == 0) {
+                stats.readCalls = value;
+            } else if (std::strcmp(name, "syscw:") == 0) {
+                stats.writeCalls = value;
+            }
+        }
+        std::fclose(file);
+        return stats;
+    }
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_BENCHMARK_PROCSTATS_H_
@@ -0,0 +1,155 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx/event.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "recorder.h"
+#include "stats.h"
+
+// Replay a trace recorded with FCITX_KEYMAN_RECORD against a kmx file as
+// fast as possible.
+
+using namespace fcitx;
+
+namespace {
+
+void usage(const char *name) {
+    std::fprintf(stderr, "Usage: %s [--quiet] KMX TRACE\n", name);
+}
+
+double toMs(uint64_t ns) { return ns / 1000000.0; }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    bool quiet = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quiet") == 0) {
+            quiet = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.size() != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::ifstream traceFile(files[1], std::ios::binary);
+    if (!traceFile) {
+        std::fprintf(stderr, "Failed to open %s\n", files[1].data());
+        return 1;
+    }
+    std::vector<KeymanTraceEvent> events;
+    // Input context id to whether it supports surrounding text.
+    std::map<uint32_t, bool> contexts;
+    try {
+        KeymanTraceReader reader(
+            std::string(std::istreambuf_iterator<char>(traceFile), {}));
+        KeymanTraceEvent event;
+        while (reader.next(event)) {
+            contexts[event.context] |=
+                event.type == KeymanTraceType::SurroundingText ||
+                (event.flags & KeymanTraceEvent::HasSurroundingText);
+            events.push_back(std::move(event));
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s: %s\n", files[1].data(), e.what());
+        return 1;
+    }
+
+    KeymanBenchmarkEnvironment environment;
+    const auto id = environment.addKeyboard(files[0]);
+    auto &engine = environment.createEngine("fcitx5-keyman-replay");
+    auto &instance = environment.instance();
+    environment.listInputMethods();
+    const auto *found = environment.findEntry(id);
+    if (!found) {
+        std::fprintf(stderr, "Failed to load %s\n", files[0].data());
+        return 1;
+    }
+    const auto &entry = *found;
+
+    std::map<uint32_t, std::unique_ptr<FakeInputContext>> ics;
+    for (const auto &[context, surroundingText] : contexts) {
+        auto &ic = ics[context];
+        ic = std::make_unique<FakeInputContext>(instance.inputContextManager(),
+                                                surroundingText);
+        InputContextEvent event(ic.get(),
+                                EventType::InputContextSwitchInputMethod);
+        engine.activate(entry, event);
+    }
+
+    KeymanLatencyHistogram latency;
+    uint64_t total = 0;
+    for (const auto &event : events) {
+        auto &ic = *ics[event.context];
+        switch (event.type) {
+        case KeymanTraceType::Key: {
+            KeyEvent keyEvent(&ic,
+                              Key(static_cast<KeySym>(event.sym),
+                                  KeyStates(event.states), event.code),
+                              event.flags & KeymanTraceEvent::Release);
+            const auto start = keymanNow();
+            engine.keyEvent(entry, keyEvent);
+            const auto duration = keymanNow() - start;
+            latency.record(duration);
+            total += duration;
+            ic.applyKey(keyEvent);
+            break;
+        }
+        case KeymanTraceType::SurroundingText:
+            ic.surroundingText().setText(event.text, event.cursor,
+                                         event.anchor);
+            break;
+        case KeymanTraceType::Reset: {
+            InputContextEvent resetEvent(&ic, EventType::InputContextReset);
+            engine.reset(entry, resetEvent);
+            break;
+        }
+        }
+    }
+
+    const auto recorded = events.empty() ? 0 : events.back().timestamp;
+    std::printf("keyboard: %s\n", id.data());
+    std::printf("events: %zu, keys: %llu, input contexts: %zu\n",
+                events.size(),
+                static_cast<unsigned long long>(latency.count()), ics.size());
+    std::printf("recorded: %.1fms, replayed: %.3fms, %.0f keys/s\n",
+                toMs(recorded), toMs(total),
+                total ? latency.count() * 1e9 / total : 0.0);
+    std::printf("latency (ns): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+                static_cast<unsigned long long>(latency.percentile(50)),
+                static_cast<unsigned long long>(latency.percentile(90)),
+                static_cast<unsigned long long>(latency.percentile(99)),
+                static_cast<unsigned long long>(latency.max()));
+    if (!quiet) {
+        for (const auto &[context, ic] : ics) {
+            std::printf("committed[%u]: %s\n", context,
+                        ic->committed().data());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_FIXTURES_FIXTUREKEYS_H_
+#define _FCITX5_KEYMAN_FIXTURES_FIXTUREKEYS_H_
+
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/keysym.h>
+
+namespace fcitx {
+
+// Key of a character in the US layout with its X11 key code, since the engine
+// only looks at the key code. '\b' is BackSpace and '<' is Left, other
+// characters are typed as the grave key.
+inline Key keymanFixtureKey(char c) {
+    static const int letterCodes[] = {30, 48, 46, 32, 18, 33, 34, 35, 23,
+                                      36, 37, 38, 50, 49, 24, 25, 16, 19,
+                                      31, 20, 22, 47, 17, 45, 21, 44};
+    // Offset between evdev and X11 key codes.
+    constexpr int evdevOffset = 8;
+    if (c >= 'a' && c <= 'z') {
+        return Key(static_cast<KeySym>(c), KeyStates(),
+                   letterCodes[c - 'a'] + evdevOffset);
+    }
+    if (c == '\b') {
+        return Key(FcitxKey_BackSpace, KeyStates(), 14 + evdevOffset);
+    }
+    if (c == '<') {
+        return Key(FcitxKey_Left, KeyStates(), 105 + evdevOffset);
+    }
+    return Key(FcitxKey_grave, KeyStates(), 41 + evdevOffset);
+}
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_FIXTURES_FIXTUREKEYS_H_
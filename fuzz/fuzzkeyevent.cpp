@@ -0,0 +1,238 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <time.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/utf8.h>
+#include <fcitx/event.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "fixturekeys.h"
+
+// Fuzz KeymanEngine::keyEvent with sequences of keys, modifiers, releases and
+// surrounding text against the fixture keyboards. A key event that takes more
+// CPU time than KEYMAN_FUZZ_EVENT_BUDGET_MS (20 by default) is reported as a
+// crash, so libFuzzer minimizes and saves it like a crash.
+//
+// Input is a program, one operation per byte, so printable seeds read like
+// typing:
+// - a-z, ` and \b and <: press and release the key, see keymanFixtureKey.
+// - S, C, A, R, G: toggle left shift, left ctrl, left alt, right ctrl and
+//   right alt. The change is sent as a press or release key event.
+// - ^ and !: the next key is only pressed or only released.
+// - T, length, cursor, bytes: set surrounding text.
+// - P: toggle surrounding text capability.
+// - K, index: switch to another keyboard.
+// - X: reset.
+// - Other bytes: press and release an unknown key with that key code.
+
+using namespace fcitx;
+
+namespace {
+
+constexpr uint64_t defaultEventBudgetMs = 20;
+constexpr const char *fixtures[] = {"fixture_simple", "fixture_deadkey",
+                                    "fixture_longcontext"};
+
+struct Modifier {
+    char op;
+    // X11 key code.
+    int code;
+    KeySym sym;
+    KeyState state;
+};
+
+const Modifier modifiers[] = {
+    {'S', 50, FcitxKey_Shift_L, KeyState::Shift},
+    {'C', 37, FcitxKey_Control_L, KeyState::Ctrl},
+    {'A', 64, FcitxKey_Alt_L, KeyState::Alt},
+    {'R', 105, FcitxKey_Control_R, KeyState::Ctrl},
+    {'G', 108, FcitxKey_ISO_Level3_Shift, KeyState::Mod5},
+};
+
+struct FuzzContext {
+    std::unique_ptr<KeymanBenchmarkEnvironment> environment;
+    Instance *instance = nullptr;
+    KeymanEngine *engine = nullptr;
+    std::vector<const InputMethodEntry *> entries;
+    uint64_t eventBudget = 0;
+};
+
+FuzzContext *context;
+
+uint64_t threadCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+class KeySequence {
+public:
+    KeySequence(const uint8_t *data, size_t size)
+        : data_(data), size_(size) {}
+
+    void run() {
+        ic_ = std::make_unique<FakeInputContext>(
+            context->instance->inputContextManager(), false);
+        activate(0);
+        while (offset_ < size_) {
+            step(data_[offset_++]);
+        }
+        ic_.reset();
+    }
+
+private:
+    uint8_t next() { return offset_ < size_ ? data_[offset_++] : 0; }
+
+    const InputMethodEntry &entry() const {
+        return *context->entries[entryIndex_];
+    }
+
+    void activate(size_t index) {
+        InputContextEvent event(ic_.get(),
+                                EventType::InputContextSwitchInputMethod);
+        if (active_) {
+            context->engine->deactivate(entry(), event);
+        }
+        entryIndex_ = index % context->entries.size();
+        context->engine->activate(entry(), event);
+        active_ = true;
+    }
+
+    void send(const Key &key, bool isRelease) {
+        KeyEvent event(ic_.get(), Key(key.sym(), states_, key.code()),
+                       isRelease);
+        const auto start = threadCpuTime();
+        context->engine->keyEvent(entry(), event);
+        const auto duration = threadCpuTime() - start;
+        if (duration > context->eventBudget) {
+            std::fprintf(stderr,
+                         "Key event %s (release: %d) at %zu took %llu us\n",
+                         key.toString().data(), isRelease, offset_ - 1,
+                         static_cast<unsigned long long>(duration / 1000));
+            std::abort();
+        }
+        ic_->applyKey(event);
+    }
+
+    void type(const Key &key) {
+        if (mode_ != '!') {
+            send(key, false);
+        }
+        if (mode_ != '^') {
+            send(key, true);
+        }
+        mode_ = 0;
+    }
+
+    void setSurroundingText() {
+        const size_t length = next();
+        std::string text;
+        for (size_t i = 0; i < length && offset_ < size_; i++) {
+            text.push_back(static_cast<char>(next()));
+        }
+        if (!utf8::validate(text)) {
+            for (auto &c : text) {
+                c = 'a' + static_cast<uint8_t>(c) % 26;
+            }
+        }
+        const auto textLength = utf8::length(text);
+        const auto cursor = next() % (textLength + 1);
+        ic_->surroundingText().setText(text, cursor, cursor);
+    }
+
+    void step(uint8_t op) {
+        for (const auto &modifier : modifiers) {
+            if (op == modifier.op) {
+                const bool pressed = states_.test(modifier.state);
+                // The state of a modifier key event does not include itself.
+                send(Key(modifier.sym, KeyStates(), modifier.code), pressed);
+                states_ = pressed ? states_.unset(modifier.state)
+                                  : states_ | modifier.state;
+                return;
+            }
+        }
+        switch (op) {
+        case '^':
+        case '!':
+            mode_ = op;
+            break;
+        case 'T':
+            setSurroundingText();
+            break;
+        case 'P':
+            ic_->setCapabilityFlags(ic_->capabilityFlags() ^
+                                    CapabilityFlag::SurroundingText);
+            break;
+        case 'K':
+            activate(next());
+            break;
+        case 'X': {
+            InputContextEvent event(ic_.get(), EventType::InputContextReset);
+            context->engine->reset(entry(), event);
+            break;
+        }
+        default:
+            if ((op >= 'a' && op <= 'z') || op == '`' || op == '\b' ||
+                op == '<') {
+                type(keymanFixtureKey(op));
+            } else {
+                type(Key(FcitxKey_None, KeyStates(), op));
+            }
+            break;
+        }
+    }
+
+    const uint8_t *data_;
+    size_t size_;
+    size_t offset_ = 0;
+    std::unique_ptr<FakeInputContext> ic_;
+    size_t entryIndex_ = 0;
+    bool active_ = false;
+    KeyStates states_;
+    char mode_ = 0;
+};
+
+} // namespace
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+    context = new FuzzContext;
+    context->environment =
+        std::make_unique<KeymanBenchmarkEnvironment>(KEYMAN_FIXTURE_DATA_DIR);
+    const char *value = getenv("KEYMAN_FUZZ_EVENT_BUDGET_MS");
+    const auto ms = value ? std::strtoull(value, nullptr, 10) : 0;
+    context->eventBudget = (ms ? ms : defaultEventBudgetMs) * 1000000;
+
+    auto &environment = *context->environment;
+    context->engine = &environment.createEngine("fuzz-keyevent");
+    context->instance = &environment.instance();
+    environment.listInputMethods();
+    for (const auto *fixture : fixtures) {
+        const auto *entry = environment.findEntry(fixture);
+        if (entry && environment.fixtureBuilt(fixture)) {
+            context->entries.push_back(entry);
+        }
+    }
+    if (context->entries.empty()) {
+        std::fprintf(stderr, "Fixture keyboards are not built.\n");
+        std::exit(keymanSkipReturnCode);
+    }
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    KeySequence(data, size).run();
+    return 0;
+}
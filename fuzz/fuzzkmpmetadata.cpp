@@ -0,0 +1,84 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/unixfd.h>
+#include "kmpmetadata.h"
+#include "stats.h"
+
+// Fuzz KmpMetadata, inputs that are parsed slower than the time budget, or
+// are kept with more memory than the memory budget, are reported as crashes.
+//
+// The time budget can be changed with KEYMAN_FUZZ_TIME_BUDGET_MS. Transient
+// memory is limited by -malloc_limit_mb and -rss_limit_mb of libFuzzer.
+
+using namespace fcitx;
+
+namespace {
+
+constexpr uint64_t defaultTimeBudgetMs = 50;
+// Memory kept by the metadata, relative to the input size.
+constexpr size_t memoryBudgetPerByte = 32;
+constexpr size_t memoryBudgetBase = 65536;
+
+uint64_t timeBudget() {
+    static const uint64_t budget = []() {
+        const char *value = getenv("KEYMAN_FUZZ_TIME_BUDGET_MS");
+        const auto ms = value ? std::strtoull(value, nullptr, 10) : 0;
+        return (ms ? ms : defaultTimeBudgetMs) * 1000000;
+    }();
+    return budget;
+}
+
+// Return the time spent on parsing.
+uint64_t parse(const uint8_t *data, size_t size, size_t &memoryUsage) {
+    UnixFD fd = UnixFD::own(memfd_create("kmp.json", MFD_CLOEXEC));
+    if (!fd.isValid() ||
+        fs::safeWrite(fd.fd(), data, size) != static_cast<ssize_t>(size) ||
+        lseek(fd.fd(), 0, SEEK_SET) != 0) {
+        std::abort();
+    }
+    memoryUsage = 0;
+    const auto start = keymanNow();
+    try {
+        KmpMetadata metadata(fd.fd());
+        memoryUsage = metadata.memoryUsage();
+    } catch (const std::runtime_error &) {
+    }
+    return keymanNow() - start;
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    size_t memoryUsage;
+    auto duration = parse(data, size, memoryUsage);
+    if (duration > timeBudget()) {
+        // Parse again in case the process was preempted.
+        duration = std::min(duration, parse(data, size, memoryUsage));
+    }
+    if (duration > timeBudget()) {
+        std::fprintf(stderr,
+                     "Parsing %zu bytes took %llu us, budget is %llu us\n",
+                     size, static_cast<unsigned long long>(duration / 1000),
+                     static_cast<unsigned long long>(timeBudget() / 1000));
+        std::abort();
+    }
+    if (memoryUsage > memoryBudgetBase + size * memoryBudgetPerByte) {
+        std::fprintf(stderr, "Parsing %zu bytes keeps %zu bytes\n", size,
+                     memoryUsage);
+        std::abort();
+    }
+    return 0;
+}
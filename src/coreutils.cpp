@@ -0,0 +1,73 @@
+/*
+ * SPDX-FileCopyrightText: 2018 SIL International
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "coreutils.h"
+#include "keymanlog.h"
+
+namespace fcitx {
+
+km_core_status keymanCreateState(km_core_keyboard *keyboard,
+                                 km_core_state **state) {
+    std::vector<km_core_option_item> keyboard_opts;
+
+    keyboard_opts.emplace_back();
+    keyboard_opts.back().scope = KM_CORE_OPT_ENVIRONMENT;
+    const auto platform = utf8ToUTF16("platform");
+    keyboard_opts.back().key = platform.data();
+    const auto platformValue = utf8ToUTF16("linux desktop hardware native");
+    keyboard_opts.back().value = platformValue.data();
+
+    keyboard_opts.emplace_back();
+    keyboard_opts.back().scope = KM_CORE_OPT_ENVIRONMENT;
+    const auto baseLayout = utf8ToUTF16("baseLayout");
+    keyboard_opts.back().key = baseLayout.data();
+    const auto baseLayoutValue = utf8ToUTF16("kbdus.dll");
+    keyboard_opts.back().value = baseLayoutValue.data();
+
+    keyboard_opts.emplace_back();
+    keyboard_opts.back().scope = KM_CORE_OPT_ENVIRONMENT;
+    const auto baseLayoutAlt = utf8ToUTF16("baseLayoutAlt");
+    keyboard_opts.back().key = baseLayoutAlt.data();
+    const auto baseLayoutAltValue = utf8ToUTF16("en-US");
+    keyboard_opts.back().value = baseLayoutAltValue.data();
+
+    keyboard_opts.emplace_back();
+    keyboard_opts.back().scope = 0;
+    keyboard_opts.back().key = nullptr;
+    keyboard_opts.back().value = nullptr;
+    return km_core_state_create(keyboard, keyboard_opts.data(), state);
+}
+
+void updateKeyboardOptions(km_core_state *state, const KeymanOptions &options) {
+    std::vector<std::vector<char16_t>> strings;
+    std::vector<km_core_option_item> items;
+    strings.reserve(options.size() * 2);
+    for (const auto &[key, value] : options) {
+        const auto &utf16Key = strings.emplace_back(utf8ToUTF16(key));
+        const auto &utf16Value = strings.emplace_back(utf8ToUTF16(value));
+        if (utf16Key.empty() || utf16Value.empty()) {
+            continue;
+        }
+        items.emplace_back();
+        items.back().scope = KM_CORE_OPT_KEYBOARD;
+        items.back().key = utf16Key.data();
+        items.back().value = utf16Value.data();
+    }
+    if (items.empty()) {
+        return;
+    }
+    items.emplace_back();
+    items.back().scope = 0;
+    items.back().key = nullptr;
+    items.back().value = nullptr;
+    if (km_core_state_options_update(state, items.data()) !=
+        KM_CORE_STATUS_OK) {
+        FCITX_KEYMAN_ERROR() << "Failed to update keyboard options.";
+    }
+}
+
+} // namespace fcitx
@@ -0,0 +1,82 @@
+/*
+ * SPDX-FileCopyrightText: 2018 SIL International
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_COREUTILS_H_
+#define _FCITX5_KEYMAN_COREUTILS_H_
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcitx-utils/utf8.h>
+#include <keyman_core_api.h>
+#include "optionstore.h"
+
+// Helpers shared by the addon and the sandbox helper process.
+
+namespace fcitx {
+
+// Convert to zero terminated UTF-16, empty if str is not valid.
+inline std::vector<char16_t> utf8ToUTF16(std::string_view str) {
+    if (!utf8::validate(str)) {
+        return {};
+    }
+    std::vector<char16_t> result;
+    for (const auto ucs4 : utf8::MakeUTF8CharRange(str)) {
+        if (ucs4 < 0x10000) {
+            result.push_back(static_cast<char16_t>(ucs4));
+        } else if (ucs4 < 0x110000) {
+            result.push_back(0xD800 | (((ucs4 - 0x10000) >> 10) & 0x3ff));
+            result.push_back(0xDC00 | (ucs4 & 0x3ff));
+        } else {
+            return {};
+        }
+    }
+    result.push_back(0);
+    return result;
+}
+
+template <typename Iter>
+std::string utf16ToUTF8(Iter start, Iter end) {
+    std::string result;
+    while (start != end) {
+        uint32_t ucs4 = 0;
+        if (*start < 0xD800 || *start > 0xDFFF) {
+            ucs4 = *start;
+            start = std::next(start);
+        } else if (0xD800 <= *start && *start <= 0xDBFF) {
+            if (std::next(start) == end) {
+                return {};
+            }
+            auto cur = *start;
+            auto next = std::next(start);
+            if (0xDC00 <= *next && *next <= 0xDFFF) {
+                /* We have a valid surrogate pair.  */
+                ucs4 = (((cur & 0x3FF) << 10) | (*next & 0x3FF)) + (1 << 16);
+            } else {
+                return {};
+            }
+            start = std::next(next);
+        } else if (0xDC00 <= *start && *start <= 0xDFFF) {
+            return {};
+        }
+        result.append(utf8::UCS4ToUTF8(ucs4));
+    }
+    return result;
+}
+
+// Create a state with the environment options of fcitx.
+km_core_status keymanCreateState(km_core_keyboard *keyboard,
+                                 km_core_state **state);
+
+// Apply the keyboard options to a state.
+void updateKeyboardOptions(km_core_state *state, const KeymanOptions &options);
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_COREUTILS_H_
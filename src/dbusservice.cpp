@@ -0,0 +1,171 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "dbusservice.h"
+#include <cstddef>
+#include <fcitx-utils/stringutils.h>
+#include "engine.h"
+
+namespace fcitx {
+
+namespace {
+
+// Transliterate runs in the main thread and blocks every input context while
+// it types, larger inputs should be split or use fcitx5-keyman-transliterate.
+constexpr size_t maxTransliterateKeys = 10000;
+
+} // namespace
+
+KeymanService::KeymanService(KeymanEngine *engine) : engine_(engine) {}
+
+std::vector<KeymanDBusLatency> KeymanService::latencySnapshot() {
+    std::vector<KeymanDBusLatency> result;
+    for (const auto &[id, data] : engine_->keyboards()) {
+        const auto &stats = data->latency();
+        if (!stats.phase(KeymanPhase::Total).count()) {
+            continue;
+        }
+        std::vector<KeymanDBusPhase> phases;
+        for (size_t i = 0; i < keymanPhaseCount; i++) {
+            const auto phase = static_cast<KeymanPhase>(i);
+            const auto &histogram = stats.phase(phase);
+            std::vector<KeymanDBusBucket> buckets;
+            for (size_t j = 0; j < histogram.counts().size(); j++) {
+                if (histogram.counts()[j]) {
+                    buckets.emplace_back(
+                        KeymanLatencyHistogram::bucketLowerBound(j),
+                        histogram.counts()[j]);
+                }
+            }
+            phases.emplace_back(keymanPhaseName(phase), histogram.count(),
+                                histogram.sum(), std::move(buckets));
+        }
+        result.emplace_back(id, std::move(phases));
+    }
+    return result;
+}
+
+void KeymanService::resetLatency() {
+    for (const auto &[id, data] : engine_->keyboards()) {
+        data->latency().reset();
+    }
+}
+
+std::vector<KeymanDBusCounters> KeymanService::counters() {
+    std::vector<KeymanDBusCounters> result;
+    for (const auto &[id, data] : engine_->keyboards()) {
+        std::vector<dbus::DictEntry<std::string, uint64_t>> values;
+        for (size_t i = 0; i < keymanCounterCount; i++) {
+            const auto counter = static_cast<KeymanCounter>(i);
+            values.emplace_back(keymanCounterName(counter),
+                                data->counters().value(counter));
+        }
+        result.emplace_back(id, std::move(values));
+    }
+    return result;
+}
+
+std::vector<KeymanDBusCounters> KeymanService::programCounters() {
+    std::vector<KeymanDBusCounters> result;
+    for (const auto &[program, counters] : engine_->programCounters()) {
+        std::vector<dbus::DictEntry<std::string, uint64_t>> values;
+        for (size_t i = 0; i < keymanCounterCount; i++) {
+            values.emplace_back(
+                keymanCounterName(static_cast<KeymanCounter>(i)),
+                counters[i]);
+        }
+        result.emplace_back(program, std::move(values));
+    }
+    return result;
+}
+
+std::string KeymanService::flightRecorder() {
+    return engine_->flightRecorderReport();
+}
+
+std::vector<dbus::DBusStruct<std::string, std::string, uint64_t>>
+KeymanService::memoryUsage(uint32_t topN) {
+    std::vector<dbus::DBusStruct<std::string, std::string, uint64_t>> result;
+    for (auto &entry : engine_->memoryUsage(topN)) {
+        result.emplace_back(std::move(entry.kind), std::move(entry.name),
+                            entry.bytes);
+    }
+    return result;
+}
+
+std::vector<KeymanDBusSlowCall> KeymanService::slowCalls() {
+    std::vector<KeymanDBusSlowCall> result;
+    for (const auto &call : engine_->watchdog().log()) {
+        result.emplace_back(call.timestamp, call.keyboard,
+                            keymanCoreCallName(call.call), call.vk,
+                            call.contextLength, call.duration);
+    }
+    return result;
+}
+
+std::vector<std::string> KeymanService::transliterate(
+    const std::string &id,
+    const std::vector<KeymanDBusKeySequence> &sequences) {
+    auto iter = engine_->keyboards().find(id);
+    if (iter == engine_->keyboards().end()) {
+        throw dbus::MethodCallError("org.freedesktop.DBus.Error.InvalidArgs",
+                                    stringutils::concat("Unknown keyboard ",
+                                                        id));
+    }
+    size_t keyCount = 0;
+    for (const auto &sequence : sequences) {
+        keyCount += std::get<1>(sequence.data()).size();
+    }
+    if (keyCount > maxTransliterateKeys) {
+        throw dbus::MethodCallError(
+            "org.freedesktop.DBus.Error.InvalidArgs",
+            stringutils::concat("Too many keys, at most ",
+                                maxTransliterateKeys,
+                                " keys may be sent in one call"));
+    }
+    // Loading a keyboard here would block the main loop and create a state
+    // for every input context, only keyboards that are in use are available.
+    auto &data = *iter->second;
+    // Keyboards may not be used by two threads at the same time, and the
+    // main thread does not wait for the worker.
+    if (data.coreBusy()) {
+        throw dbus::MethodCallError(
+            "org.freedesktop.DBus.Error.Failed",
+            stringutils::concat("Keyboard ", id, " is busy"));
+    }
+    auto transliterator = data.acquireTransliterator();
+    if (!transliterator) {
+        throw dbus::MethodCallError(
+            "org.freedesktop.DBus.Error.Failed",
+            stringutils::concat("Keyboard ", id,
+                                " is not loaded in the fcitx process"));
+    }
+    std::vector<std::string> result;
+    result.reserve(sequences.size());
+    std::vector<KeymanKeyStroke> keys;
+    for (const auto &sequence : sequences) {
+        keys.clear();
+        for (const auto &key : std::get<1>(sequence.data())) {
+            keys.push_back({std::get<0>(key.data()), std::get<1>(key.data())});
+        }
+        result.push_back(transliterator->run(std::get<0>(sequence.data()),
+                                             keys.data(), keys.size()));
+        if (transliterator->optionChanged()) {
+            // Do not leak the option to the next sequence.
+            data.releaseTransliterator(std::move(transliterator));
+            transliterator = data.acquireTransliterator();
+            if (!transliterator) {
+                throw dbus::MethodCallError(
+                    "org.freedesktop.DBus.Error.Failed",
+                    stringutils::concat("Failed to create state for ", id));
+            }
+        }
+    }
+    data.releaseTransliterator(std::move(transliterator));
+    return result;
+}
+
+} // namespace fcitx
@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_DBUSSERVICE_H_
+#define _FCITX5_KEYMAN_DBUSSERVICE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fcitx-utils/dbus/objectvtable.h>
+
+namespace fcitx {
+
+class KeymanEngine;
+
+// (lower bound, count) of a non empty bucket.
+using KeymanDBusBucket = dbus::DBusStruct<uint64_t, uint64_t>;
+// (phase, count, sum, buckets).
+using KeymanDBusPhase = dbus::DBusStruct<std::string, uint64_t, uint64_t,
+                                         std::vector<KeymanDBusBucket>>;
+// (keyboard id, phases).
+using KeymanDBusLatency =
+    dbus::DBusStruct<std::string, std::vector<KeymanDBusPhase>>;
+// (keyboard id or program, counter name to value).
+using KeymanDBusCounters =
+    dbus::DBusStruct<std::string,
+                     std::vector<dbus::DictEntry<std::string, uint64_t>>>;
+
+// (timestamp, keyboard id, core call, vk, context length, duration).
+using KeymanDBusSlowCall = dbus::DBusStruct<uint64_t, std::string, std::string,
+                                            uint16_t, uint32_t, uint64_t>;
+
+// (vk, KM_CORE_MODIFIER_*).
+using KeymanDBusKeyStroke = dbus::DBusStruct<uint16_t, uint16_t>;
+// (context, keys).
+using KeymanDBusKeySequence =
+    dbus::DBusStruct<std::string, std::vector<KeymanDBusKeyStroke>>;
+
+// Diagnostics and batch interface org.fcitx.Fcitx.Keyman1 at /keyman.
+class KeymanService : public dbus::ObjectVTable<KeymanService> {
+public:
+    KeymanService(KeymanEngine *engine);
+
+    std::vector<KeymanDBusLatency> latencySnapshot();
+    void resetLatency();
+    std::vector<KeymanDBusCounters> counters();
+    std::vector<KeymanDBusCounters> programCounters();
+    std::string flightRecorder();
+    std::vector<dbus::DBusStruct<std::string, std::string, uint64_t>>
+    memoryUsage(uint32_t topN);
+    std::vector<KeymanDBusSlowCall> slowCalls();
+    // Type each sequence after its context on a state that is not attached
+    // to any input context, return the text before the cursor.
+    std::vector<std::string>
+    transliterate(const std::string &id,
+                  const std::vector<KeymanDBusKeySequence> &sequences);
+
+private:
+    KeymanEngine *engine_;
+    FCITX_OBJECT_VTABLE_METHOD(latencySnapshot, "LatencySnapshot", "",
+                               "a(sa(stta(tt)))");
+    FCITX_OBJECT_VTABLE_METHOD(resetLatency, "ResetLatency", "", "");
+    FCITX_OBJECT_VTABLE_METHOD(counters, "Counters", "", "a(sa{st})");
+    FCITX_OBJECT_VTABLE_METHOD(programCounters, "ProgramCounters", "",
+                               "a(sa{st})");
+    FCITX_OBJECT_VTABLE_METHOD(flightRecorder, "FlightRecorder", "", "s");
+    FCITX_OBJECT_VTABLE_METHOD(memoryUsage, "MemoryUsage", "u", "a(sst)");
+    FCITX_OBJECT_VTABLE_METHOD(slowCalls, "SlowCalls", "", "a(tssqut)");
+    FCITX_OBJECT_VTABLE_METHOD(transliterate, "Transliterate", "sa(sa(qq))",
+                               "as");
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_DBUSSERVICE_H_
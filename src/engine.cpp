@@ -7,14 +7,27 @@
  */
 #include "engine.h"
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <cstdlib>
 #include <fcitx-utils/inputbuffer.h>
 #include <fcitx-utils/log.h>
 #include <fcitx-utils/misc.h>
 #include <fcitx-utils/utf8.h>
+#include <fcitx/inputcontextmanager.h>
+#include <fcitx/inputmethodmanager.h>
 #include <keyman_core_api.h>
+#include "coreutils.h"
+#include "dbusservice.h"
+#include "keymanlog.h"
 #include "kmpdata.h"
 #include "kmpmetadata.h"
+#include "probes.h"
+#include "trace.h"
+
+#ifdef FCITX_KEYMAN_DBUS
+#include <dbus_public.h>
+#endif
 
 #define MAXCONTEXT_ITEMS 128
 #define KEYMAN_BACKSPACE 14
@@ -25,62 +38,21 @@
 #define KEYMAN_RALT 100
 
 FCITX_DEFINE_LOG_CATEGORY(keyman, "keyman");
-#define FCITX_KEYMAN_DEBUG() FCITX_LOGC(::keyman, Debug)
-#define FCITX_KEYMAN_ERROR() FCITX_LOGC(::keyman, Error)
 
 namespace fcitx {
 
 namespace {
 
-std::vector<char16_t> utf8ToUTF16(std::string_view str) {
-    if (!utf8::validate(str)) {
-        return {};
-    }
-    std::vector<char16_t> result;
-    for (const auto ucs4 : utf8::MakeUTF8CharRange(str)) {
-        if (ucs4 < 0x10000) {
-            result.push_back(static_cast<char16_t>(ucs4));
-        } else if (ucs4 < 0x110000) {
-            result.push_back(0xD800 | (((ucs4 - 0x10000) >> 10) & 0x3ff));
-            result.push_back(0xDC00 | (ucs4 & 0x3ff));
-        } else {
-            return {};
-        }
-    }
-    result.push_back(0);
-    return result;
-}
-
-template <typename Iter>
-std::string utf16ToUTF8(Iter start, Iter end) {
-    std::string result;
-    while (start != end) {
-        uint32_t ucs4 = 0;
-        if (*start < 0xD800 || *start > 0xDFFF) {
-            ucs4 = *start;
-            start = std::next(start);
-        } else if (0xD800 <= *start && *start <= 0xDBFF) {
-            if (std::next(start) == end) {
-                return {};
-            }
-            auto cur = *start;
-            auto next = std::next(start);
-            if (0xDC00 <= *next && *next <= 0xDFFF) {
-                /* We have a valid surrogate pair.  */
-                ucs4 = (((cur & 0x3FF) << 10) | (*next & 0x3FF)) + (1 << 16);
-            } else {
-                return {};
-            }
-            start = std::next(next);
-        } else if (0xDC00 <= *start && *start <= 0xDFFF) {
-            return {};
-        }
-        result.append(utf8::UCS4ToUTF8(ucs4));
-    }
-    return result;
-}
+constexpr char ConfigFile[] = "conf/keyman.conf";
+// Loading keyboard in the sandbox helper may take longer than a key event.
+constexpr uint64_t keyboardLoadTimeout = 5000000000ULL;
+// Transliterators kept per keyboard between batch requests.
+constexpr size_t maxIdleTransliterators = 4;
 
 std::string get_current_context_text_debug(km_core_state *state) {
+    if (!state) {
+        return {};
+    }
     km_core_cp *buf =
         km_core_state_context_debug(state, KM_CORE_DEBUG_CONTEXT_CACHED);
     std::string result;
@@ -96,6 +68,7 @@ std::string get_current_context_text_debug(km_core_state *state) {
 }
 
 std::set<std::string> listKeymapDirs() {
+    KEYMAN_TRACE_SCOPE("listKeymapDirs");
     // Locate all directory under $XDG_DATA/keyman
     std::set<std::string> keymapDirs;
     StandardPath::global().scanFiles(
@@ -109,51 +82,104 @@ std::set<std::string> listKeymapDirs() {
     return keymapDirs;
 }
 
+KeymanFingerprint fileFingerprint(const std::string &path) {
+    struct stat statBuf;
+    if (stat(path.data(), &statBuf) != 0) {
+        return {};
+    }
+    return {static_cast<int64_t>(statBuf.st_mtim.tv_sec) * 1000000000 +
+                statBuf.st_mtim.tv_nsec,
+            static_cast<int64_t>(statBuf.st_size)};
+}
+
+// Dispose the state or keyboard of request in worker if the worker may still
+// use it, otherwise dispose it now.
+void disposeInWorker(KeymanWorker *worker, KeymanWorkerRequest request) {
+    if (worker && !worker->idle() && worker->submit(request)) {
+        return;
+    }
+    if (request.type == KeymanWorkerRequest::Type::DisposeState) {
+        km_core_state_dispose(request.state);
+    } else {
+        km_core_keyboard_dispose(request.keyboard);
+    }
+}
+
+// Fire key_entry and key_return probes around a key event.
+class KeyEventProbe {
+public:
+    KeyEventProbe(const KeyEvent &keyEvent) : keyEvent_(keyEvent) {
+        KEYMAN_PROBE(key_entry, keyEvent_.key().code(),
+                     static_cast<uint32_t>(keyEvent_.rawKey().states()),
+                     keyEvent_.isRelease());
+    }
+    ~KeyEventProbe() {
+        KEYMAN_PROBE(key_return, keyEvent_.key().code(), keyEvent_.filtered());
+    }
+
+private:
+    const KeyEvent &keyEvent_;
+};
+
 } // namespace
 
-class KeymanState : public InputContextProperty {
+class KeymanState : public InputContextProperty,
+                    public TrackableObject<KeymanState> {
 public:
     KeymanState(KeymanKeyboardData *keyboard, InputContext *ic)
         : keyboard_(keyboard), ic_(ic) {
-        std::vector<km_core_option_item> keyboard_opts;
-
-        keyboard_opts.emplace_back();
-        keyboard_opts.back().scope = KM_CORE_OPT_ENVIRONMENT;
-        const auto platform = utf8ToUTF16("platform");
-        keyboard_opts.back().key = platform.data();
-        const auto platformValue = utf8ToUTF16("linux desktop hardware native");
-        keyboard_opts.back().value = platformValue.data();
-
-        keyboard_opts.emplace_back();
-        keyboard_opts.back().scope = KM_CORE_OPT_ENVIRONMENT;
-        const auto baseLayout = utf8ToUTF16("baseLayout");
-        keyboard_opts.back().key = baseLayout.data();
-        const auto baseLayoutValue = utf8ToUTF16("kbdus.dll");
-        keyboard_opts.back().value = baseLayoutValue.data();
-
-        keyboard_opts.emplace_back();
-        keyboard_opts.back().scope = KM_CORE_OPT_ENVIRONMENT;
-        const auto baseLayoutAlt = utf8ToUTF16("baseLayoutAlt");
-        keyboard_opts.back().key = baseLayoutAlt.data();
-        const auto baseLayoutAltValue = utf8ToUTF16("en-US");
-        keyboard_opts.back().value = baseLayoutAltValue.data();
-
-        keyboard_opts.emplace_back();
-        keyboard_opts.back().scope = 0;
-        keyboard_opts.back().key = nullptr;
-        keyboard_opts.back().value = nullptr;
-        km_core_status status_state = km_core_state_create(
-            keyboard_->kbpKeyboard(), keyboard_opts.data(), &state);
-        if (status_state != KM_CORE_STATUS_OK) {
-            FCITX_KEYMAN_ERROR() << "problem creating km_core_state for "
-                                 << keyboard_->metadata().id;
-            return;
-        };
+        createState();
+        updateContext();
+    }
+
+    ~KeymanState() {
+        if (state) {
+            keyboard_->disposeState(state);
+        }
+        disposeRemoteState(remoteState_, remoteGeneration_);
+    }
+
+    // Recreate the state after the keyboard is reloaded, and carry over the
+    // context. Return the old state for the caller to dispose, since it may
+    // still be used by the worker of the old keyboard.
+    km_core_state *recreate() {
+        auto *oldState = std::exchange(state, nullptr);
+        const auto oldRemoteState = std::exchange(remoteState_, 0);
+        const auto oldGeneration = remoteGeneration_;
+        createState();
+        restoreHistory();
         updateContext();
+        disposeRemoteState(oldRemoteState, oldGeneration);
+        return oldState;
     }
 
+    // Whether the state can be used. The state is created later if the
+    // worker was busy, and in sandbox mode, it is created again if the helper
+    // is restarted.
+    bool ready() {
+        auto *sandbox = keyboard_->engine()->sandbox();
+        if (!sandbox) {
+            if (!state && statePending_ && !keyboard_->coreBusy()) {
+                createState();
+                restoreHistory();
+            }
+            return state != nullptr;
+        }
+        if (!remoteState_ || remoteGeneration_ != sandbox->generation()) {
+            remoteState_ = 0;
+            createState();
+            restoreHistory();
+        }
+        return remoteState_ != 0;
+    }
+    uint32_t remoteState() const { return remoteState_; }
+
     // Update context from surrounding if possible.
     void updateContext() {
+        // The surrounding text is set again by the next key event.
+        if (keyboard_->coreBusy() || !ready()) {
+            return;
+        }
         if (ic_->capabilityFlags().test(CapabilityFlag::SurroundingText) &&
             ic_->surroundingText().isValid()) {
             auto text = ic_->surroundingText().text();
@@ -168,8 +194,22 @@ public:
                 utf8::nextNChar(startIter, context_pos - context_start);
             std::string new_context(startIter, endIter);
             auto utf16Context = utf8ToUTF16(new_context);
-            km_core_state_context_set_if_needed(
-                state, reinterpret_cast<km_core_cp *>(utf16Context.data()));
+            surroundingContextLength_ = context_pos - context_start;
+            auto status = setCoreContext(utf16Context);
+            // Exclude the trailing zero.
+            surroundingContextHash_ =
+                utf16Context.empty()
+                    ? 0
+                    : keymanContextHash(utf16Context.begin(),
+                                        std::prev(utf16Context.end()));
+            hasSurroundingContext_ = true;
+            const bool changed = status == KM_CORE_CONTEXT_STATUS_UPDATED ||
+                                 status == KM_CORE_CONTEXT_STATUS_CLEARED;
+            if (changed) {
+                count(KeymanCounter::ContextChanged);
+            }
+            KEYMAN_PROBE(context_resync, context_pos - context_start,
+                         changed);
             FCITX_KEYMAN_DEBUG()
                 << "Set context from application: " << new_context;
         }
@@ -177,7 +217,109 @@ public:
 
     void clearContext() {
         FCITX_KEYMAN_DEBUG() << "Clear context";
-        km_core_state_context_clear(state);
+        if (keyboard_->coreBusy()) {
+            keyboard_->deferClearContext(this);
+        } else {
+            clearCoreContext();
+        }
+        history_.clear();
+        count(KeymanCounter::ContextCleared);
+    }
+
+    void clearCoreContext() {
+        if (state) {
+            km_core_state_context_clear(state);
+        }
+        if (auto *sandbox = keyboard_->engine()->sandbox();
+            sandbox && remoteState_ &&
+            remoteGeneration_ == sandbox->generation()) {
+            sandbox->clearContext(remoteState_);
+        }
+    }
+
+    void applyOptions(const KeymanOptions &options) {
+        if (state) {
+            updateKeyboardOptions(state, options);
+        }
+        if (auto *sandbox = keyboard_->engine()->sandbox();
+            sandbox && remoteState_ &&
+            remoteGeneration_ == sandbox->generation()) {
+            sandbox->updateOptions(remoteState_, options);
+        }
+    }
+
+    void count(KeymanCounter counter, uint64_t value = 1) {
+        counters_.add(counter, value);
+        keyboard_->counters().add(counter, value);
+    }
+    const auto &counters() const { return counters_; }
+    const auto &program() const { return ic_->program(); }
+
+    void record(const KeymanFlightRecord &record) {
+        if (keymanIsSensitive(*ic_)) {
+            return;
+        }
+        recorder_.record(record);
+    }
+    const auto &recorder() const { return recorder_; }
+
+    size_t memoryUsage() const {
+        return sizeof(*this) + stateHeapUsage_ + recorder_.memoryUsage() +
+               history_.capacity() * sizeof(char16_t);
+    }
+
+    // Hash of the context last set from application, or of the text produced
+    // by the keyboard.
+    uint32_t contextHash() const {
+        if (hasSurroundingContext_) {
+            return surroundingContextHash_;
+        }
+        return keymanContextHash(history_.begin(), history_.end());
+    }
+
+    // Length of the context last set from application, or of the text
+    // produced by the keyboard.
+    size_t contextLength() const {
+        if (hasSurroundingContext_) {
+            return surroundingContextLength_;
+        }
+        return history_.size();
+    }
+
+    // Report the duration of a keyman core call to the watchdog, and update
+    // the sub mode if the keyboard becomes slow or recovers.
+    void checkCoreCall(KeymanCoreCall call, uint16_t vk, uint64_t start,
+                       uint64_t end) {
+        if (keyboard_->engine()->watchdog().check(keyboard_->id(), call, vk,
+                                                  contextLength(), start,
+                                                  end)) {
+            ic_->updateUserInterface(UserInterfaceComponent::StatusArea);
+        }
+    }
+
+    // Keep track of the text produced by the keyboard, it is used as the
+    // context of the new state if the keyboard is reloaded.
+    void updateHistory(unsigned int numOfDelete,
+                       const std::vector<km_core_usv> &output) {
+        history_.resize(history_.size() -
+                        std::min<size_t>(numOfDelete, history_.size()));
+        for (const auto c : output) {
+            if (c < 0x10000) {
+                history_.push_back(static_cast<char16_t>(c));
+            } else {
+                history_.push_back(static_cast<char16_t>(
+                    0xD800 | (((c - 0x10000) >> 10) & 0x3ff)));
+                history_.push_back(static_cast<char16_t>(0xDC00 | (c & 0x3ff)));
+            }
+        }
+        if (history_.size() > MAXCONTEXT_ITEMS * 2) {
+            auto start = history_.size() - MAXCONTEXT_ITEMS;
+            // Do not start with a low surrogate.
+            if (0xDC00 <= history_[start] && history_[start] <= 0xDFFF) {
+                start++;
+            }
+            history_.erase(0, start);
+        }
     }
 
     void reset() {
@@ -196,11 +338,123 @@ public:
     bool ralt_pressed = false;
 
 private:
+    // Return km_core_context_status, or -1 if the helper fails.
+    int setCoreContext(std::vector<char16_t> &context) {
+        const auto start = keymanNow();
+        int status = -1;
+        if (auto *sandbox = keyboard_->engine()->sandbox()) {
+            status = sandbox->setContext(
+                remoteState_, context,
+                keyboard_->engine()->processDeadline());
+        } else {
+            status = km_core_state_context_set_if_needed(
+                state, reinterpret_cast<km_core_cp *>(context.data()));
+        }
+        checkCoreCall(KeymanCoreCall::ContextSet, 0, start, keymanNow());
+        return status;
+    }
+
+    // Set the text produced by the keyboard as the context of a new state.
+    void restoreHistory() {
+        if ((!state && !remoteState_) || history_.empty()) {
+            return;
+        }
+        std::vector<char16_t> context(history_.begin(), history_.end());
+        context.push_back(0);
+        setCoreContext(context);
+    }
+
+    void disposeRemoteState(uint32_t remoteState, uint64_t generation) {
+        auto *sandbox = keyboard_->engine()->sandbox();
+        if (sandbox && remoteState && generation == sandbox->generation()) {
+            sandbox->disposeState(remoteState);
+        }
+    }
+
+    void createState() {
+        KEYMAN_TRACE_SCOPE("createState", keyboard_->id());
+        if (auto *sandbox = keyboard_->engine()->sandbox()) {
+            const auto keyboard = keyboard_->remoteKeyboard();
+            if (!keyboard) {
+                return;
+            }
+            const auto start = keymanNow();
+            remoteState_ = sandbox->createState(
+                keyboard, keyboard_->options(),
+                keyboard_->engine()->processDeadline());
+            remoteGeneration_ = sandbox->generation();
+            checkCoreCall(KeymanCoreCall::StateCreate, 0, start, keymanNow());
+            return;
+        }
+        // Keyboard may not be used while the worker is busy with it.
+        statePending_ = keyboard_->coreBusy();
+        if (statePending_) {
+            return;
+        }
+        const KeymanHeapMeter heap;
+        const auto start = keymanNow();
+        km_core_status status_state =
+            keymanCreateState(keyboard_->kbpKeyboard(), &state);
+        const auto end = keymanNow();
+        stateHeapUsage_ = heap.delta();
+        checkCoreCall(KeymanCoreCall::StateCreate, 0, start, end);
+        if (status_state != KM_CORE_STATUS_OK) {
+            FCITX_KEYMAN_ERROR() << "problem creating km_core_state for "
+                                 << keyboard_->id();
+            state = nullptr;
+            return;
+        };
+        if (const auto *options = keyboard_->options()) {
+            updateKeyboardOptions(state, *options);
+        }
+    }
+
     KeymanKeyboardData *keyboard_;
     InputContext *ic_;
+    KeymanCounters counters_;
+    KeymanFlightRecorder recorder_;
+    // Heap allocated by km_core_state_create, if keymanHeapAccounting() is on.
+    size_t stateHeapUsage_ = 0;
+    // Handle of the state in the sandbox helper.
+    uint32_t remoteState_ = 0;
+    uint64_t remoteGeneration_ = 0;
+    // The state is not created yet since the worker was busy.
+    bool statePending_ = false;
+    bool hasSurroundingContext_ = false;
+    uint32_t surroundingContextHash_ = 0;
+    size_t surroundingContextLength_ = 0;
+    // UTF-16 text produced by the keyboard.
+    std::u16string history_;
 };
 
-KeymanEngine::KeymanEngine(Instance *instance) : instance_(instance) {
+KeymanEngine::KeymanEngine(Instance *instance)
+    : instance_(instance), fileWatcher_(&instance->eventLoop()) {
+    reloadConfig();
+    if (*config_.sandbox) {
+        sandbox_ = std::make_unique<KeymanSandbox>(KEYMAN_HELPER_PATH,
+                                                   &instance_->eventLoop());
+    }
+    dispatcher_.attach(&instance_->eventLoop());
+    if (const char *path = getenv("FCITX_KEYMAN_RECORD"); path && path[0]) {
+        recorder_ = std::make_unique<KeymanRecorder>(path);
+    }
+#ifdef FCITX_KEYMAN_DBUS
+    if (auto *dbusAddon = dbus()) {
+        service_ = std::make_unique<KeymanService>(this);
+        dbusAddon->call<IDBusModule::bus>()->addObjectVTable(
+            "/keyman", "org.fcitx.Fcitx.Keyman1", *service_);
+    }
+#endif
+    // Watch option files written by other tools, e.g. km-config.
+    const auto optionDir = stringutils::joinPath(
+        StandardPath::global().userDirectory(StandardPath::Type::PkgConfig),
+        "keyman");
+    fs::makePath(optionDir);
+    fileWatcher_.watch(optionDir, [this](const std::string &name) {
+        if (stringutils::endsWith(name, ".conf")) {
+            reloadOptions(name.substr(0, name.size() - 5));
+        }
+    });
     updateHandler_ = instance_->watchEvent(
         EventType::CheckUpdate, EventWatcherPhase::Default,
         [this](Event &event) {
@@ -224,7 +478,86 @@ KeymanEngine::KeymanEngine(Instance *instance) : instance_(instance) {
         });
 }
 
+KeymanEngine::~KeymanEngine() {
+    for (auto &[id, loader] : loaders_) {
+        loader.join();
+    }
+    // Input method entries may keep the keyboard data after the engine is
+    // gone.
+    for (auto &[id, data] : keyboards_) {
+        data->detach();
+    }
+    keyboards_.clear();
+    KeymanTracer::global().flush();
+}
+
+void KeymanEngine::reloadConfig() {
+    readAsIni(config_, ConfigFile);
+    watchdog_.setThreshold(static_cast<uint64_t>(*config_.slowThreshold) *
+                           1000000);
+    // Workers are started by the first key, and stopped once they are idle
+    // if they are disabled.
+    for (auto &[id, data] : keyboards_) {
+        data->dispatchWorkerResults();
+    }
+}
+
+void KeymanEngine::setConfig(const RawConfig &config) {
+    config_.load(config, true);
+    safeSaveAsIni(config_, ConfigFile);
+    reloadConfig();
+}
+
+void KeymanEngine::loadKeyboardAsync(
+    std::string kmxPath,
+    std::function<void(KeymanKeyboardPtr, size_t)> callback) {
+    const auto id = nextLoaderId_++;
+    loaders_.emplace(
+        id, std::thread([this, id, kmxPath = std::move(kmxPath),
+                         callback = std::move(callback)]() {
+            km_core_keyboard *keyboard = nullptr;
+            size_t heapUsage;
+            {
+                KEYMAN_TRACE_SCOPE("km_core_keyboard_load", kmxPath);
+                const KeymanHeapMeter heap;
+                if (km_core_keyboard_load(kmxPath.data(), &keyboard) !=
+                    KM_CORE_STATUS_OK) {
+                    keyboard = nullptr;
+                }
+                heapUsage = heap.delta();
+            }
+            // Keyboard is freed if the callback is never called.
+            auto result = std::make_shared<KeymanKeyboardPtr>(keyboard);
+            dispatcher_.schedule([this, id, result, heapUsage, callback]() {
+                if (auto iter = loaders_.find(id); iter != loaders_.end()) {
+                    iter->second.join();
+                    loaders_.erase(iter);
+                }
+                callback(std::move(*result), heapUsage);
+            });
+        }));
+}
+
+void KeymanEngine::watchKeyboardDir(const std::string &dir) {
+    fileWatcher_.watch(dir, [this](const std::string &name) {
+        if (stringutils::endsWith(name, ".kmx")) {
+            if (auto *data = keyboardData(name.substr(0, name.size() - 4))) {
+                data->reload();
+            }
+        }
+    });
+}
+
+KeymanKeyboardData *KeymanEngine::keyboardData(const std::string &id) {
+    if (auto iter = keyboards_.find(id); iter != keyboards_.end()) {
+        return iter->second.get();
+    }
+    return nullptr;
+}
+
 std::vector<InputMethodEntry> KeymanEngine::listInputMethods() {
+    KEYMAN_TRACE_SCOPE("listInputMethods");
+    KEYMAN_PROBE(catalog_scan_start);
     // Locate all directory under $XDG_DATA/keyman
     std::set<std::string> keymapDirs = listKeymapDirs();
     FCITX_KEYMAN_DEBUG() << "Keyman directories: " << keymapDirs;
@@ -237,6 +570,7 @@ std::vector<InputMethodEntry> KeymanEngine::listInputMethods() {
             try {
                 timestamp_ =
                     std::max(timestamp_, fs::modifiedTime(kmpJsonFile.path()));
+                KEYMAN_TRACE_SCOPE("KmpMetadata", kmpJsonFile.path());
                 KmpMetadata metadata(kmpJsonFile.fd());
                 for (const auto &[id, keyboard] : metadata.keyboards()) {
                     if (auto iter = keyboards.find(id);
@@ -245,23 +579,46 @@ std::vector<InputMethodEntry> KeymanEngine::listInputMethods() {
                         continue;
                     }
                     keyboards[id] = std::make_unique<KeymanKeyboard>(
-                        instance_, keyboard, metadata,
-                        fs::dirName(kmpJsonFile.path()));
+                        keyboard, metadata, fs::dirName(kmpJsonFile.path()));
                 }
             } catch (...) {
             }
         }
     }
+    // Keep the keyboards that are already known, so their loaded data and
+    // states survive the reload. If the kmx file is changed, the keyboard is
+    // reloaded in place.
+    for (auto iter = keyboards_.begin(); iter != keyboards_.end();) {
+        if (keyboards.count(iter->first)) {
+            ++iter;
+        } else {
+            iter = keyboards_.erase(iter);
+        }
+    }
     std::vector<InputMethodEntry> result;
+    catalogUsage_ = 0;
     for (auto &[id, keyboard] : keyboards) {
+        catalogUsage_ += keyboard->memoryUsage();
+        auto &data = keyboards_[id];
+        if (data) {
+            data->setBaseDir(keyboard->baseDir);
+            data->reload();
+        } else {
+            data = std::make_shared<KeymanKeyboardData>(this, id,
+                                                        keyboard->baseDir);
+        }
+        keyboard->setData(data);
         std::string icon = "km-config";
         // Check if icon file exists, otherwise fallback to keyman's icon.
-        for (auto *suffix : {".bmp.png", ".icon.png"}) {
-            auto path = stringutils::joinPath(keyboard->baseDir,
-                                              stringutils::concat(id, suffix));
-            if (fs::isreg(path)) {
-                icon = std::move(path);
-                break;
+        {
+            KEYMAN_TRACE_SCOPE("findIcon", id);
+            for (auto *suffix : {".bmp.png", ".icon.png"}) {
+                auto path = stringutils::joinPath(
+                    keyboard->baseDir, stringutils::concat(id, suffix));
+                if (fs::isreg(path)) {
+                    icon = std::move(path);
+                    break;
+                }
             }
         }
 
@@ -271,47 +628,237 @@ std::vector<InputMethodEntry> KeymanEngine::listInputMethods() {
         result.back().setIcon(icon).setConfigurable(true).setUserData(
             std::move(keyboard));
     }
+    KEYMAN_PROBE(catalog_scan_done, result.size());
     return result;
 }
 
-FCITX_ADDON_FACTORY(fcitx::KeymanEngineFactory);
-
 } // namespace fcitx
 
 void fcitx::KeymanKeyboardData::load() {
     if (loaded_) {
         return;
     }
+    KEYMAN_TRACE_SCOPE("KeymanKeyboardData::load", id_);
     loaded_ = true;
-    auto kmxPath = stringutils::joinPath(
-        metadata_.baseDir, stringutils::concat(metadata_.id, ".kmx"));
+    auto kmxPath = this->kmxPath();
     auto ldmlFile = stringutils::joinPath(
-        metadata_.baseDir, stringutils::concat(metadata_.id, ".ldml"));
+        baseDir_, stringutils::concat(id_, ".ldml"));
     if (!fs::isreg(ldmlFile)) {
         ldmlFile.clear();
     }
     ldmlFile_ = ldmlFile;
     if (!fs::isreg(kmxPath)) {
-        FCITX_KEYMAN_ERROR() << "Failed to find kmx file. " << metadata_.id;
+        FCITX_KEYMAN_ERROR() << "Failed to find kmx file. " << id_;
         return;
     }
 
-    km_core_status status_keyboard =
-        km_core_keyboard_load(kmxPath.data(), &keyboard_);
+    engine_->watchKeyboardDir(baseDir_);
+    loadedPath_ = kmxPath;
+    fingerprint_ = fileFingerprint(kmxPath);
+    if (engine_->sandbox()) {
+        // The factory is registered once the helper loads the keyboard.
+        loadRemote(kmxPath, fingerprint_);
+        return;
+    }
+    km_core_status status_keyboard;
+    {
+        KEYMAN_TRACE_SCOPE("km_core_keyboard_load", kmxPath);
+        KEYMAN_PROBE(keyboard_load_start, id_.data());
+        const KeymanHeapMeter heap;
+        const auto start = keymanNow();
+        status_keyboard = km_core_keyboard_load(kmxPath.data(), &keyboard_);
+        const auto end = keymanNow();
+        keyboardHeapUsage_ = heap.delta();
+        engine_->watchdog().check(id_, KeymanCoreCall::KeyboardLoad, 0, 0,
+                                  start, end);
+        KEYMAN_PROBE(keyboard_load_done, id_.data(),
+                     static_cast<int>(status_keyboard));
+    }
 
     if (status_keyboard != KM_CORE_STATUS_OK) {
         FCITX_KEYMAN_ERROR()
-            << "problem creating km_core_keyboard" << metadata_.id;
+            << "problem creating km_core_keyboard" << id_;
+        keyboard_ = nullptr;
         return;
     }
 
-    instance_->inputContextManager().registerProperty(
-        stringutils::concat("keymanState", metadata_.id), &factory_);
+    {
+        KEYMAN_TRACE_SCOPE("loadOptions", id_);
+        if (const auto *keyboardOptions = options()) {
+            FCITX_KEYMAN_DEBUG() << "Keyboard options: " << *keyboardOptions;
+        }
+    }
 
-    config_ = RawConfig();
-    readAsIni(config_, stringutils::concat("keyman/", metadata_.id, ".conf"));
+    engine_->instance()->inputContextManager().registerProperty(
+        stringutils::concat("keymanState", id_), &factory_);
+}
 
-    FCITX_KEYMAN_DEBUG() << config_;
+void fcitx::KeymanKeyboardData::reload() {
+    if (!loaded_) {
+        // The new file will be picked up by load().
+        return;
+    }
+    if (reloading_) {
+        reloadPending_ = true;
+        return;
+    }
+    auto path = kmxPath();
+    auto fingerprint = fileFingerprint(path);
+    if ((path == loadedPath_ && fingerprint == fingerprint_) ||
+        !fingerprint.size) {
+        return;
+    }
+    FCITX_KEYMAN_DEBUG() << "Reloading keyboard " << id_;
+    if (engine_->sandbox()) {
+        // States are recreated once the helper loads the new file.
+        loadRemote(path, fingerprint);
+        return;
+    }
+    reloading_ = true;
+    engine_->loadKeyboardAsync(
+        path, [ref = watch(), path, fingerprint](KeymanKeyboardPtr keyboard,
+                                                 size_t heapUsage) {
+            auto *self = ref.get();
+            if (!self) {
+                return;
+            }
+            self->reloading_ = false;
+            if (keyboard) {
+                self->keyboardHeapUsage_ = heapUsage;
+                self->swapKeyboard(std::move(keyboard), path, fingerprint);
+            } else {
+                FCITX_KEYMAN_ERROR() << "Failed to reload keyboard "
+                                     << self->id_;
+            }
+            if (std::exchange(self->reloadPending_, false)) {
+                self->reload();
+            }
+        });
+}
+
+void fcitx::KeymanKeyboardData::swapKeyboard(
+    KeymanKeyboardPtr keyboard, const std::string &path,
+    const KeymanFingerprint &fingerprint) {
+    auto *oldKeyboard = std::exchange(keyboard_, keyboard.release());
+    // The worker may still use the old keyboard and states, so they are
+    // disposed by it, and the new keyboard starts its own worker.
+    auto oldWorker = std::move(worker_);
+    pendingSequence_ = 0;
+    deferredClear_.clear();
+    deferredOptions_.clear();
+    if (loadedPath_ != path) {
+        engine_->watchKeyboardDir(baseDir_);
+    }
+    loadedPath_ = path;
+    fingerprint_ = fingerprint;
+    // The new version may not be slow any more.
+    engine_->watchdog().forget(id_);
+    std::vector<km_core_state *> oldStates;
+    if (factory_.registered()) {
+        engine_->instance()->inputContextManager().foreach(
+            [this, &oldStates](InputContext *ic) {
+                if (auto *oldState = ic->propertyFor(&factory_)->recreate()) {
+                    oldStates.push_back(oldState);
+                }
+                return true;
+            });
+    } else {
+        engine_->instance()->inputContextManager().registerProperty(
+            stringutils::concat("keymanState", id_), &factory_);
+    }
+    transliterators_.clear();
+    KeymanWorkerRequest request;
+    request.type = KeymanWorkerRequest::Type::DisposeState;
+    for (auto *oldState : oldStates) {
+        request.state = oldState;
+        disposeInWorker(oldWorker.get(), request);
+    }
+    if (oldKeyboard) {
+        request.type = KeymanWorkerRequest::Type::DisposeKeyboard;
+        request.keyboard = oldKeyboard;
+        disposeInWorker(oldWorker.get(), request);
+    }
+    // Detached if it is stuck, the requests above are still run if it
+    // recovers.
+    oldWorker.reset();
+    FCITX_KEYMAN_DEBUG() << "Keyboard " << id_ << " is reloaded.";
+}
+
+uint32_t fcitx::KeymanKeyboardData::remoteKeyboard() {
+    auto *sandbox = engine_->sandbox();
+    if (remoteGeneration_ != sandbox->generation()) {
+        remoteKeyboard_ = 0;
+    }
+    if (!remoteKeyboard_ && !reloading_ && !loadedPath_.empty()) {
+        // Keys are passed to the application until the keyboard is loaded
+        // again in the restarted helper.
+        loadRemote(loadedPath_, fingerprint_);
+    }
+    return remoteKeyboard_;
+}
+
+void fcitx::KeymanKeyboardData::loadRemote(
+    const std::string &path, const KeymanFingerprint &fingerprint) {
+    auto *sandbox = engine_->sandbox();
+    KEYMAN_PROBE(keyboard_load_start, id_.data());
+    reloading_ = true;
+    sandbox->loadKeyboardAsync(
+        path, keyboardLoadTimeout,
+        [ref = watch(), sandbox, path, fingerprint,
+         start = keymanNow()](uint32_t keyboard) {
+            auto *self = ref.get();
+            if (!self) {
+                if (keyboard) {
+                    sandbox->disposeKeyboard(keyboard);
+                }
+                return;
+            }
+            self->reloading_ = false;
+            self->engine_->watchdog().check(self->id_,
+                                            KeymanCoreCall::KeyboardLoad, 0, 0,
+                                            start, keymanNow());
+            KEYMAN_PROBE(keyboard_load_done, self->id_.data(),
+                         keyboard ? 0 : -1);
+            if (keyboard) {
+                const auto oldKeyboard =
+                    std::exchange(self->remoteKeyboard_, keyboard);
+                const auto oldGeneration =
+                    std::exchange(self->remoteGeneration_,
+                                  sandbox->generation());
+                // After a restart of the helper, the states are created
+                // again by KeymanState::ready().
+                if (!self->factory_.registered() ||
+                    path != self->loadedPath_ ||
+                    fingerprint != self->fingerprint_) {
+                    self->swapKeyboard(nullptr, path, fingerprint);
+                }
+                if (oldKeyboard && oldGeneration == sandbox->generation()) {
+                    sandbox->disposeKeyboard(oldKeyboard);
+                }
+            } else {
+                FCITX_KEYMAN_ERROR() << "Failed to load keyboard "
+                                     << self->id_ << " in keyman helper";
+            }
+            if (std::exchange(self->reloadPending_, false)) {
+                self->reload();
+            }
+        });
+}
+
+void fcitx::KeymanKeyboardData::setBaseDir(const std::string &baseDir) {
+    if (baseDir_ == baseDir) {
+        return;
+    }
+    baseDir_ = baseDir;
+}
+
+std::string fcitx::KeymanKeyboardData::kmxPath() const {
+    return stringutils::joinPath(baseDir_,
+                                 stringutils::concat(id_, ".kmx"));
+}
+
+const fcitx::KeymanOptions *fcitx::KeymanKeyboardData::options() const {
+    return engine_->optionStore().options(id_);
 }
 
 void fcitx::KeymanKeyboardData::setOption(const km_core_cp *key,
@@ -329,34 +876,195 @@ void fcitx::KeymanKeyboardData::setOption(const km_core_cp *key,
     auto utf8Value = utf16ToUTF8(value, valueEnd);
 
     if (!utf8Key.empty()) {
-        config_.setValueByPath(utf8Key, utf8Value);
-        safeSaveAsIni(config_,
-                      stringutils::concat("keyman/", metadata_.id, ".conf"));
+        engine_->optionStore().setOption(id_, utf8Key, utf8Value);
     }
 }
 
+void fcitx::KeymanKeyboardData::updateOptions(const KeymanOptions &options) {
+    if (!ready() || !factory_.registered() || options.empty()) {
+        return;
+    }
+    if (coreBusy()) {
+        // Applied by dispatchWorkerResults() once the worker is done.
+        for (const auto &[key, value] : options) {
+            deferredOptions_[key] = value;
+        }
+        return;
+    }
+    transliterators_.clear();
+    engine_->instance()->inputContextManager().foreach(
+        [this, &options](InputContext *ic) {
+            ic->propertyFor(&factory_)->applyOptions(options);
+            return true;
+        });
+}
+
 fcitx::KeymanKeyboardData::KeymanKeyboardData(
-    Instance *instance, const fcitx::KeymanKeyboard &metadata)
-    : instance_(instance), metadata_(metadata),
+    KeymanEngine *engine, std::string id, std::string baseDir)
+    : engine_(engine), id_(std::move(id)), baseDir_(std::move(baseDir)),
       factory_(
           [this](InputContext &ic) { return new KeymanState(this, &ic); }) {}
 
-fcitx::KeymanKeyboardData::~KeymanKeyboardData() { factory_.unregister(); }
+std::unique_ptr<fcitx::KeymanTransliterator>
+fcitx::KeymanKeyboardData::acquireTransliterator() {
+    if (!keyboard_) {
+        return nullptr;
+    }
+    if (!transliterators_.empty()) {
+        auto transliterator = std::move(transliterators_.back());
+        transliterators_.pop_back();
+        return transliterator;
+    }
+    auto transliterator =
+        std::make_unique<KeymanTransliterator>(keyboard_, options());
+    if (!transliterator->valid()) {
+        return nullptr;
+    }
+    return transliterator;
+}
+
+void fcitx::KeymanKeyboardData::releaseTransliterator(
+    std::unique_ptr<KeymanTransliterator> transliterator) {
+    if (transliterator && !transliterator->optionChanged() &&
+        transliterators_.size() < maxIdleTransliterators) {
+        transliterators_.push_back(std::move(transliterator));
+    }
+}
+
+fcitx::KeymanKeyboardData::~KeymanKeyboardData() { detach(); }
+
+void fcitx::KeymanKeyboardData::detach() {
+    if (!engine_) {
+        return;
+    }
+    // States are destroyed first, they are disposed through the worker.
+    factory_.unregister();
+    transliterators_.clear();
+    if (keyboard_) {
+        disposeKeyboard(std::exchange(keyboard_, nullptr));
+    }
+    deferredClear_.clear();
+    worker_.reset();
+    if (auto *sandbox = engine_->sandbox();
+        sandbox && remoteKeyboard_ &&
+        remoteGeneration_ == sandbox->generation()) {
+        sandbox->disposeKeyboard(remoteKeyboard_);
+    }
+    remoteKeyboard_ = 0;
+    engine_ = nullptr;
+}
+
+bool fcitx::KeymanKeyboardData::processInWorker(km_core_state *state,
+                                                uint16_t vk,
+                                                uint16_t modifiers,
+                                                bool isKeyDown,
+                                                KeymanWorkerResult &result) {
+    if (pendingSequence_) {
+        return false;
+    }
+    if (!worker_) {
+        worker_ = std::make_unique<KeymanWorker>(
+            &engine_->instance()->eventLoop(),
+            [this]() { applyWorkerResults(); });
+    }
+    KeymanWorkerRequest request;
+    request.type = KeymanWorkerRequest::Type::Process;
+    request.state = state;
+    request.vk = vk;
+    request.modifiers = modifiers;
+    request.isKeyDown = isKeyDown;
+    pendingSequence_ = worker_->submit(request);
+    if (!pendingSequence_) {
+        return false;
+    }
+    const auto deadline = keymanNow() + engine_->processDeadline();
+    while (true) {
+        while (worker_->pop(result)) {
+            if (result.sequence == pendingSequence_) {
+                pendingSequence_ = 0;
+                return true;
+            }
+        }
+        const auto now = keymanNow();
+        if (now >= deadline || !worker_->wait(deadline - now)) {
+            // Result is dropped by applyWorkerResults() when it arrives.
+            return false;
+        }
+    }
+}
+
+void fcitx::KeymanKeyboardData::disposeState(km_core_state *state) {
+    KeymanWorkerRequest request;
+    request.type = KeymanWorkerRequest::Type::DisposeState;
+    request.state = state;
+    disposeInWorker(worker_.get(), request);
+}
+
+void fcitx::KeymanKeyboardData::disposeKeyboard(km_core_keyboard *keyboard) {
+    KeymanWorkerRequest request;
+    request.type = KeymanWorkerRequest::Type::DisposeKeyboard;
+    request.keyboard = keyboard;
+    disposeInWorker(worker_.get(), request);
+}
+
+void fcitx::KeymanKeyboardData::deferClearContext(KeymanState *state) {
+    deferredClear_.push_back(state->watch());
+}
+
+void fcitx::KeymanKeyboardData::applyWorkerResults() {
+    if (!worker_) {
+        return;
+    }
+    KeymanWorkerResult result;
+    while (worker_->pop(result)) {
+        // Result of a key that missed the deadline, it was passed to the
+        // application already.
+        pendingSequence_ = 0;
+    }
+    if (coreBusy()) {
+        return;
+    }
+    for (auto &ref : std::exchange(deferredClear_, {})) {
+        if (auto *state = ref.get()) {
+            state->clearCoreContext();
+        }
+    }
+    if (!deferredOptions_.empty()) {
+        updateOptions(std::exchange(deferredOptions_, {}));
+    }
+}
+
+void fcitx::KeymanKeyboardData::dispatchWorkerResults() {
+    applyWorkerResults();
+    if (worker_ && !coreBusy() && !engine_->workerEnabled()) {
+        worker_.reset();
+    }
+}
 
 void fcitx::KeymanEngine::activate(const fcitx::InputMethodEntry &entry,
                                    fcitx::InputContextEvent &event) {
     auto data = static_cast<const KeymanKeyboard *>(entry.userData());
-    data->load();
-    auto keyman = state(entry, *event.inputContext());
-    if (!keyman) {
-        return;
+    const bool firstActivation = !data->data().loaded();
+    {
+        KEYMAN_TRACE_SCOPE("activate", data->id);
+        data->load();
+        auto keyman = state(entry, *event.inputContext());
+        if (keyman) {
+            keyman->updateContext();
+        }
+    }
+    if (firstActivation) {
+        KeymanTracer::global().flush();
     }
-    keyman->updateContext();
 }
 
 void fcitx::KeymanEngine::keyEvent(const fcitx::InputMethodEntry &entry,
                                    fcitx::KeyEvent &keyEvent) {
+    KeyEventProbe probe(keyEvent);
     auto ic = keyEvent.inputContext();
+    if (recorder_) {
+        recorder_->recordKey(*ic, keyEvent.rawKey(), keyEvent.isRelease());
+    }
     auto keyman = state(entry, *ic);
     if (!keyman) {
         return;
@@ -387,8 +1095,17 @@ void fcitx::KeymanEngine::keyEvent(const fcitx::InputMethodEntry &entry,
     if (keycode_to_vk[keycode] == 0) {
         // key that we don't handles
         if (keyEvent.key().isCursorMove()) {
-            km_core_state_context_clear(keyman->state);
+            keyman->clearContext();
             keyman->updateContext();
+            KeymanFlightRecord record;
+            record.timestamp = keymanNow();
+            record.keycode = keycode;
+            record.states = static_cast<uint32_t>(state);
+            record.flags = KeymanFlightRecord::ContextCleared;
+            if (keyEvent.isRelease()) {
+                record.flags |= KeymanFlightRecord::Release;
+            }
+            keyman->record(record);
         }
         return;
     }
@@ -427,21 +1144,86 @@ void fcitx::KeymanEngine::keyEvent(const fcitx::InputMethodEntry &entry,
         }
     }
 
+    auto &latency = keyman->keyboard()->latency();
+    const auto startTime = keymanNow();
+    // Apply the deferred context changes if the worker is done.
+    keyman->keyboard()->dispatchWorkerResults();
     if (ic->capabilityFlags().test(CapabilityFlag::SurroundingText) &&
         ic->surroundingText().isValid()) {
         keyman->updateContext();
     }
+    const auto processTime = keymanNow();
+    latency.record(KeymanPhase::ContextSync, processTime - startTime);
 
-    FCITX_KEYMAN_DEBUG() << "before process key event context: "
-                         << get_current_context_text_debug(keyman->state);
+    // The worker may still be using the state after a missed deadline.
+    if (!keyman->keyboard()->coreBusy()) {
+        FCITX_KEYMAN_DEBUG() << "before process key event context: "
+                             << get_current_context_text_debug(keyman->state);
+    }
     FCITX_KEYMAN_DEBUG() << "km_mod_state=" << km_mod_state;
-    km_core_process_event(keyman->state, keycode_to_vk[keycode], km_mod_state,
-                          !keyEvent.isRelease(), 0);
-    FCITX_KEYMAN_DEBUG() << "after process key event context : "
-                         << get_current_context_text_debug(keyman->state);
+    KEYMAN_PROBE(process_start, keycode_to_vk[keycode], km_mod_state);
+    const KeymanActions *actions = nullptr;
+    if (sandbox_) {
+        const auto start = keymanNow();
+        if (sandbox_->processEvent(keyman->remoteState(),
+                                   keycode_to_vk[keycode], km_mod_state,
+                                   !keyEvent.isRelease(), processDeadline(),
+                                   actions_)) {
+            actions = &actions_;
+        }
+        keyman->checkCoreCall(KeymanCoreCall::ProcessEvent,
+                              keycode_to_vk[keycode], start, keymanNow());
+    } else if (keyman->keyboard()->coreBusy() || workerEnabled()) {
+        // The worker of a disabled keyboard may still be busy with a key that
+        // missed the deadline.
+        if (keyman->keyboard()->processInWorker(
+                keyman->state, keycode_to_vk[keycode], km_mod_state,
+                !keyEvent.isRelease(), workerResult_)) {
+            keyman->checkCoreCall(KeymanCoreCall::ProcessEvent,
+                                  keycode_to_vk[keycode], workerResult_.start,
+                                  workerResult_.end);
+            actions = &workerResult_.actions;
+        }
+    } else {
+        const auto start = keymanNow();
+        km_core_process_event(keyman->state, keycode_to_vk[keycode],
+                              km_mod_state, !keyEvent.isRelease(), 0);
+        keyman->checkCoreCall(KeymanCoreCall::ProcessEvent,
+                              keycode_to_vk[keycode], start, keymanNow());
+        actions_.assign(km_core_state_get_actions(keyman->state));
+        actions = &actions_;
+    }
+    if (!actions) {
+        // Pass the key to the application, the context of keyman does not
+        // match the text any more.
+        FCITX_KEYMAN_DEBUG() << "Keyman missed the deadline";
+        keyman->count(KeymanCounter::WorkerTimeout);
+        keyman->clearContext();
+        KeymanFlightRecord record;
+        record.timestamp = startTime;
+        record.duration =
+            std::min<uint64_t>(keymanNow() - startTime, UINT32_MAX);
+        record.keycode = keycode;
+        record.states = static_cast<uint32_t>(state);
+        record.modifiers = km_mod_state;
+        record.flags = KeymanFlightRecord::ContextCleared;
+        if (keyEvent.isRelease()) {
+            record.flags |= KeymanFlightRecord::Release;
+        }
+        keyman->record(record);
+        return;
+    }
+    const auto actionTime = keymanNow();
+    KEYMAN_PROBE(process_done, keycode_to_vk[keycode],
+                 actionTime - processTime);
+    keyman->count(KeymanCounter::Keystrokes);
+    latency.record(KeymanPhase::Process, actionTime - processTime);
+    if (!keyman->keyboard()->coreBusy()) {
+        FCITX_KEYMAN_DEBUG() << "after process key event context : "
+                             << get_current_context_text_debug(keyman->state);
+    }
 
-    km_core_actions const *actions = km_core_state_get_actions(keyman->state);
-    auto numOfDelete = actions->code_points_to_delete;
+    auto numOfDelete = actions->deleteCount;
     FCITX_KEYMAN_DEBUG() << "BACK action " << numOfDelete;
 
     if (numOfDelete > 0) {
@@ -450,10 +1232,12 @@ void fcitx::KeymanEngine::keyEvent(const fcitx::InputMethodEntry &entry,
         } else if (ic->capabilityFlags().test(
                        CapabilityFlag::SurroundingText)) {
             ic->deleteSurroundingText(-numOfDelete, numOfDelete);
+            keyman->count(KeymanCounter::SurroundingTextDeleted, numOfDelete);
             FCITX_KEYMAN_DEBUG()
                 << "deleting surrounding text " << numOfDelete << " char(s)";
         } else {
             FCITX_KEYMAN_DEBUG() << "forwarding backspace with reset context";
+            keyman->count(KeymanCounter::BackspaceForwarded, numOfDelete);
             while (numOfDelete) {
                 ic->forwardKey(Key(FcitxKey_BackSpace));
                 numOfDelete -= 1;
@@ -461,48 +1245,81 @@ void fcitx::KeymanEngine::keyEvent(const fcitx::InputMethodEntry &entry,
         }
     }
 
+    keyman->updateHistory(actions->deleteCount, actions->output);
+
     std::string output;
-    if (actions->output) {
-        for (size_t n = 0; actions->output[n]; n++) {
-            output.append(utf8::UCS4ToUTF8(actions->output[n]));
-        }
+    for (auto c : actions->output) {
+        output.append(utf8::UCS4ToUTF8(c));
     }
 
-    if (actions->do_alert) {
+    if (actions->alert) {
         FCITX_KEYMAN_DEBUG() << "ALERT action";
+        keyman->count(KeymanCounter::Alert);
     }
 
+    uint64_t commitDuration = 0;
     if (!output.empty()) {
+        const auto commitTime = keymanNow();
         ic->commitString(output);
+        commitDuration = keymanNow() - commitTime;
+        KEYMAN_PROBE(commit, output.size(), commitDuration);
+        keyman->count(KeymanCounter::CommittedBytes, output.size());
+        latency.record(KeymanPhase::Commit, commitDuration);
     }
-    if (actions->emit_keystroke || emit_keystroke) {
+    if (actions->emitKeystroke || emit_keystroke) {
         FCITX_KEYMAN_DEBUG() << "EMIT_KEYSTROKE action";
         emit_keystroke = false;
+        keyman->count(KeymanCounter::EmitKeystroke);
     } else {
         keyEvent.filterAndAccept();
     }
 
     FCITX_KEYMAN_DEBUG() << "PERSIST_OPT action";
-    for (size_t i = 0; actions->persist_options[i].scope; i++) {
-        if (actions->persist_options[i].key &&
-            actions->persist_options[i].value) {
-            // Put the keyboard option into config
-            FCITX_KEYMAN_DEBUG() << "Saving keyboard option to Config";
-            // Load the current keyboard options from DConf
-            keyman->keyboard()->setOption(actions->persist_options[i].key,
-                                          actions->persist_options[i].value);
-        }
+    for (const auto &[key, value] : actions->persistOptions) {
+        // Put the keyboard option into config
+        FCITX_KEYMAN_DEBUG() << "Saving keyboard option to Config";
+        keyman->keyboard()->setOption(key.data(), value.data());
+        keyman->count(KeymanCounter::PersistedOption);
     }
 
     // TODO: set capslock if actions->new_caps_lock_state !=
     // KM_CORE_CAPS_UNCHANGED
 
+    const auto endTime = keymanNow();
+    latency.record(KeymanPhase::Actions,
+                   endTime - actionTime - commitDuration);
+    latency.record(KeymanPhase::Total, endTime - startTime);
+
+    KeymanFlightRecord record;
+    record.timestamp = startTime;
+    record.duration = std::min<uint64_t>(endTime - startTime, UINT32_MAX);
+    record.keycode = keycode;
+    record.states = static_cast<uint32_t>(state);
+    record.modifiers = km_mod_state;
+    record.deleteCount =
+        std::min<unsigned int>(actions->deleteCount, UINT8_MAX);
+    record.outputLength = std::min<size_t>(utf8::length(output), UINT16_MAX);
+    record.contextHash = keyman->contextHash();
+    if (keyEvent.isRelease()) {
+        record.flags |= KeymanFlightRecord::Release;
+    }
+    if (keyEvent.filtered()) {
+        record.flags |= KeymanFlightRecord::Filtered;
+    }
+    if (actions->alert) {
+        record.flags |= KeymanFlightRecord::Alert;
+    }
+    keyman->record(record);
+
     FCITX_KEYMAN_DEBUG() << "after processing all actions";
 }
 
 void fcitx::KeymanEngine::reset(const fcitx::InputMethodEntry &entry,
                                 fcitx::InputContextEvent &event) {
     auto ic = event.inputContext();
+    if (recorder_) {
+        recorder_->recordReset(*ic);
+    }
     auto keyman = state(entry, *ic);
     if (!keyman) {
         return;
@@ -518,21 +1335,123 @@ fcitx::KeymanEngine::state(const fcitx::InputMethodEntry &entry,
     auto userData = static_cast<const KeymanKeyboard *>(entry.userData());
     auto &data = userData->data();
     // Check if data is ready.
-    if (!data.kbpKeyboard() || !data.factory().registered()) {
+    if (!data.ready() || !data.factory().registered()) {
         return nullptr;
     }
     auto keyman = ic.propertyFor(&data.factory());
-    if (!keyman->state) {
+    if (!keyman->ready()) {
         return nullptr;
     }
     return keyman;
 }
 
+void fcitx::KeymanEngine::reloadOptions(const std::string &id) {
+    auto changed = optionStore_.importIni(id);
+    if (changed.empty()) {
+        return;
+    }
+    FCITX_KEYMAN_DEBUG() << "Reload options of " << id << ": " << changed;
+    if (auto *data = keyboardData(id)) {
+        data->updateOptions(changed);
+    }
+}
+
+std::unordered_map<std::string,
+                   std::array<uint64_t, fcitx::keymanCounterCount>>
+fcitx::KeymanEngine::programCounters() {
+    std::unordered_map<std::string, std::array<uint64_t, keymanCounterCount>>
+        result;
+    instance_->inputContextManager().foreach(
+        [this, &result](InputContext *ic) {
+            for (const auto &[id, data] : keyboards_) {
+                if (!data->factory().registered()) {
+                    continue;
+                }
+                const auto *keyman = ic->propertyFor(&data->factory());
+                auto &values = result[keyman->program()];
+                for (size_t i = 0; i < keymanCounterCount; i++) {
+                    values[i] += keyman->counters().value(
+                        static_cast<KeymanCounter>(i));
+                }
+            }
+            return true;
+        });
+    return result;
+}
+
+std::string fcitx::KeymanEngine::flightRecorderReport() {
+    std::string result;
+    instance_->inputContextManager().foreach(
+        [this, &result](InputContext *ic) {
+            // Records kept before the capability was set are not reported.
+            if (keymanIsSensitive(*ic)) {
+                return true;
+            }
+            for (const auto &[id, data] : keyboards_) {
+                if (!data->factory().registered()) {
+                    continue;
+                }
+                const auto *keyman = ic->propertyFor(&data->factory());
+                auto records = keyman->recorder().snapshot();
+                if (records.empty()) {
+                    continue;
+                }
+                result.append(stringutils::concat(
+                    "Input context ", ic->program(), " (", ic->frontendName(),
+                    "), keyboard ", id, ":\n"));
+                result.append(formatFlightRecords(records));
+            }
+            return true;
+        });
+    return result;
+}
+
+std::vector<fcitx::KeymanMemoryEntry>
+fcitx::KeymanEngine::memoryUsage(size_t topN) {
+    std::vector<KeymanMemoryEntry> entries;
+    uint64_t keyboardTotal = 0;
+    uint64_t stateTotal = 0;
+    for (const auto &[id, data] : keyboards_) {
+        auto usage = data->memoryUsage();
+        keyboardTotal += usage;
+        entries.push_back({"keyboard", id, usage});
+    }
+    instance_->inputContextManager().foreach([&](InputContext *ic) {
+        for (const auto &[id, data] : keyboards_) {
+            if (!data->factory().registered()) {
+                continue;
+            }
+            const auto *keyman = ic->propertyFor(&data->factory());
+            auto usage = keyman->memoryUsage();
+            stateTotal += usage;
+            entries.push_back(
+                {"state", stringutils::concat(id, "@", ic->program()), usage});
+        }
+        return true;
+    });
+    const auto count = std::min(topN, entries.size());
+    std::partial_sort(entries.begin(), entries.begin() + count, entries.end(),
+                      [](const KeymanMemoryEntry &lhs,
+                         const KeymanMemoryEntry &rhs) {
+                          return lhs.bytes > rhs.bytes;
+                      });
+    entries.resize(count);
+    entries.insert(entries.begin(),
+                   {{"total", "keyboards", keyboardTotal},
+                    {"total", "states", stateTotal},
+                    {"total", "catalog", catalogUsage_},
+                    {"total", "heap", keymanHeapUsage()}});
+    return entries;
+}
+
 std::string fcitx::KeymanEngine::subMode(const fcitx::InputMethodEntry &entry,
                                          fcitx::InputContext &ic) {
     auto keyman = state(entry, ic);
     if (!keyman) {
         return _("Not available");
     }
+    if (watchdog_.isSlow(keyman->keyboard()->id())) {
+        return _("Slow");
+    }
     return "";
 }
@@ -7,7 +7,12 @@
 #ifndef _FCITX5_KEYMAN_ENGINE_H_
 #define _FCITX5_KEYMAN_ENGINE_H_
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <thread>
+#include <unordered_map>
 #include <fcitx-config/configuration.h>
 #include <fcitx-config/iniparser.h>
 #include <fcitx-utils/event.h>
@@ -15,6 +20,8 @@
 #include <fcitx-utils/i18n.h>
 #include <fcitx-utils/library.h>
 #include <fcitx-utils/log.h>
+#include <fcitx-utils/misc.h>
+#include <fcitx-utils/trackableobject.h>
 #include <fcitx/action.h>
 #include <fcitx/addonfactory.h>
 #include <fcitx/addonmanager.h>
@@ -24,48 +31,174 @@
 #include <fcitx/instance.h>
 #include <fcitx/menu.h>
 #include <keyman_core_api.h>
+#include "filewatcher.h"
+#include "flightrecorder.h"
+#include "keymanmemory.h"
 #include "kmpmetadata.h"
+#include "optionstore.h"
+#include "recorder.h"
+#include "sandbox.h"
+#include "stats.h"
+#include "transliterator.h"
+#include "watchdog.h"
+#include "worker.h"
 
 namespace fcitx {
 
 class KeymanState;
 class KeymanKeyboard;
+class KeymanEngine;
+class KeymanService;
 
-FCITX_CONFIGURATION(KeymanConfig,
-                    ExternalOption config{this, "Configuration",
-                                          _("Configuration"), "km-config"};);
+FCITX_CONFIGURATION(
+    KeymanConfig,
+    ExternalOption config{this, "Configuration", _("Configuration"),
+                          "km-config"};
+    Option<int, IntConstrain> slowThreshold{
+        this, "SlowThreshold", _("Slow keyboard threshold (ms)"), 20,
+        IntConstrain(1, 1000)};
+    Option<bool> worker{this, "Worker",
+                        _("Process keys in a separate thread"), false};
+    Option<int, IntConstrain> workerDeadline{
+        this, "WorkerDeadline",
+        _("Pass the key to application if it takes longer than (ms)"), 50,
+        IntConstrain(1, 1000)};
+    Option<bool> sandbox{
+        this, "Sandbox",
+        _("Run keyboards in a separate process (requires restart)"), false};);
 
-class KeymanKeyboardData {
+using KeymanKeyboardPtr =
+    UniqueCPtr<km_core_keyboard, km_core_keyboard_dispose>;
+
+// Modification time (in nanoseconds) and size of a file.
+struct KeymanFingerprint {
+    int64_t mtime = 0;
+    int64_t size = 0;
+
+    bool operator==(const KeymanFingerprint &other) const {
+        return mtime == other.mtime && size == other.size;
+    }
+    bool operator!=(const KeymanFingerprint &other) const {
+        return !(*this == other);
+    }
+};
+
+class KeymanKeyboardData : public TrackableObject<KeymanKeyboardData> {
 public:
-    KeymanKeyboardData(Instance *instance, const KeymanKeyboard &metadata);
+    KeymanKeyboardData(KeymanEngine *engine, std::string id,
+                       std::string baseDir);
     ~KeymanKeyboardData();
 
+    // Destroy the states and keyboards, the data may outlive the engine in
+    // the input method entries.
+    void detach();
+
     void load();
-    const auto &metadata() const { return metadata_; }
+    bool loaded() const { return loaded_; }
+    // Whether the keyboard is loaded, either locally or in the sandbox.
+    bool ready() const { return keyboard_ || remoteKeyboard_; }
+    // Handle of the keyboard in sandbox, 0 while it is loaded. The keyboard
+    // is loaded again if the helper is restarted.
+    uint32_t remoteKeyboard();
+    auto *engine() const { return engine_; }
+    // Reload the keyboard in background if the kmx file is changed, existing
+    // states are recreated with the new keyboard.
+    void reload();
+    const auto &id() const { return id_; }
+    const auto &baseDir() const { return baseDir_; }
+    // Keyboard may be moved to a different directory by a newer version, the
+    // new file is used by the next load() or reload().
+    void setBaseDir(const std::string &baseDir);
     auto *kbpKeyboard() const { return keyboard_; }
     const auto &factory() const { return factory_; }
+    const KeymanOptions *options() const;
     void setOption(const km_core_cp *key, const km_core_cp *value);
+    // Apply options to all the existing states.
+    void updateOptions(const KeymanOptions &options);
+    // Whether the worker thread of this keyboard has requests that are not
+    // done. The keyboard and its states must not be used by the main thread
+    // until then.
+    bool coreBusy() const { return worker_ && !worker_->idle(); }
+    // Return false if the worker is still busy with a key that missed the
+    // deadline, or if it misses the deadline.
+    bool processInWorker(km_core_state *state, uint16_t vk, uint16_t modifiers,
+                         bool isKeyDown, KeymanWorkerResult &result);
+    // Dispose in the worker thread if it may still be used by the worker.
+    void disposeState(km_core_state *state);
+    // Clear the context of state once the worker is not busy.
+    void deferClearContext(KeymanState *state);
+    // Apply the deferred changes if the worker is done, and stop the worker
+    // if it is disabled.
+    void dispatchWorkerResults();
+    auto &latency() { return latency_; }
+    const auto &latency() const { return latency_; }
+    auto &counters() { return counters_; }
+    const auto &counters() const { return counters_; }
+    // Transliterator of this keyboard for batch requests, nullptr if the
+    // keyboard is not loaded in this process. Give it back with
+    // releaseTransliterator() so its state can be reused.
+    std::unique_ptr<KeymanTransliterator> acquireTransliterator();
+    void releaseTransliterator(
+        std::unique_ptr<KeymanTransliterator> transliterator);
+    // Size of the kmx file, plus heap allocated by km_core_keyboard_load if
+    // keymanHeapAccounting() is on.
+    size_t memoryUsage() const {
+        return sizeof(*this) + keyboardHeapUsage_ + fingerprint_.size +
+               keymanStringUsage(id_) + keymanStringUsage(baseDir_) +
+               keymanStringUsage(loadedPath_);
+    }
 
 private:
-    Instance *instance_;
+    void swapKeyboard(KeymanKeyboardPtr keyboard, const std::string &path,
+                      const KeymanFingerprint &fingerprint);
+    std::string kmxPath() const;
+    // Load path in the sandbox without waiting, states are recreated if
+    // path or fingerprint is different from the loaded one.
+    void loadRemote(const std::string &path,
+                    const KeymanFingerprint &fingerprint);
+    void disposeKeyboard(km_core_keyboard *keyboard);
+    // Drop late results, and apply the deferred changes if the worker is
+    // done.
+    void applyWorkerResults();
+
+    KeymanEngine *engine_;
     bool loaded_ = false;
+    bool reloading_ = false;
+    bool reloadPending_ = false;
+    std::string id_;
+    std::string baseDir_;
+    // The kmx file that is currently loaded and its fingerprint.
+    std::string loadedPath_;
+    KeymanFingerprint fingerprint_;
     std::string ldmlFile_;
-    const KeymanKeyboard &metadata_;
     km_core_keyboard *keyboard_ = nullptr;
+    size_t keyboardHeapUsage_ = 0;
+    uint32_t remoteKeyboard_ = 0;
+    uint64_t remoteGeneration_ = 0;
     FactoryFor<KeymanState> factory_;
-    RawConfig config_;
+    // Keyboard and states may be disposed by the worker, so it needs to
+    // outlive them.
+    std::unique_ptr<KeymanWorker> worker_;
+    // Sequence of the process request in the worker, 0 if there is none.
+    uint64_t pendingSequence_ = 0;
+    std::vector<TrackableObjectReference<KeymanState>> deferredClear_;
+    // Options changed while the worker is busy.
+    KeymanOptions deferredOptions_;
+    // Idle transliterators, they are separate from the input contexts.
+    std::vector<std::unique_ptr<KeymanTransliterator>> transliterators_;
+    KeymanLatencyStats latency_;
+    KeymanCounters counters_;
 };
 
 class KeymanKeyboard : public InputMethodEntryUserData {
 public:
-    KeymanKeyboard(Instance *instance, const KmpKeyboardMetadata &keyboard,
+    KeymanKeyboard(const KmpKeyboardMetadata &keyboard,
                    const KmpMetadata &metadata, const std::string &dir)
         : id(keyboard.id), version(keyboard.version), baseDir(dir),
           name(keyboard.name),
           language(keyboard.languages.empty() ? ""
                                               : keyboard.languages[0].first),
-          readme(metadata.readmeFile()), graphic(metadata.graphicFile()),
-          data_(instance, *this) {}
+          readme(metadata.readmeFile()), graphic(metadata.graphicFile()) {}
     const std::string id;
     const std::string version;
     const std::string baseDir;
@@ -74,17 +207,57 @@ public:
     const std::string readme;
     const std::string graphic;
 
-    void load() const { data_.load(); }
-    KeymanKeyboardData &data() const { return data_; }
+    void load() const { data_->load(); }
+    KeymanKeyboardData &data() const { return *data_; }
+    void setData(std::shared_ptr<KeymanKeyboardData> data) {
+        data_ = std::move(data);
+    }
+    size_t memoryUsage() const {
+        size_t usage = sizeof(*this);
+        for (const auto *str :
+             {&id, &version, &baseDir, &name, &language, &readme, &graphic}) {
+            usage += keymanStringUsage(*str);
+        }
+        return usage;
+    }
 
 private:
-    mutable KeymanKeyboardData data_;
+    // Shared with the keyboard of the same id from the previous listing.
+    std::shared_ptr<KeymanKeyboardData> data_;
 };
 
 class KeymanEngine final : public InputMethodEngineV2 {
 public:
     KeymanEngine(Instance *instance);
+    ~KeymanEngine();
     Instance *instance() { return instance_; }
+    KeymanOptionStore &optionStore() { return optionStore_; }
+    KeymanWatchdog &watchdog() { return watchdog_; }
+    // nullptr unless keyboards run in fcitx5-keyman-helper.
+    KeymanSandbox *sandbox() { return sandbox_.get(); }
+    // Nanoseconds to wait for the worker or the helper.
+    uint64_t processDeadline() const {
+        return static_cast<uint64_t>(*config_.workerDeadline) * 1000000;
+    }
+    // Whether keys are processed in the worker thread of each keyboard.
+    bool workerEnabled() const { return *config_.worker && !*config_.sandbox; }
+    // Load a keyboard in a background thread, callback is called in the main
+    // thread.
+    // The second argument of callback is the heap allocated by loading.
+    void loadKeyboardAsync(
+        std::string kmxPath,
+        std::function<void(KeymanKeyboardPtr, size_t)> callback);
+    // Reload keyboards under dir when their kmx file is changed.
+    void watchKeyboardDir(const std::string &dir);
+    const auto &keyboards() const { return keyboards_; }
+    // Counters of the existing input contexts, grouped by program.
+    std::unordered_map<std::string,
+                       std::array<uint64_t, keymanCounterCount>>
+    programCounters();
+    // Recent key events of all input contexts.
+    std::string flightRecorderReport();
+    // Totals followed by the topN largest keyboards and states.
+    std::vector<KeymanMemoryEntry> memoryUsage(size_t topN);
     void activate(const fcitx::InputMethodEntry &,
                   fcitx::InputContextEvent &) override;
     void keyEvent(const InputMethodEntry &entry, KeyEvent &keyEvent) override;
@@ -92,6 +265,8 @@ public:
     void reset(const fcitx::InputMethodEntry &,
                fcitx::InputContextEvent &) override;
     const fcitx::Configuration *getConfig() const override { return &config_; }
+    void setConfig(const RawConfig &config) override;
+    void reloadConfig() override;
     std::string subMode(const fcitx::InputMethodEntry &,
                         fcitx::InputContext &) override;
 
@@ -99,9 +274,28 @@ private:
     FCITX_ADDON_DEPENDENCY_LOADER(dbus, instance_->addonManager());
     KeymanState *state(const fcitx::InputMethodEntry &entry,
                        fcitx::InputContext &ic);
+    void reloadOptions(const std::string &id);
+    KeymanKeyboardData *keyboardData(const std::string &id);
 
     Instance *instance_;
     KeymanConfig config_;
+    KeymanOptionStore optionStore_;
+    KeymanWatchdog watchdog_;
+    KeymanFileWatcher fileWatcher_;
+    EventDispatcher dispatcher_;
+    std::unique_ptr<KeymanSandbox> sandbox_;
+    KeymanWorkerResult workerResult_;
+    KeymanActions actions_;
+    std::unordered_map<uint64_t, std::thread> loaders_;
+    // Keyboard id to the keyboard data that are listed.
+    std::unordered_map<std::string, std::shared_ptr<KeymanKeyboardData>>
+        keyboards_;
+    std::unique_ptr<KeymanService> service_;
+    // Set if FCITX_KEYMAN_RECORD is set.
+    std::unique_ptr<KeymanRecorder> recorder_;
+    // Memory of the listed keyboards, kmp.json is not kept after listing.
+    size_t catalogUsage_ = 0;
+    uint64_t nextLoaderId_ = 0;
     std::unique_ptr<HandlerTableEntry<EventHandler>> updateHandler_;
     int64_t timestamp_ = 0;
     bool emit_keystroke = false;
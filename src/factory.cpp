@@ -0,0 +1,13 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "engine.h"
+
+namespace fcitx {
+
+FCITX_ADDON_FACTORY(fcitx::KeymanEngineFactory);
+
+} // namespace fcitx
@@ -0,0 +1,81 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "filewatcher.h"
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#include "keymanlog.h"
+
+namespace fcitx {
+
+KeymanFileWatcher::KeymanFileWatcher(EventLoop *loop) {
+    fd_.give(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (!fd_.isValid()) {
+        FCITX_KEYMAN_WARN() << "Failed to initialize inotify.";
+        return;
+    }
+    event_ = loop->addIOEvent(fd_.fd(), IOEventFlag::In,
+                              [this](EventSourceIO *, int, IOEventFlags) {
+                                  dispatch();
+                                  return true;
+                              });
+}
+
+bool KeymanFileWatcher::watch(const std::string &dir, Callback callback) {
+    if (!fd_.isValid()) {
+        return false;
+    }
+    int wd = inotify_add_watch(fd_.fd(), dir.data(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        FCITX_KEYMAN_DEBUG() << "Failed to watch " << dir;
+        return false;
+    }
+    // The same directory always get the same watch descriptor.
+    watches_[wd] = {dir, std::move(callback)};
+    dirs_[dir] = wd;
+    return true;
+}
+
+void KeymanFileWatcher::unwatch(const std::string &dir) {
+    auto iter = dirs_.find(dir);
+    if (iter == dirs_.end()) {
+        return;
+    }
+    inotify_rm_watch(fd_.fd(), iter->second);
+    watches_.erase(iter->second);
+    dirs_.erase(iter);
+}
+
+void KeymanFileWatcher::dispatch() {
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        auto length = read(fd_.fd(), buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (auto *ptr = buffer; ptr < buffer + length;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+            if (!event->len) {
+                continue;
+            }
+            auto iter = watches_.find(event->wd);
+            if (iter == watches_.end()) {
+                continue;
+            }
+            // Copy the callback, it may unwatch the directory.
+            auto callback = iter->second.second;
+            callback(event->name);
+        }
+    }
+}
+
+} // namespace fcitx
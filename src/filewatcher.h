@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_FILEWATCHER_H_
+#define _FCITX5_KEYMAN_FILEWATCHER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/unixfd.h>
+
+namespace fcitx {
+
+// Watch files being written or renamed into a set of directories with
+// inotify.
+class KeymanFileWatcher {
+public:
+    // Called with the file name relative to the watched directory.
+    using Callback = std::function<void(const std::string &name)>;
+
+    KeymanFileWatcher(EventLoop *loop);
+
+    bool watch(const std::string &dir, Callback callback);
+    void unwatch(const std::string &dir);
+
+private:
+    void dispatch();
+
+    UnixFD fd_;
+    std::unique_ptr<EventSourceIO> event_;
+    // watch descriptor to directory and callback.
+    std::unordered_map<int, std::pair<std::string, Callback>> watches_;
+    std::unordered_map<std::string, int> dirs_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_FILEWATCHER_H_
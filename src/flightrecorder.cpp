@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "flightrecorder.h"
+#include <cinttypes>
+#include <cstdio>
+
+namespace fcitx {
+
+std::string
+formatFlightRecords(const std::vector<KeymanFlightRecord> &records) {
+    std::string result;
+    if (records.empty()) {
+        return result;
+    }
+    const auto start = records.front().timestamp;
+    for (const auto &record : records) {
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "+%10.3fms keycode=%-3u states=0x%04" PRIx32
+                 " modifiers=0x%02x %-7s del=%-3u out=%-3u context=%08" PRIx32
+                 " %7.1fus%s%s%s\n",
+                 (record.timestamp - start) / 1e6, record.keycode,
+                 record.states, record.modifiers,
+                 (record.flags & KeymanFlightRecord::Release) ? "release"
+                                                              : "press",
+                 record.deleteCount, record.outputLength, record.contextHash,
+                 record.duration / 1e3,
+                 (record.flags & KeymanFlightRecord::Filtered) ? " filtered"
+                                                               : "",
+                 (record.flags & KeymanFlightRecord::Alert) ? " alert" : "",
+                 (record.flags & KeymanFlightRecord::ContextCleared)
+                     ? " context-cleared"
+                     : "");
+        result.append(line);
+    }
+    return result;
+}
+
+} // namespace fcitx
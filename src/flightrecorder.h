@@ -0,0 +1,119 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_FLIGHTRECORDER_H_
+#define _FCITX5_KEYMAN_FLIGHTRECORDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fcitx {
+
+struct KeymanFlightRecord {
+    enum Flag : uint8_t {
+        Release = 1 << 0,
+        Filtered = 1 << 1,
+        Alert = 1 << 2,
+        // Context is cleared by cursor movement.
+        ContextCleared = 1 << 3,
+    };
+
+    // CLOCK_MONOTONIC in nanoseconds.
+    uint64_t timestamp = 0;
+    uint32_t duration = 0;
+    uint32_t states = 0;
+    uint32_t contextHash = 0;
+    uint16_t keycode = 0;
+    uint16_t modifiers = 0;
+    uint16_t outputLength = 0;
+    uint8_t deleteCount = 0;
+    uint8_t flags = 0;
+};
+
+// Fixed size ring buffer of the recent key events of an input context.
+// There is only one writer, readers may run on any thread and skip the
+// entries that are being overwritten. The ring is allocated by the first
+// record, most input contexts never get a key of every keyboard.
+class KeymanFlightRecorder {
+public:
+    static constexpr size_t capacity = 256;
+
+    void record(const KeymanFlightRecord &record) {
+        auto *slots = slots_.load(std::memory_order_relaxed);
+        if (!slots) {
+            storage_ = std::make_unique<Slot[]>(capacity);
+            slots = storage_.get();
+            slots_.store(slots, std::memory_order_release);
+        }
+        const auto index = next_.load(std::memory_order_relaxed);
+        auto &slot = slots[index % capacity];
+        slot.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.record = record;
+        slot.sequence.store(index * 2 + 2, std::memory_order_release);
+        next_.store(index + 1, std::memory_order_release);
+    }
+
+    // Records from the oldest to the newest.
+    std::vector<KeymanFlightRecord> snapshot() const {
+        std::vector<KeymanFlightRecord> result;
+        const auto end = next_.load(std::memory_order_acquire);
+        const auto *slots = slots_.load(std::memory_order_acquire);
+        if (!slots) {
+            return result;
+        }
+        const auto begin = end > capacity ? end - capacity : 0;
+        result.reserve(end - begin);
+        for (auto index = begin; index < end; index++) {
+            const auto &slot = slots[index % capacity];
+            const auto sequence =
+                slot.sequence.load(std::memory_order_acquire);
+            KeymanFlightRecord record = slot.record;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence != index * 2 + 2 ||
+                slot.sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;
+            }
+            result.push_back(record);
+        }
+        return result;
+    }
+
+    size_t memoryUsage() const {
+        return slots_.load(std::memory_order_relaxed) ? capacity * sizeof(Slot)
+                                                      : 0;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        KeymanFlightRecord record;
+    };
+    std::atomic<uint64_t> next_{0};
+    std::atomic<Slot *> slots_{nullptr};
+    std::unique_ptr<Slot[]> storage_;
+};
+
+// FNV-1a hash, used to tell whether the context differs between events
+// without storing the text.
+template <typename Iter>
+uint32_t keymanContextHash(Iter begin, Iter end) {
+    uint32_t hash = 2166136261U;
+    for (; begin != end; ++begin) {
+        hash = (hash ^ static_cast<uint32_t>(*begin)) * 16777619U;
+    }
+    return hash;
+}
+
+// Human readable report of records.
+std::string formatFlightRecords(const std::vector<KeymanFlightRecord> &records);
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_FLIGHTRECORDER_H_
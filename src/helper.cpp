@@ -0,0 +1,281 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+
+// fcitx5-keyman-helper owns the keyman core keyboards and states when the
+// sandbox option is enabled, so a misbehaving keyboard can not crash or
+// stall fcitx. It is started by the addon, see sandboxprotocol.h.
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcitx-utils/log.h>
+#include <keyman_core_api.h>
+#include "coreutils.h"
+#include "keymanlog.h"
+#include "sandboxprotocol.h"
+#include "stats.h"
+
+FCITX_DEFINE_LOG_CATEGORY(keyman, "keyman");
+
+namespace fcitx {
+
+namespace {
+
+// Keep polling for a while before sleeping, keys tend to come in bursts.
+uint64_t spinDuration() {
+    static const uint64_t duration =
+        std::thread::hardware_concurrency() > 1 ? 50000 : 0;
+    return duration;
+}
+
+KeymanOptions decodeOptions(const KeymanSandboxMessage &message) {
+    KeymanOptions options;
+    std::string_view payload(message.payload, message.size);
+    while (!payload.empty()) {
+        auto keyEnd = payload.find('\0');
+        if (keyEnd == std::string_view::npos) {
+            break;
+        }
+        auto valueEnd = payload.find('\0', keyEnd + 1);
+        if (valueEnd == std::string_view::npos) {
+            break;
+        }
+        options[std::string(payload.substr(0, keyEnd))] =
+            std::string(payload.substr(keyEnd + 1, valueEnd - keyEnd - 1));
+        payload.remove_prefix(valueEnd + 1);
+    }
+    return options;
+}
+
+// Return false if the actions do not fit into the payload.
+bool encodeActions(const km_core_actions *actions,
+                   KeymanSandboxMessage &message) {
+    size_t outputLength = 0;
+    while (actions->output && actions->output[outputLength]) {
+        outputLength++;
+    }
+    char *cursor = message.payload;
+    char *const end = message.payload + KeymanSandboxMessage::maxPayload;
+    auto put = [&cursor, end](const void *data, size_t size) {
+        if (static_cast<size_t>(end - cursor) < size) {
+            return false;
+        }
+        memcpy(cursor, data, size);
+        cursor += size;
+        return true;
+    };
+    const uint32_t deleteCount = actions->code_points_to_delete;
+    const uint8_t alert = actions->do_alert;
+    const uint8_t emitKeystroke = actions->emit_keystroke;
+    const uint16_t length = outputLength;
+    if (outputLength > UINT16_MAX ||
+        !put(&deleteCount, sizeof(deleteCount)) ||
+        !put(&alert, sizeof(alert)) ||
+        !put(&emitKeystroke, sizeof(emitKeystroke)) ||
+        !put(&length, sizeof(length))) {
+        return false;
+    }
+    for (size_t i = 0; i < outputLength; i++) {
+        const uint32_t c = actions->output[i];
+        if (!put(&c, sizeof(c))) {
+            return false;
+        }
+    }
+    for (size_t i = 0; actions->persist_options[i].scope; i++) {
+        if (!actions->persist_options[i].key ||
+            !actions->persist_options[i].value) {
+            continue;
+        }
+        for (const auto *str : {actions->persist_options[i].key,
+                                actions->persist_options[i].value}) {
+            size_t n = 0;
+            do {
+                const uint16_t c = str[n];
+                if (!put(&c, sizeof(c))) {
+                    return false;
+                }
+            } while (str[n++]);
+        }
+    }
+    message.size = cursor - message.payload;
+    return true;
+}
+
+class KeymanHelper {
+public:
+    KeymanHelper(KeymanSandboxShared *shared) : shared_(shared) {}
+    ~KeymanHelper() {
+        for (auto &[handle, state] : states_) {
+            km_core_state_dispose(state);
+        }
+        for (auto &[handle, keyboard] : keyboards_) {
+            km_core_keyboard_dispose(keyboard);
+        }
+    }
+
+    void run() {
+        while (true) {
+            const auto *request = waitRequest();
+            if (!request) {
+                return;
+            }
+            KeymanSandboxMessage *response;
+            while (!(response = shared_->responses.reserve())) {
+                // The addon always drains responses before sending more
+                // requests than the capacity.
+                usleep(100);
+            }
+            response->command = request->command;
+            response->sequence = request->sequence;
+            response->handle = 0;
+            response->status = 0;
+            response->size = 0;
+            handle(*request, *response);
+            shared_->requests.pop();
+            shared_->responses.commit(keymanSandboxResponseFd);
+        }
+    }
+
+private:
+    const KeymanSandboxMessage *waitRequest() {
+        auto &requests = shared_->requests;
+        const auto spinEnd = keymanNow() + spinDuration();
+        while (true) {
+            if (const auto *request = requests.front()) {
+                return request;
+            }
+            if (keymanNow() < spinEnd) {
+                continue;
+            }
+            if (!requests.prepareSleep()) {
+                continue;
+            }
+            uint64_t value;
+            auto ret = read(keymanSandboxRequestFd, &value, sizeof(value));
+            requests.wakeUp();
+            if (ret < 0 && errno != EINTR) {
+                return nullptr;
+            }
+        }
+    }
+
+    void handle(const KeymanSandboxMessage &request,
+                KeymanSandboxMessage &response) {
+        switch (static_cast<KeymanSandboxCommand>(request.command)) {
+        case KeymanSandboxCommand::LoadKeyboard: {
+            std::string path(request.payload, request.size);
+            km_core_keyboard *keyboard = nullptr;
+            if (km_core_keyboard_load(path.data(), &keyboard) !=
+                KM_CORE_STATUS_OK) {
+                response.status = -1;
+                return;
+            }
+            response.handle = nextHandle_++;
+            keyboards_[response.handle] = keyboard;
+            return;
+        }
+        case KeymanSandboxCommand::DisposeKeyboard:
+            if (auto iter = keyboards_.find(request.handle);
+                iter != keyboards_.end()) {
+                km_core_keyboard_dispose(iter->second);
+                keyboards_.erase(iter);
+            }
+            return;
+        case KeymanSandboxCommand::CreateState: {
+            auto iter = keyboards_.find(request.handle);
+            km_core_state *state = nullptr;
+            if (iter == keyboards_.end() ||
+                keymanCreateState(iter->second, &state) != KM_CORE_STATUS_OK) {
+                response.status = -1;
+                return;
+            }
+            updateKeyboardOptions(state, decodeOptions(request));
+            response.handle = nextHandle_++;
+            states_[response.handle] = state;
+            return;
+        }
+        case KeymanSandboxCommand::DisposeState:
+            if (auto iter = states_.find(request.handle);
+                iter != states_.end()) {
+                km_core_state_dispose(iter->second);
+                states_.erase(iter);
+            }
+            return;
+        default:
+            break;
+        }
+
+        auto iter = states_.find(request.handle);
+        if (iter == states_.end()) {
+            response.status = -1;
+            return;
+        }
+        auto *state = iter->second;
+        switch (static_cast<KeymanSandboxCommand>(request.command)) {
+        case KeymanSandboxCommand::SetContext: {
+            const auto length = request.size / sizeof(char16_t);
+            if (!length) {
+                response.status = -1;
+                return;
+            }
+            std::vector<km_core_cp> context(length);
+            memcpy(context.data(), request.payload,
+                   length * sizeof(char16_t));
+            context.back() = 0;
+            response.status =
+                km_core_state_context_set_if_needed(state, context.data());
+            return;
+        }
+        case KeymanSandboxCommand::ClearContext:
+            km_core_state_context_clear(state);
+            return;
+        case KeymanSandboxCommand::UpdateOptions:
+            updateKeyboardOptions(state, decodeOptions(request));
+            return;
+        case KeymanSandboxCommand::ProcessEvent:
+            km_core_process_event(state, request.vk, request.modifiers,
+                                  request.isKeyDown, 0);
+            if (!encodeActions(km_core_state_get_actions(state), response)) {
+                response.status = -1;
+            }
+            return;
+        default:
+            response.status = -1;
+            return;
+        }
+    }
+
+    KeymanSandboxShared *shared_;
+    uint32_t nextHandle_ = 1;
+    std::unordered_map<uint32_t, km_core_keyboard *> keyboards_;
+    std::unordered_map<uint32_t, km_core_state *> states_;
+};
+
+} // namespace
+
+} // namespace fcitx
+
+int main() {
+    using namespace fcitx;
+    auto *shared = static_cast<KeymanSandboxShared *>(
+        mmap(nullptr, sizeof(KeymanSandboxShared), PROT_READ | PROT_WRITE,
+             MAP_SHARED, keymanSandboxSharedFd, 0));
+    if (shared == MAP_FAILED || shared->magic != keymanSandboxMagic) {
+        FCITX_KEYMAN_ERROR() << "fcitx5-keyman-helper must be started by "
+                                "fcitx5-keyman.";
+        return 1;
+    }
+    KeymanHelper helper(shared);
+    helper.run();
+    return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_KEYMANLOG_H_
+#define _FCITX5_KEYMAN_KEYMANLOG_H_
+
+#include <fcitx-utils/log.h>
+
+FCITX_DECLARE_LOG_CATEGORY(keyman);
+#define FCITX_KEYMAN_DEBUG() FCITX_LOGC(::keyman, Debug)
+#define FCITX_KEYMAN_WARN() FCITX_LOGC(::keyman, Warn)
+#define FCITX_KEYMAN_ERROR() FCITX_LOGC(::keyman, Error)
+
+#endif // _FCITX5_KEYMAN_KEYMANLOG_H_
@@ -0,0 +1,80 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_KEYMANMEMORY_H_
+#define _FCITX5_KEYMAN_KEYMANMEMORY_H_
+
+#include <malloc.h>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+
+namespace fcitx {
+
+// Bytes currently allocated from the heap by the whole process. Allocations
+// from other threads are included, so a delta is an estimate.
+inline size_t keymanHeapUsage() {
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    const auto info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+    const auto info = mallinfo();
+    return static_cast<unsigned int>(info.uordblks) +
+           static_cast<unsigned int>(info.hblkhd);
+#else
+    return 0;
+#endif
+}
+
+inline size_t keymanHeapDelta(size_t before, size_t after) {
+    return after > before ? after - before : 0;
+}
+
+// Whether the heap allocated by keyboard loads and state creations is
+// measured. keymanHeapUsage locks and walks every malloc arena, so it is only
+// done if FCITX_KEYMAN_MEMORY is set.
+inline bool keymanHeapAccounting() {
+    static const bool enabled = []() {
+        const char *value = getenv("FCITX_KEYMAN_MEMORY");
+        return value && value[0];
+    }();
+    return enabled;
+}
+
+// Heap growth since construction, 0 unless keymanHeapAccounting() is on.
+class KeymanHeapMeter {
+public:
+    KeymanHeapMeter()
+        : before_(keymanHeapAccounting() ? keymanHeapUsage() : 0) {}
+
+    size_t delta() const {
+        return keymanHeapAccounting()
+                   ? keymanHeapDelta(before_, keymanHeapUsage())
+                   : 0;
+    }
+
+private:
+    size_t before_;
+};
+
+// Heap memory used by a string, short strings are stored inline.
+inline size_t keymanStringUsage(const std::string &str) {
+    static const size_t inlineCapacity = std::string().capacity();
+    return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0;
+}
+
+struct KeymanMemoryEntry {
+    // "keyboard" or "state".
+    std::string kind;
+    std::string name;
+    uint64_t bytes;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_KEYMANMEMORY_H_
@@ -10,6 +10,7 @@
 #include <fcitx-utils/misc.h>
 #include <fcitx-utils/stringutils.h>
 #include <json-c/json.h>
+#include "keymanmemory.h"
 
 namespace fcitx {
 
@@ -117,4 +118,35 @@ KmpMetadata::KmpMetadata(int fd) {
     }
 }
 
+size_t KmpMetadata::memoryUsage() const {
+    // Node of unordered_map, with next pointer and cached hash.
+    constexpr size_t nodeOverhead = sizeof(void *) * 2;
+    size_t usage = 0;
+    for (const auto *str : {&keymanDeveloperVersion_, &fileVersion_, &name_,
+                            &version_, &copyright_, &author_, &website_,
+                            &readmeFile_, &graphicFile_}) {
+        usage += keymanStringUsage(*str);
+    }
+    usage += files_.bucket_count() * sizeof(void *);
+    for (const auto &[name, description] : files_) {
+        usage += nodeOverhead + sizeof(std::pair<std::string, std::string>) +
+                 keymanStringUsage(name) + keymanStringUsage(description);
+    }
+    usage += keyboards_.bucket_count() * sizeof(void *);
+    for (const auto &[id, keyboard] : keyboards_) {
+        usage += nodeOverhead +
+                 sizeof(std::pair<std::string, KmpKeyboardMetadata>) +
+                 keymanStringUsage(id) + keymanStringUsage(keyboard.id) +
+                 keymanStringUsage(keyboard.name) +
+                 keymanStringUsage(keyboard.version) +
+                 keyboard.languages.capacity() *
+                     sizeof(std::pair<std::string, std::string>);
+        for (const auto &[languageId, languageName] : keyboard.languages) {
+            usage +=
+                keymanStringUsage(languageId) + keymanStringUsage(languageName);
+        }
+    }
+    return usage;
+}
+
 } // namespace fcitx
@@ -42,6 +42,9 @@ public:
     const auto &readmeFile() const { return readmeFile_; }
     const auto &graphicFile() const { return graphicFile_; }
 
+    // Estimated heap memory used by the metadata.
+    size_t memoryUsage() const;
+
 private:
     // System
     std::string keymanDeveloperVersion_;
@@ -0,0 +1,370 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "optionstore.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include <fcitx-config/iniparser.h>
+#include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/standardpath.h>
+#include <fcitx-utils/stringutils.h>
+#include "keymanlog.h"
+
+namespace fcitx {
+
+namespace {
+
+constexpr std::string_view optionStoreFile = "keyman/options.db";
+constexpr std::string_view optionStoreMagic = "KMOPTDB1";
+// Only compact when the file is reasonably large.
+constexpr size_t optionStoreCompactSize = 4096;
+
+enum : uint8_t {
+    RecordValue = 1,
+    // key is the mtime of imported ini file. Followed by a RecordImportValue
+    // for every value in the file.
+    RecordImport = 2,
+    RecordImportValue = 3,
+    // The key is removed from the options.
+    RecordRemove = 4,
+};
+
+// Record layout: type (1 byte), payload length (4 bytes), payload.
+// Payload is "id\0key\0value\0".
+constexpr size_t recordHeaderSize = 1 + sizeof(uint32_t);
+
+size_t recordSize(const std::string &id, const std::string &key,
+                  const std::string &value) {
+    return recordHeaderSize + id.size() + key.size() + value.size() + 3;
+}
+
+void appendRecord(std::string &buffer, uint8_t type, const std::string &id,
+                  const std::string &key, const std::string &value) {
+    uint32_t length = id.size() + key.size() + value.size() + 3;
+    buffer.push_back(static_cast<char>(type));
+    buffer.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    for (const auto *str : {&id, &key, &value}) {
+        buffer.append(*str);
+        buffer.push_back('\0');
+    }
+}
+
+int64_t modifiedTimeNs(const std::string &path) {
+    struct stat statBuf;
+    if (stat(path.data(), &statBuf) != 0) {
+        return 0;
+    }
+    return static_cast<int64_t>(statBuf.st_mtim.tv_sec) * 1000000000 +
+           statBuf.st_mtim.tv_nsec;
+}
+
+} // namespace
+
+KeymanOptionStore::KeymanOptionStore(KeymanOptionStoreMode mode)
+    : mode_(mode) {}
+
+const KeymanOptions *KeymanOptionStore::options(const std::string &id) {
+    ensureOpen();
+    if (mode_ == KeymanOptionStoreMode::ReadOnly) {
+        // Nothing watches keyman/<id>.conf for a read only store.
+        importIni(id);
+    }
+    if (auto iter = options_.find(id); iter != options_.end()) {
+        return &iter->second;
+    }
+    return nullptr;
+}
+
+void KeymanOptionStore::setOption(const std::string &id,
+                                  const std::string &key,
+                                  const std::string &value) {
+    ensureOpen();
+    if (auto iter = options_.find(id); iter != options_.end()) {
+        if (auto valueIter = iter->second.find(key);
+            valueIter != iter->second.end() && valueIter->second == value) {
+            return;
+        }
+    }
+    set(id, key, value);
+    append(RecordValue, id, key, value);
+    writeIni(id);
+    compact();
+}
+
+void KeymanOptionStore::writeIni(const std::string &id) {
+    if (mode_ == KeymanOptionStoreMode::ReadOnly) {
+        return;
+    }
+    const auto path = stringutils::concat("keyman/", id, ".conf");
+    RawConfig config;
+    for (const auto &[key, value] : options_[id]) {
+        config.setValueByPath(key, value);
+    }
+    if (!safeSaveAsIni(config, path)) {
+        FCITX_KEYMAN_WARN() << "Failed to save " << path;
+        return;
+    }
+    // Do not import our own write again.
+    auto &imported = imported_[id];
+    imported.mtime = modifiedTimeNs(stringutils::joinPath(
+        StandardPath::global().userDirectory(StandardPath::Type::PkgConfig),
+        path));
+    imported.values = options_[id];
+    appendImport(id);
+}
+
+KeymanOptions KeymanOptionStore::importIni(const std::string &id) {
+    ensureOpen();
+    const auto path = stringutils::concat("keyman/", id, ".conf");
+    auto file = StandardPath::global().locate(StandardPath::Type::PkgConfig,
+                                              path);
+    if (file.empty()) {
+        return {};
+    }
+    const auto mtime = modifiedTimeNs(file);
+    auto &imported = imported_[id];
+    if (imported.mtime == mtime) {
+        return {};
+    }
+
+    RawConfig config;
+    readAsIni(config, path);
+    KeymanOptions values;
+    for (const auto &key : config.subItems()) {
+        if (const auto *value = config.valueByPath(key)) {
+            values[key] = *value;
+        }
+    }
+    // Only apply the keys that another tool changed in the file since the
+    // last import, the other keys may be persisted by the keyboard since.
+    KeymanOptions changed;
+    auto &keyboardOptions = options_[id];
+    for (const auto &[key, value] : values) {
+        if (auto iter = imported.values.find(key);
+            iter != imported.values.end() && iter->second == value) {
+            continue;
+        }
+        if (auto iter = keyboardOptions.find(key);
+            iter != keyboardOptions.end() && iter->second == value) {
+            continue;
+        }
+        set(id, key, value);
+        append(RecordValue, id, key, value);
+        changed[key] = value;
+    }
+    for (const auto &[key, value] : imported.values) {
+        if (!values.count(key) && keyboardOptions.erase(key)) {
+            append(RecordRemove, id, key, "");
+        }
+    }
+    imported.mtime = mtime;
+    imported.values = std::move(values);
+    appendImport(id);
+    compact();
+    return changed;
+}
+
+void KeymanOptionStore::appendImport(const std::string &id) {
+    const auto &imported = imported_[id];
+    append(RecordImport, id, std::to_string(imported.mtime), "");
+    for (const auto &[key, value] : imported.values) {
+        append(RecordImportValue, id, key, value);
+    }
+}
+
+void KeymanOptionStore::ensureOpen() {
+    if (opened_) {
+        return;
+    }
+    opened_ = true;
+
+    const auto path = stringutils::joinPath(
+        StandardPath::global().userDirectory(StandardPath::Type::PkgConfig),
+        optionStoreFile);
+    if (mode_ == KeymanOptionStoreMode::ReadOnly) {
+        // A missing store only means that no option is set yet.
+        fd_.give(::open(path.data(), O_RDONLY | O_CLOEXEC));
+        if (fd_.isValid()) {
+            readFile();
+            fd_.reset();
+        }
+        return;
+    }
+    fs::makePath(fs::dirName(path));
+    fd_.give(::open(path.data(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0600));
+    if (!fd_.isValid()) {
+        FCITX_KEYMAN_ERROR() << "Failed to open keyman option store: " << path;
+        return;
+    }
+
+    readFile();
+    if (fileSize_ == 0) {
+        // New or corrupted file.
+        if (ftruncate(fd_.fd(), 0) == 0) {
+            fs::safeWrite(fd_.fd(), optionStoreMagic.data(),
+                          optionStoreMagic.size());
+            fileSize_ = optionStoreMagic.size();
+        }
+    }
+
+    // Migrate the legacy per keyboard files.
+    std::vector<std::string> legacyFiles;
+    StandardPath::global().scanFiles(
+        StandardPath::Type::PkgConfig, "keyman",
+        [&legacyFiles](const std::string &path, const std::string &, bool) {
+            if (stringutils::endsWith(path, ".conf")) {
+                legacyFiles.push_back(path.substr(0, path.size() - 5));
+            }
+            return true;
+        });
+    for (const auto &id : legacyFiles) {
+        importIni(id);
+    }
+}
+
+void KeymanOptionStore::readFile() {
+    struct stat statBuf;
+    if (fstat(fd_.fd(), &statBuf) == 0 &&
+        static_cast<size_t>(statBuf.st_size) >= optionStoreMagic.size()) {
+        auto *data = mmap(nullptr, statBuf.st_size, PROT_READ, MAP_PRIVATE,
+                          fd_.fd(), 0);
+        if (data != MAP_FAILED) {
+            parse(static_cast<const char *>(data), statBuf.st_size);
+            munmap(data, statBuf.st_size);
+        }
+    }
+}
+
+void KeymanOptionStore::parse(const char *data, size_t size) {
+    if (std::string_view(data, optionStoreMagic.size()) != optionStoreMagic) {
+        FCITX_KEYMAN_WARN() << "Invalid keyman option store, discarding it.";
+        return;
+    }
+    size_t offset = optionStoreMagic.size();
+    while (offset + recordHeaderSize <= size) {
+        const uint8_t type = data[offset];
+        uint32_t length;
+        memcpy(&length, data + offset + 1, sizeof(length));
+        const auto *payload = data + offset + recordHeaderSize;
+        if (length > size - offset - recordHeaderSize) {
+            break;
+        }
+        std::string_view fields[3];
+        size_t field = 0;
+        for (size_t start = 0, i = 0; i < length && field < 3; i++) {
+            if (payload[i] == '\0') {
+                fields[field++] = std::string_view(payload + start, i - start);
+                start = i + 1;
+            }
+        }
+        if (field != 3) {
+            break;
+        }
+        std::string id{fields[0]};
+        if (type == RecordValue) {
+            set(id, std::string{fields[1]}, std::string{fields[2]});
+        } else if (type == RecordImport) {
+            auto &imported = imported_[id];
+            imported.mtime =
+                std::strtoll(std::string{fields[1]}.data(), nullptr, 10);
+            imported.values.clear();
+        } else if (type == RecordImportValue) {
+            imported_[id].values[std::string{fields[1]}] =
+                std::string{fields[2]};
+        } else if (type == RecordRemove) {
+            if (auto iter = options_.find(id); iter != options_.end()) {
+                iter->second.erase(std::string{fields[1]});
+            }
+        }
+        offset += recordHeaderSize + length;
+    }
+    fileSize_ = offset;
+    if (offset != size && mode_ == KeymanOptionStoreMode::ReadWrite) {
+        // Drop the partially written record at the end.
+        FCITX_KEYMAN_WARN() << "Truncating keyman option store at " << offset;
+        if (ftruncate(fd_.fd(), offset) != 0) {
+            fileSize_ = 0;
+        }
+    }
+}
+
+void KeymanOptionStore::set(const std::string &id, const std::string &key,
+                            const std::string &value) {
+    options_[id][key] = value;
+}
+
+void KeymanOptionStore::append(uint8_t type, const std::string &id,
+                               const std::string &key,
+                               const std::string &value) {
+    if (mode_ == KeymanOptionStoreMode::ReadOnly || !fd_.isValid()) {
+        return;
+    }
+    std::string buffer;
+    appendRecord(buffer, type, id, key, value);
+    if (fs::safeWrite(fd_.fd(), buffer.data(), buffer.size()) ==
+        static_cast<ssize_t>(buffer.size())) {
+        fileSize_ += buffer.size();
+    }
+}
+
+void KeymanOptionStore::compact() {
+    if (mode_ == KeymanOptionStoreMode::ReadOnly) {
+        return;
+    }
+    size_t liveSize = optionStoreMagic.size();
+    for (const auto &[id, keyboardOptions] : options_) {
+        for (const auto &[key, value] : keyboardOptions) {
+            liveSize += recordSize(id, key, value);
+        }
+    }
+    for (const auto &[id, imported] : imported_) {
+        liveSize += recordSize(id, std::to_string(imported.mtime), "");
+        for (const auto &[key, value] : imported.values) {
+            liveSize += recordSize(id, key, value);
+        }
+    }
+    if (fileSize_ < optionStoreCompactSize || fileSize_ < liveSize * 2) {
+        return;
+    }
+
+    std::string buffer{optionStoreMagic};
+    buffer.reserve(liveSize);
+    for (const auto &[id, keyboardOptions] : options_) {
+        for (const auto &[key, value] : keyboardOptions) {
+            appendRecord(buffer, RecordValue, id, key, value);
+        }
+    }
+    for (const auto &[id, imported] : imported_) {
+        appendRecord(buffer, RecordImport, id, std::to_string(imported.mtime),
+                     "");
+        for (const auto &[key, value] : imported.values) {
+            appendRecord(buffer, RecordImportValue, id, key, value);
+        }
+    }
+    if (!StandardPath::global().safeSave(
+            StandardPath::Type::PkgConfig, std::string{optionStoreFile},
+            [&buffer](int fd) {
+                return fs::safeWrite(fd, buffer.data(), buffer.size()) ==
+                       static_cast<ssize_t>(buffer.size());
+            })) {
+        return;
+    }
+    const auto path = stringutils::joinPath(
+        StandardPath::global().userDirectory(StandardPath::Type::PkgConfig),
+        optionStoreFile);
+    fd_.give(::open(path.data(), O_RDWR | O_APPEND | O_CLOEXEC));
+    fileSize_ = buffer.size();
+}
+
+} // namespace fcitx
@@ -0,0 +1,83 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_OPTIONSTORE_H_
+#define _FCITX5_KEYMAN_OPTIONSTORE_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <fcitx-utils/unixfd.h>
+
+namespace fcitx {
+
+using KeymanOptions = std::unordered_map<std::string, std::string>;
+
+enum class KeymanOptionStoreMode {
+    ReadWrite,
+    // Never create or modify any file, for tools that run outside of fcitx.
+    ReadOnly,
+};
+
+// Keyboard options of all keyboards, stored in a single append only file
+// keyman/options.db under the user config directory.
+//
+// The file is a header followed by a sequence of records. Each record
+// overrides earlier records with the same keyboard id and key. New values are
+// appended to the end of the file, and the file is rewritten with only live
+// records once the garbage is larger than the live data.
+//
+// The per keyboard files keyman/<id>.conf are still written for other tools
+// like km-config, and are imported whenever they are newer than the last
+// import of that keyboard, so values written by those tools are picked up.
+// The values seen by the last import are kept, and only the keys that are
+// changed or removed in the file since then are applied. A read only store
+// imports them in memory when the options of the keyboard are read.
+class KeymanOptionStore {
+public:
+    explicit KeymanOptionStore(
+        KeymanOptionStoreMode mode = KeymanOptionStoreMode::ReadWrite);
+
+    // Return the options of given keyboard, nullptr if there is none.
+    const KeymanOptions *options(const std::string &id);
+
+    void setOption(const std::string &id, const std::string &key,
+                   const std::string &value);
+
+    // Import keyman/<id>.conf if it is modified since the last import, return
+    // the values that are changed. Removed keys are only dropped from the
+    // store, existing states keep their value.
+    KeymanOptions importIni(const std::string &id);
+
+private:
+    void ensureOpen();
+    void writeIni(const std::string &id);
+    void appendImport(const std::string &id);
+    void readFile();
+    void parse(const char *data, size_t size);
+    void append(uint8_t type, const std::string &id, const std::string &key,
+                const std::string &value);
+    void compact();
+    void set(const std::string &id, const std::string &key,
+             const std::string &value);
+
+    const KeymanOptionStoreMode mode_;
+    bool opened_ = false;
+    UnixFD fd_;
+    size_t fileSize_ = 0;
+    std::unordered_map<std::string, KeymanOptions> options_;
+    struct ImportedIni {
+        // In nanoseconds.
+        int64_t mtime = 0;
+        KeymanOptions values;
+    };
+    // keyboard id to the last imported ini file.
+    std::unordered_map<std::string, ImportedIni> imported_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_OPTIONSTORE_H_
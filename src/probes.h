@@ -0,0 +1,22 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_PROBES_H_
+#define _FCITX5_KEYMAN_PROBES_H_
+
+// USDT probes under provider fcitx5_keyman, see tools/bpftrace for examples.
+// Probes are a single nop when not attached, and compiled out unless
+// ENABLE_USDT is set.
+#ifdef FCITX_KEYMAN_USDT
+#include <sys/sdt.h>
+#define KEYMAN_PROBE(name, ...) STAP_PROBEV(fcitx5_keyman, name, ##__VA_ARGS__)
+#else
+#define KEYMAN_PROBE(name, ...)                                                \
+    do {                                                                       \
+    } while (0)
+#endif
+
+#endif // _FCITX5_KEYMAN_PROBES_H_
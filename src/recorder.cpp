@@ -0,0 +1,167 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "recorder.h"
+#include <fcntl.h>
+#include <cstring>
+#include <stdexcept>
+#include <fcitx-utils/capabilityflags.h>
+#include <fcitx-utils/fs.h>
+#include <fcitx/surroundingtext.h>
+#include "keymanlog.h"
+#include "stats.h"
+
+namespace fcitx {
+
+namespace {
+
+// Flush when the buffer is larger than this, and on destruction.
+constexpr size_t recorderBufferSize = 65536;
+// Forget the destroyed input contexts once in a while, they are not tracked.
+constexpr size_t maxRecorderContexts = 1024;
+
+template <typename T>
+void appendValue(std::string &buffer, T value) {
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+} // namespace
+
+bool keymanIsSensitive(const InputContext &ic) {
+    return ic.capabilityFlags().test(CapabilityFlag::Password) ||
+           ic.capabilityFlags().test(CapabilityFlag::Sensitive);
+}
+
+KeymanRecorder::KeymanRecorder(const std::string &path) : start_(keymanNow()) {
+    fd_.give(::open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600));
+    if (!fd_.isValid()) {
+        FCITX_KEYMAN_ERROR() << "Failed to open key event record: " << path;
+        return;
+    }
+    buffer_.append(keymanTraceMagic);
+}
+
+KeymanRecorder::~KeymanRecorder() { flush(); }
+
+KeymanRecorder::Context &KeymanRecorder::context(InputContext &ic) {
+    std::string uuid(reinterpret_cast<const char *>(ic.uuid().data()),
+                     ic.uuid().size());
+    if (auto iter = contexts_.find(uuid); iter != contexts_.end()) {
+        return iter->second;
+    }
+    if (contexts_.size() >= maxRecorderContexts) {
+        contexts_.clear();
+    }
+    auto &context = contexts_[uuid];
+    context.id = nextContextId_++;
+    return context;
+}
+
+void KeymanRecorder::appendHeader(KeymanTraceType type, uint32_t context) {
+    appendValue(buffer_, static_cast<uint8_t>(type));
+    appendValue(buffer_, context);
+    appendValue(buffer_, keymanNow() - start_);
+}
+
+void KeymanRecorder::recordKey(InputContext &ic, const Key &rawKey,
+                               bool isRelease) {
+    if (!isValid() || keymanIsSensitive(ic)) {
+        return;
+    }
+    auto &context = this->context(ic);
+    uint8_t flags = isRelease ? KeymanTraceEvent::Release : 0;
+    if (ic.capabilityFlags().test(CapabilityFlag::SurroundingText)) {
+        flags |= KeymanTraceEvent::HasSurroundingText;
+        const auto &surrounding = ic.surroundingText();
+        if (surrounding.isValid() &&
+            (surrounding.cursor() != context.cursor ||
+             surrounding.anchor() != context.anchor ||
+             surrounding.text() != context.text)) {
+            context.text = surrounding.text();
+            context.cursor = surrounding.cursor();
+            context.anchor = surrounding.anchor();
+            appendHeader(KeymanTraceType::SurroundingText, context.id);
+            appendValue(buffer_, context.cursor);
+            appendValue(buffer_, context.anchor);
+            appendValue(buffer_, static_cast<uint32_t>(context.text.size()));
+            buffer_.append(context.text);
+        }
+    }
+    appendHeader(KeymanTraceType::Key, context.id);
+    appendValue(buffer_, static_cast<uint32_t>(rawKey.code()));
+    appendValue(buffer_, static_cast<uint32_t>(rawKey.sym()));
+    appendValue(buffer_, static_cast<uint32_t>(rawKey.states()));
+    appendValue(buffer_, flags);
+    if (buffer_.size() >= recorderBufferSize) {
+        flush();
+    }
+}
+
+void KeymanRecorder::recordReset(InputContext &ic) {
+    if (!isValid() || keymanIsSensitive(ic)) {
+        return;
+    }
+    appendHeader(KeymanTraceType::Reset, context(ic).id);
+}
+
+void KeymanRecorder::flush() {
+    if (!isValid() || buffer_.empty()) {
+        return;
+    }
+    if (fs::safeWrite(fd_.fd(), buffer_.data(), buffer_.size()) !=
+        static_cast<ssize_t>(buffer_.size())) {
+        FCITX_KEYMAN_ERROR() << "Failed to write key event record.";
+    }
+    buffer_.clear();
+}
+
+KeymanTraceReader::KeymanTraceReader(std::string data)
+    : data_(std::move(data)), offset_(keymanTraceMagic.size()) {
+    if (std::string_view(data_).substr(0, keymanTraceMagic.size()) !=
+        keymanTraceMagic) {
+        throw std::runtime_error("Not a keyman key event record");
+    }
+}
+
+template <typename T>
+bool KeymanTraceReader::read(T &value) {
+    if (data_.size() - offset_ < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, data_.data() + offset_, sizeof(value));
+    offset_ += sizeof(value);
+    return true;
+}
+
+bool KeymanTraceReader::next(KeymanTraceEvent &event) {
+    event = KeymanTraceEvent();
+    uint8_t type;
+    if (!read(type) || !read(event.context) || !read(event.timestamp)) {
+        return false;
+    }
+    event.type = static_cast<KeymanTraceType>(type);
+    switch (event.type) {
+    case KeymanTraceType::Key:
+        return read(event.code) && read(event.sym) && read(event.states) &&
+               read(event.flags);
+    case KeymanTraceType::SurroundingText: {
+        uint32_t length;
+        if (!read(event.cursor) || !read(event.anchor) || !read(length) ||
+            data_.size() - offset_ < length) {
+            return false;
+        }
+        event.text.assign(data_, offset_, length);
+        offset_ += length;
+        return true;
+    }
+    case KeymanTraceType::Reset:
+        return true;
+    }
+    return false;
+}
+
+} // namespace fcitx
@@ -0,0 +1,113 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_RECORDER_H_
+#define _FCITX5_KEYMAN_RECORDER_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/unixfd.h>
+#include <fcitx/inputcontext.h>
+
+namespace fcitx {
+
+// Key event trace, written by KeymanRecorder and read by fcitx5-keyman-replay.
+//
+// The file starts with keymanTraceMagic, followed by records. Every record
+// starts with type (1 byte), input context id (4 bytes) and the time since
+// the start of recording in nanoseconds (8 bytes).
+// - Key: code, sym and states (4 bytes each), flags (1 byte).
+// - SurroundingText: cursor, anchor and length (4 bytes each), then the UTF-8
+//   text. Only written before a key if the text is changed since the last
+//   record of the same input context.
+// - Reset: no payload.
+// Integers are in host byte order.
+constexpr std::string_view keymanTraceMagic = "KMREC001";
+
+enum class KeymanTraceType : uint8_t {
+    Key = 1,
+    SurroundingText = 2,
+    Reset = 3,
+};
+
+struct KeymanTraceEvent {
+    enum Flag : uint8_t {
+        Release = 1,
+        // The input context supports surrounding text.
+        HasSurroundingText = 2,
+    };
+
+    KeymanTraceType type = KeymanTraceType::Key;
+    uint32_t context = 0;
+    uint64_t timestamp = 0;
+    uint32_t code = 0;
+    uint32_t sym = 0;
+    uint32_t states = 0;
+    uint8_t flags = 0;
+    uint32_t cursor = 0;
+    uint32_t anchor = 0;
+    std::string text;
+};
+
+// Whether the input context holds a password or other sensitive text, whose
+// keys must not be kept by any recorder.
+bool keymanIsSensitive(const InputContext &ic);
+
+// Record the key events that reach KeymanEngine::keyEvent, enabled by setting
+// FCITX_KEYMAN_RECORD to the output file. Input contexts with the Password or
+// Sensitive capability are not recorded.
+class KeymanRecorder {
+public:
+    explicit KeymanRecorder(const std::string &path);
+    ~KeymanRecorder();
+
+    bool isValid() const { return fd_.isValid(); }
+    void recordKey(InputContext &ic, const Key &rawKey, bool isRelease);
+    void recordReset(InputContext &ic);
+    void flush();
+
+private:
+    struct Context {
+        uint32_t id;
+        std::string text;
+        uint32_t cursor = 0;
+        uint32_t anchor = 0;
+    };
+
+    Context &context(InputContext &ic);
+    void appendHeader(KeymanTraceType type, uint32_t context);
+
+    UnixFD fd_;
+    uint64_t start_;
+    uint32_t nextContextId_ = 1;
+    std::string buffer_;
+    std::unordered_map<std::string, Context> contexts_;
+};
+
+// Read the trace written by KeymanRecorder.
+class KeymanTraceReader {
+public:
+    // Throw if data is not a trace.
+    explicit KeymanTraceReader(std::string data);
+
+    // Replace event with the next record, return false at the end of trace
+    // or a truncated record. Fields that the record does not have are reset.
+    bool next(KeymanTraceEvent &event);
+
+private:
+    template <typename T>
+    bool read(T &value);
+
+    std::string data_;
+    size_t offset_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_RECORDER_H_
@@ -0,0 +1,505 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "sandbox.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <utility>
+#include "keymanlog.h"
+#include "stats.h"
+
+namespace fcitx {
+
+namespace {
+
+// Do not restart the helper more than once per second.
+constexpr uint64_t restartInterval = 1000000000;
+// Wait this long for a free slot if the request ring is full, before the
+// helper is considered stuck.
+constexpr uint64_t queueTimeout = 100000000;
+// Microseconds between the checks of the pending loads.
+constexpr uint64_t loadPollInterval = 2000;
+// Poll for the response for a while before sleeping, most keys are
+// processed within a few microseconds. Polling only delays the helper if
+// there is a single CPU.
+uint64_t spinDuration() {
+    static const uint64_t duration =
+        std::thread::hardware_concurrency() > 1 ? 20000 : 0;
+    return duration;
+}
+
+bool encodeOptions(const KeymanOptions &options,
+                   KeymanSandboxMessage &message) {
+    size_t size = 0;
+    for (const auto &[key, value] : options) {
+        const auto length = key.size() + value.size() + 2;
+        if (size + length > KeymanSandboxMessage::maxPayload) {
+            return false;
+        }
+        memcpy(message.payload + size, key.data(), key.size() + 1);
+        memcpy(message.payload + size + key.size() + 1, value.data(),
+               value.size() + 1);
+        size += length;
+    }
+    message.size = size;
+    return true;
+}
+
+// The message is in memory shared with the helper, nothing in it is trusted.
+bool decodeActions(const KeymanSandboxMessage &message,
+                   KeymanActions &actions) {
+    const uint32_t size = message.size;
+    if (size > KeymanSandboxMessage::maxPayload) {
+        return false;
+    }
+    const char *cursor = message.payload;
+    const char *const end = message.payload + size;
+    auto get = [&cursor, end](void *data, size_t size) {
+        if (static_cast<size_t>(end - cursor) < size) {
+            return false;
+        }
+        memcpy(data, cursor, size);
+        cursor += size;
+        return true;
+    };
+    uint32_t deleteCount;
+    uint8_t alert;
+    uint8_t emitKeystroke;
+    uint16_t length;
+    if (!get(&deleteCount, sizeof(deleteCount)) ||
+        !get(&alert, sizeof(alert)) ||
+        !get(&emitKeystroke, sizeof(emitKeystroke)) ||
+        !get(&length, sizeof(length)) ||
+        deleteCount > KeymanSandboxMessage::maxDeleteCount) {
+        return false;
+    }
+    actions.deleteCount = deleteCount;
+    actions.alert = alert;
+    actions.emitKeystroke = emitKeystroke;
+    actions.output.clear();
+    for (uint16_t i = 0; i < length; i++) {
+        uint32_t c;
+        if (!get(&c, sizeof(c))) {
+            return false;
+        }
+        actions.output.push_back(c);
+    }
+    actions.persistOptions.clear();
+    while (cursor < end) {
+        auto &option = actions.persistOptions.emplace_back();
+        for (auto *str : {&option.first, &option.second}) {
+            uint16_t c;
+            do {
+                if (!get(&c, sizeof(c))) {
+                    return false;
+                }
+                str->push_back(c);
+            } while (c);
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+KeymanSandbox::KeymanSandbox(std::string helperPath, EventLoop *loop)
+    : helperPath_(std::move(helperPath)), loop_(loop) {}
+
+KeymanSandbox::~KeymanSandbox() { stop(); }
+
+void KeymanSandbox::loadKeyboardAsync(const std::string &path,
+                                      uint64_t timeout,
+                                      std::function<void(uint32_t)> callback) {
+    PendingLoad load;
+    load.deadline = keymanNow() + timeout;
+    load.callback = std::move(callback);
+    // A failure is reported by the timer as well, so callback is never
+    // called before this returns.
+    load.done = true;
+    if (path.size() <= KeymanSandboxMessage::maxPayload) {
+        if (auto *message = prepare(KeymanSandboxCommand::LoadKeyboard, 0,
+                                    queueTimeout)) {
+            memcpy(message->payload, path.data(), path.size());
+            message->size = path.size();
+            load.sequence = send();
+            load.done = false;
+        }
+    }
+    loads_.push_back(std::move(load));
+    if (!loadTimer_) {
+        loadTimer_ = loop_->addTimeEvent(
+            CLOCK_MONOTONIC, now(CLOCK_MONOTONIC) + loadPollInterval, 0,
+            [this](EventSourceTime *source, uint64_t) {
+                dispatchLoads();
+                if (!loads_.empty()) {
+                    source->setNextInterval(loadPollInterval);
+                    source->setOneShot();
+                }
+                return true;
+            });
+    } else if (!loadTimer_->isEnabled()) {
+        loadTimer_->setNextInterval(loadPollInterval);
+        loadTimer_->setOneShot();
+    }
+}
+
+bool KeymanSandbox::loading() const {
+    return std::any_of(loads_.begin(), loads_.end(),
+                       [](const PendingLoad &load) { return !load.done; });
+}
+
+uint32_t KeymanSandbox::createState(uint32_t keyboard,
+                                    const KeymanOptions *options,
+                                    uint64_t timeout) {
+    if (loading()) {
+        return 0;
+    }
+    auto *message =
+        prepare(KeymanSandboxCommand::CreateState, keyboard, timeout);
+    if (!message) {
+        return 0;
+    }
+    if (options && !encodeOptions(*options, *message)) {
+        FCITX_KEYMAN_WARN() << "Keyboard options are too large.";
+        message->size = 0;
+    }
+    const auto *response = wait(send(), timeout);
+    if (!response) {
+        return 0;
+    }
+    const auto handle = response->status == 0 ? response->handle : 0;
+    popResponse();
+    return handle;
+}
+
+int KeymanSandbox::setContext(uint32_t state,
+                              const std::vector<char16_t> &context,
+                              uint64_t timeout) {
+    const auto size = context.size() * sizeof(char16_t);
+    if (context.empty() || size > KeymanSandboxMessage::maxPayload ||
+        loading()) {
+        return -1;
+    }
+    auto *message = prepare(KeymanSandboxCommand::SetContext, state, timeout);
+    if (!message) {
+        return -1;
+    }
+    memcpy(message->payload, context.data(), size);
+    message->size = size;
+    const auto *response = wait(send(), timeout);
+    if (!response) {
+        return -1;
+    }
+    const auto status = response->status;
+    popResponse();
+    return status;
+}
+
+bool KeymanSandbox::processEvent(uint32_t state, uint16_t vk,
+                                 uint16_t modifiers, bool isKeyDown,
+                                 uint64_t timeout, KeymanActions &actions) {
+    if (loading()) {
+        return false;
+    }
+    auto *message =
+        prepare(KeymanSandboxCommand::ProcessEvent, state, timeout);
+    if (!message) {
+        return false;
+    }
+    message->vk = vk;
+    message->modifiers = modifiers;
+    message->isKeyDown = isKeyDown;
+    const auto *response = wait(send(), timeout);
+    if (!response) {
+        return false;
+    }
+    const bool success =
+        response->status == 0 && decodeActions(*response, actions);
+    popResponse();
+    return success;
+}
+
+void KeymanSandbox::disposeKeyboard(uint32_t keyboard) {
+    if (prepare(KeymanSandboxCommand::DisposeKeyboard, keyboard,
+                queueTimeout)) {
+        send();
+    }
+}
+
+void KeymanSandbox::disposeState(uint32_t state) {
+    if (prepare(KeymanSandboxCommand::DisposeState, state, queueTimeout)) {
+        send();
+    }
+}
+
+void KeymanSandbox::clearContext(uint32_t state) {
+    if (prepare(KeymanSandboxCommand::ClearContext, state, queueTimeout)) {
+        send();
+    }
+}
+
+void KeymanSandbox::updateOptions(uint32_t state,
+                                  const KeymanOptions &options) {
+    auto *message =
+        prepare(KeymanSandboxCommand::UpdateOptions, state, queueTimeout);
+    if (!message) {
+        return;
+    }
+    if (!encodeOptions(options, *message)) {
+        FCITX_KEYMAN_WARN() << "Keyboard options are too large.";
+        message->size = 0;
+    }
+    send();
+}
+
+bool KeymanSandbox::start() {
+    if (pid_) {
+        return true;
+    }
+    const auto now = keymanNow();
+    if (lastStart_ && now - lastStart_ < restartInterval) {
+        return false;
+    }
+    lastStart_ = now;
+
+    UnixFD memfd;
+    memfd.give(memfd_create("fcitx5-keyman-sandbox", MFD_CLOEXEC));
+    if (!memfd.isValid() ||
+        ftruncate(memfd.fd(), sizeof(KeymanSandboxShared)) != 0) {
+        FCITX_KEYMAN_ERROR() << "Failed to create shared memory for sandbox.";
+        return false;
+    }
+    auto *data = mmap(nullptr, sizeof(KeymanSandboxShared),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, memfd.fd(), 0);
+    if (data == MAP_FAILED) {
+        FCITX_KEYMAN_ERROR() << "Failed to map shared memory for sandbox.";
+        return false;
+    }
+    shared_ = new (data) KeymanSandboxShared();
+    requestEvent_.give(eventfd(0, EFD_CLOEXEC));
+    responseEvent_.give(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    int pipeFds[2];
+    if (!requestEvent_.isValid() || !responseEvent_.isValid() ||
+        pipe2(pipeFds, O_CLOEXEC) != 0) {
+        FCITX_KEYMAN_ERROR() << "Failed to create eventfd for sandbox.";
+        stop();
+        return false;
+    }
+    deathPipe_.give(pipeFds[0]);
+    UnixFD aliveFd;
+    aliveFd.give(pipeFds[1]);
+
+    const auto parent = getpid();
+    pid_ = fork();
+    if (pid_ == 0) {
+        // Only async signal safe functions may be used here.
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent) {
+            _exit(1);
+        }
+        // Move the descriptors out of the way first, they may overlap with
+        // the target numbers. dup2 clears FD_CLOEXEC of the new ones.
+        const int fds[] = {memfd.fd(), requestEvent_.fd(),
+                           responseEvent_.fd(), aliveFd.fd()};
+        int movedFds[4];
+        for (int i = 0; i < 4; i++) {
+            movedFds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 10);
+        }
+        for (int i = 0; i < 4; i++) {
+            if (movedFds[i] < 0 ||
+                dup2(movedFds[i], keymanSandboxSharedFd + i) < 0) {
+                _exit(1);
+            }
+        }
+        execl(helperPath_.data(), helperPath_.data(), nullptr);
+        _exit(127);
+    }
+    if (pid_ < 0) {
+        pid_ = 0;
+        FCITX_KEYMAN_ERROR() << "Failed to start " << helperPath_;
+        stop();
+        return false;
+    }
+    FCITX_KEYMAN_DEBUG() << "Started keyman helper " << pid_;
+    return true;
+}
+
+void KeymanSandbox::stop() {
+    if (pid_) {
+        kill(pid_, SIGKILL);
+        while (waitpid(pid_, nullptr, 0) < 0 && errno == EINTR) {
+        }
+        pid_ = 0;
+        generation_++;
+    }
+    // Handles of the finished loads are not valid any more either.
+    for (auto &load : loads_) {
+        load.done = true;
+        load.handle = 0;
+    }
+    if (shared_) {
+        shared_->~KeymanSandboxShared();
+        munmap(shared_, sizeof(KeymanSandboxShared));
+        shared_ = nullptr;
+    }
+    requestEvent_.reset();
+    responseEvent_.reset();
+    deathPipe_.reset();
+}
+
+KeymanSandboxMessage *KeymanSandbox::prepare(KeymanSandboxCommand command,
+                                             uint32_t handle,
+                                             uint64_t timeout) {
+    if (!start()) {
+        return nullptr;
+    }
+    // Responses of the requests that are not waited for.
+    drainResponses();
+    auto *message = shared_->requests.reserve();
+    if (!message) {
+        // The helper frees the slot of a request before its response.
+        const auto deadline = keymanNow() + timeout;
+        while (!(message = shared_->requests.reserve())) {
+            if (keymanNow() >= deadline || !sleep(deadline)) {
+                FCITX_KEYMAN_ERROR() << "Keyman helper is not responding, "
+                                        "restarting it.";
+                stop();
+                return nullptr;
+            }
+            drainResponses();
+        }
+    }
+    message->command = static_cast<uint32_t>(command);
+    message->handle = handle;
+    message->status = 0;
+    message->vk = 0;
+    message->modifiers = 0;
+    message->isKeyDown = 0;
+    message->size = 0;
+    return message;
+}
+
+uint32_t KeymanSandbox::send() {
+    const auto sequence = nextSequence_++;
+    shared_->requests.reserve()->sequence = sequence;
+    shared_->requests.commit(requestEvent_.fd());
+    return sequence;
+}
+
+void KeymanSandbox::drainResponses() {
+    while (shared_->responses.front()) {
+        popResponse();
+    }
+}
+
+void KeymanSandbox::popResponse() {
+    const auto *response = shared_->responses.front();
+    for (auto &load : loads_) {
+        if (!load.done && load.sequence == response->sequence) {
+            load.done = true;
+            load.handle = response->status == 0 ? response->handle : 0;
+        }
+    }
+    shared_->responses.pop();
+}
+
+void KeymanSandbox::dispatchLoads() {
+    if (shared_) {
+        drainResponses();
+    }
+    const auto now = keymanNow();
+    for (const auto &load : loads_) {
+        if (!load.done && now >= load.deadline) {
+            FCITX_KEYMAN_ERROR() << "Keyman helper missed the deadline of "
+                                    "loading a keyboard, restarting it.";
+            stop();
+            break;
+        }
+    }
+    std::vector<PendingLoad> finished;
+    for (auto iter = loads_.begin(); iter != loads_.end();) {
+        if (iter->done) {
+            finished.push_back(std::move(*iter));
+            iter = loads_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+    // Callbacks may send new requests.
+    for (auto &load : finished) {
+        load.callback(load.handle);
+    }
+}
+
+bool KeymanSandbox::sleep(uint64_t deadline) {
+    auto &responses = shared_->responses;
+    if (!responses.prepareSleep()) {
+        return true;
+    }
+    const auto now = keymanNow();
+    const auto timeout = deadline > now ? deadline - now : 0;
+    struct pollfd fds[2];
+    fds[0].fd = responseEvent_.fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = deathPipe_.fd();
+    fds[1].events = POLLIN;
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    const auto ret = ppoll(fds, 2, &ts, nullptr);
+    responses.wakeUp();
+    if (ret > 0 && (fds[0].revents & POLLIN)) {
+        uint64_t value;
+        while (read(responseEvent_.fd(), &value, sizeof(value)) < 0 &&
+               errno == EINTR) {
+        }
+    }
+    return !(ret > 0 && fds[1].revents && !responses.front());
+}
+
+const KeymanSandboxMessage *KeymanSandbox::wait(uint32_t sequence,
+                                                uint64_t timeout) {
+    auto &responses = shared_->responses;
+    const auto start = keymanNow();
+    const auto deadline = start + timeout;
+    const auto spinEnd = start + spinDuration();
+    while (true) {
+        while (const auto *response = responses.front()) {
+            if (response->sequence == sequence) {
+                return response;
+            }
+            popResponse();
+        }
+        const auto now = keymanNow();
+        if (now >= deadline) {
+            FCITX_KEYMAN_ERROR() << "Keyman helper missed the deadline, "
+                                    "restarting it.";
+            break;
+        }
+        if (now < spinEnd) {
+            continue;
+        }
+        if (!sleep(deadline)) {
+            FCITX_KEYMAN_ERROR() << "Keyman helper exited, restarting it.";
+            break;
+        }
+    }
+    stop();
+    return nullptr;
+}
+
+} // namespace fcitx
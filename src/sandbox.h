@@ -0,0 +1,109 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_SANDBOX_H_
+#define _FCITX5_KEYMAN_SANDBOX_H_
+
+#include <sys/types.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/unixfd.h>
+#include "optionstore.h"
+#include "sandboxprotocol.h"
+#include "worker.h"
+
+namespace fcitx {
+
+// Client of fcitx5-keyman-helper, which owns keyboards and states in a
+// separate process.
+//
+// The helper is started on demand. If it crashes or misses a deadline, it is
+// killed and generation() is increased, and all the handles from the older
+// generations become invalid. Handle 0 is never valid.
+//
+// Requests that wait for the helper fail without a restart while a keyboard
+// is being loaded, since the helper runs the requests in order.
+class KeymanSandbox {
+public:
+    KeymanSandbox(std::string helperPath, EventLoop *loop);
+    ~KeymanSandbox();
+
+    uint64_t generation() const { return generation_; }
+
+    // Load a keyboard without waiting for the helper. callback is called in
+    // the main loop with the handle, or 0 if the load fails or takes longer
+    // than timeout.
+    void loadKeyboardAsync(const std::string &path, uint64_t timeout,
+                           std::function<void(uint32_t)> callback);
+    // Whether the helper is busy loading a keyboard.
+    bool loading() const;
+    uint32_t createState(uint32_t keyboard, const KeymanOptions *options,
+                         uint64_t timeout);
+    // Return km_core_context_status, or -1 on failure.
+    int setContext(uint32_t state, const std::vector<char16_t> &context,
+                   uint64_t timeout);
+    bool processEvent(uint32_t state, uint16_t vk, uint16_t modifiers,
+                      bool isKeyDown, uint64_t timeout, KeymanActions &actions);
+
+    // These do not wait for the helper.
+    void disposeKeyboard(uint32_t keyboard);
+    void disposeState(uint32_t state);
+    void clearContext(uint32_t state);
+    void updateOptions(uint32_t state, const KeymanOptions &options);
+
+private:
+    struct PendingLoad {
+        uint32_t sequence = 0;
+        uint64_t deadline = 0;
+        bool done = false;
+        uint32_t handle = 0;
+        std::function<void(uint32_t)> callback;
+    };
+
+    bool start();
+    void stop();
+    // Return nullptr if the helper is not available. If the request ring is
+    // full, wait at most timeout nanoseconds for the helper to catch up.
+    KeymanSandboxMessage *prepare(KeymanSandboxCommand command,
+                                  uint32_t handle, uint64_t timeout);
+    uint32_t send();
+    // Wait for the response of sequence, and drop the responses before it.
+    // The helper is restarted on failure.
+    const KeymanSandboxMessage *wait(uint32_t sequence, uint64_t timeout);
+    // Block until a response arrives or deadline, return false if the helper
+    // exited.
+    bool sleep(uint64_t deadline);
+    void drainResponses();
+    // Pop the front response, and keep it if it is for a pending load.
+    void popResponse();
+    // Run the callbacks of the finished loads, and stop the helper if a load
+    // misses its deadline.
+    void dispatchLoads();
+
+    const std::string helperPath_;
+    EventLoop *loop_;
+    pid_t pid_ = 0;
+    UnixFD requestEvent_;
+    UnixFD responseEvent_;
+    // Closed when the helper exits.
+    UnixFD deathPipe_;
+    KeymanSandboxShared *shared_ = nullptr;
+    uint32_t nextSequence_ = 1;
+    uint64_t generation_ = 1;
+    // CLOCK_MONOTONIC of the last start, to avoid restarting in a loop.
+    uint64_t lastStart_ = 0;
+    std::vector<PendingLoad> loads_;
+    // Polls the pending loads.
+    std::unique_ptr<EventSourceTime> loadTimer_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_SANDBOX_H_
@@ -0,0 +1,149 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_SANDBOXPROTOCOL_H_
+#define _FCITX5_KEYMAN_SANDBOXPROTOCOL_H_
+
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+// Shared memory layout between the addon and fcitx5-keyman-helper.
+//
+// The addon creates a memfd with KeymanSandboxShared and two eventfds, and
+// starts the helper with them as the file descriptors below. Requests and
+// responses are passed through two single producer, single consumer rings.
+// The consumer sets sleeping before it blocks on the eventfd, so the
+// producer only needs to write the eventfd when the other side is asleep.
+
+namespace fcitx {
+
+constexpr int keymanSandboxSharedFd = 3;
+constexpr int keymanSandboxRequestFd = 4;
+constexpr int keymanSandboxResponseFd = 5;
+// Write end of a pipe that is kept open by the helper, so the addon can
+// tell when the helper exits.
+constexpr int keymanSandboxAliveFd = 6;
+constexpr uint32_t keymanSandboxMagic = 0x4b4d5342;
+
+enum class KeymanSandboxCommand : uint32_t {
+    // payload: UTF-8 path of the kmx file. Response handle: keyboard.
+    LoadKeyboard = 1,
+    DisposeKeyboard,
+    // handle: keyboard, payload: options. Response handle: state.
+    CreateState,
+    DisposeState,
+    // handle: state, payload: zero terminated UTF-16 context.
+    // Response status: km_core_context_status.
+    SetContext,
+    ClearContext,
+    // handle: state, payload: options.
+    UpdateOptions,
+    // handle: state. Response payload: actions.
+    ProcessEvent,
+};
+
+// Options are encoded as UTF-8 "key\0value\0" pairs.
+//
+// Actions are encoded as deleteCount (uint32_t), alert (uint8_t),
+// emitKeystroke (uint8_t), output length (uint16_t) and the output
+// characters (uint32_t), followed by zero terminated UTF-16 key and value of
+// persisted options.
+struct KeymanSandboxMessage {
+    static constexpr size_t maxPayload = 4064;
+    // Larger delete counts are treated as a broken helper. A rule can not
+    // match more than the context the engine keeps (MAXCONTEXT_ITEMS).
+    static constexpr uint32_t maxDeleteCount = 128;
+
+    uint32_t command = 0;
+    uint32_t sequence = 0;
+    uint32_t handle = 0;
+    // 0 on success for responses.
+    int32_t status = 0;
+    uint16_t vk = 0;
+    uint16_t modifiers = 0;
+    uint8_t isKeyDown = 0;
+    uint32_t size = 0;
+    char payload[maxPayload];
+};
+
+template <size_t Capacity>
+struct KeymanSandboxRing {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+    // Return nullptr if the ring is full.
+    KeymanSandboxMessage *reserve() {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+            return nullptr;
+        }
+        return &slots_[tail & (Capacity - 1)];
+    }
+
+    // Publish the reserved message and wake up the consumer if needed.
+    void commit(int eventFd) {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) {
+            uint64_t value = 1;
+            while (write(eventFd, &value, sizeof(value)) < 0 &&
+                   errno == EINTR) {
+            }
+        }
+    }
+
+    // Return nullptr if the ring is empty.
+    const KeymanSandboxMessage *front() const {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots_[head & (Capacity - 1)];
+    }
+
+    void pop() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    // Called by the consumer before blocking. Return false if a message
+    // arrived in the meantime.
+    bool prepareSleep() {
+        sleeping_.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (front()) {
+            sleeping_.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    void wakeUp() { sleeping_.store(0, std::memory_order_relaxed); }
+
+private:
+    alignas(64) std::atomic<uint32_t> head_{0};
+    alignas(64) std::atomic<uint32_t> tail_{0};
+    alignas(64) std::atomic<uint32_t> sleeping_{0};
+    KeymanSandboxMessage slots_[Capacity];
+};
+
+struct KeymanSandboxShared {
+    static constexpr size_t capacity = 16;
+
+    uint32_t magic = keymanSandboxMagic;
+    KeymanSandboxRing<capacity> requests;
+    KeymanSandboxRing<capacity> responses;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "Shared memory requires lock free atomics");
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_SANDBOXPROTOCOL_H_
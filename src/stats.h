@@ -0,0 +1,208 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_STATS_H_
+#define _FCITX5_KEYMAN_STATS_H_
+
+#include <time.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace fcitx {
+
+inline uint64_t keymanNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Latency histogram in nanoseconds with log-linear buckets, similar to HDR
+// histogram. Every power of two is split into 8 buckets, so the error is
+// within 12.5%. Values larger than ~2^40ns go into the last bucket.
+class KeymanLatencyHistogram {
+public:
+    static constexpr int subBucketBits = 3;
+    static constexpr uint64_t subBuckets = 1 << subBucketBits;
+    static constexpr int maxBits = 40;
+    static constexpr size_t numBuckets =
+        (maxBits - subBucketBits + 1) * subBuckets;
+
+    void record(uint64_t value) {
+        counts_[bucketIndex(value)]++;
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    void reset() { *this = KeymanLatencyHistogram(); }
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+    const auto &counts() const { return counts_; }
+
+    // Return the lower bound of the bucket that contains the percentile.
+    uint64_t percentile(double percentile) const {
+        const auto target = static_cast<uint64_t>(count_ * percentile / 100);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < numBuckets; i++) {
+            seen += counts_[i];
+            if (counts_[i] && seen > target) {
+                return bucketLowerBound(i);
+            }
+        }
+        return max_;
+    }
+
+    static size_t bucketIndex(uint64_t value) {
+        if (value < subBuckets) {
+            return value;
+        }
+        const int msb = 63 - __builtin_clzll(value);
+        if (msb >= maxBits) {
+            return numBuckets - 1;
+        }
+        const int shift = msb - subBucketBits;
+        return (shift + 1) * subBuckets + ((value >> shift) & (subBuckets - 1));
+    }
+
+    static uint64_t bucketLowerBound(size_t index) {
+        if (index < subBuckets) {
+            return index;
+        }
+        const auto shift = index / subBuckets - 1;
+        return (subBuckets + index % subBuckets) << shift;
+    }
+
+private:
+    std::array<uint64_t, numBuckets> counts_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+enum class KeymanPhase {
+    // Set context from surrounding text.
+    ContextSync,
+    // km_core_process_event.
+    Process,
+    // Apply deletion, build output and persist options.
+    Actions,
+    // InputContext::commitString.
+    Commit,
+    // The whole key event.
+    Total,
+};
+
+constexpr size_t keymanPhaseCount = static_cast<size_t>(KeymanPhase::Total) + 1;
+
+inline const char *keymanPhaseName(KeymanPhase phase) {
+    switch (phase) {
+    case KeymanPhase::ContextSync:
+        return "ContextSync";
+    case KeymanPhase::Process:
+        return "Process";
+    case KeymanPhase::Actions:
+        return "Actions";
+    case KeymanPhase::Commit:
+        return "Commit";
+    case KeymanPhase::Total:
+        return "Total";
+    }
+    return "";
+}
+
+class KeymanLatencyStats {
+public:
+    void record(KeymanPhase phase, uint64_t value) {
+        phases_[static_cast<size_t>(phase)].record(value);
+    }
+    const KeymanLatencyHistogram &phase(KeymanPhase phase) const {
+        return phases_[static_cast<size_t>(phase)];
+    }
+    void reset() {
+        for (auto &histogram : phases_) {
+            histogram.reset();
+        }
+    }
+
+private:
+    std::array<KeymanLatencyHistogram, keymanPhaseCount> phases_;
+};
+
+enum class KeymanCounter {
+    // Key events sent to km_core_process_event.
+    Keystrokes,
+    // Context set from surrounding text that differs from the cached one.
+    ContextChanged,
+    // Context cleared by cursor movement or reset.
+    ContextCleared,
+    // Backspaces forwarded to the application.
+    BackspaceForwarded,
+    // Characters removed with deleteSurroundingText.
+    SurroundingTextDeleted,
+    // Key events passed through to the application.
+    EmitKeystroke,
+    Alert,
+    PersistedOption,
+    CommittedBytes,
+    // Key events passed through because the worker or the sandbox helper
+    // missed the deadline.
+    WorkerTimeout,
+    Last = WorkerTimeout,
+};
+
+constexpr size_t keymanCounterCount =
+    static_cast<size_t>(KeymanCounter::Last) + 1;
+
+inline const char *keymanCounterName(KeymanCounter counter) {
+    switch (counter) {
+    case KeymanCounter::Keystrokes:
+        return "Keystrokes";
+    case KeymanCounter::ContextChanged:
+        return "ContextChanged";
+    case KeymanCounter::ContextCleared:
+        return "ContextCleared";
+    case KeymanCounter::BackspaceForwarded:
+        return "BackspaceForwarded";
+    case KeymanCounter::SurroundingTextDeleted:
+        return "SurroundingTextDeleted";
+    case KeymanCounter::EmitKeystroke:
+        return "EmitKeystroke";
+    case KeymanCounter::Alert:
+        return "Alert";
+    case KeymanCounter::PersistedOption:
+        return "PersistedOption";
+    case KeymanCounter::CommittedBytes:
+        return "CommittedBytes";
+    case KeymanCounter::WorkerTimeout:
+        return "WorkerTimeout";
+    }
+    return "";
+}
+
+// Always on counters, they may be read from any thread.
+class KeymanCounters {
+public:
+    void add(KeymanCounter counter, uint64_t value = 1) {
+        counters_[static_cast<size_t>(counter)].fetch_add(
+            value, std::memory_order_relaxed);
+    }
+    uint64_t value(KeymanCounter counter) const {
+        return counters_[static_cast<size_t>(counter)].load(
+            std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, keymanCounterCount> counters_{};
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_STATS_H_
@@ -0,0 +1,118 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "trace.h"
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/unixfd.h>
+#include "keymanlog.h"
+
+namespace fcitx {
+
+namespace {
+
+// Keep memory bounded if tracing is left enabled.
+constexpr size_t maxTraceEvents = 100000;
+
+const char *tracePath() {
+    const char *path = getenv("FCITX_KEYMAN_TRACE");
+    return path && path[0] ? path : nullptr;
+}
+
+void appendJsonString(std::string &out, const std::string &str) {
+    out.push_back('"');
+    for (char c : str) {
+        switch (c) {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out.append(buf);
+            } else {
+                out.push_back(c);
+            }
+            break;
+        }
+    }
+    out.push_back('"');
+}
+
+} // namespace
+
+const bool KeymanTracer::enabled_ = tracePath() != nullptr;
+
+KeymanTracer &KeymanTracer::global() {
+    static KeymanTracer tracer;
+    return tracer;
+}
+
+KeymanTracer::KeymanTracer() {
+    if (const char *path = tracePath()) {
+        path_ = path;
+    }
+}
+
+void KeymanTracer::addEvent(const char *name, uint64_t start, uint64_t end,
+                            std::string detail) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (events_.size() >= maxTraceEvents) {
+        return;
+    }
+    events_.push_back({name, start, end,
+                       static_cast<uint64_t>(syscall(SYS_gettid)),
+                       std::move(detail)});
+}
+
+void KeymanTracer::flush() {
+    if (!enabled()) {
+        return;
+    }
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    const auto pid = getpid();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bool first = true;
+        for (const auto &event : events_) {
+            char buf[256];
+            snprintf(buf, sizeof(buf),
+                     "%s{\"cat\":\"keyman\",\"ph\":\"X\",\"pid\":%d,"
+                     "\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+                     first ? "" : ",", pid,
+                     static_cast<unsigned long long>(event.thread),
+                     event.start / 1e3, (event.end - event.start) / 1e3);
+            first = false;
+            json.append(buf);
+            appendJsonString(json, event.name);
+            if (!event.detail.empty()) {
+                json.append(",\"args\":{\"detail\":");
+                appendJsonString(json, event.detail);
+                json.push_back('}');
+            }
+            json.push_back('}');
+        }
+    }
+    json.append("]}\n");
+
+    UnixFD fd = UnixFD::own(
+        open(path_.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd.isValid() ||
+        fs::safeWrite(fd.fd(), json.data(), json.size()) !=
+            static_cast<ssize_t>(json.size())) {
+        FCITX_KEYMAN_WARN() << "Failed to write trace to " << path_;
+    }
+}
+
+} // namespace fcitx
@@ -0,0 +1,86 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_TRACE_H_
+#define _FCITX5_KEYMAN_TRACE_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "stats.h"
+
+namespace fcitx {
+
+// Collect spans in memory and write them as Chrome trace JSON, which can be
+// opened with chrome://tracing or Perfetto.
+//
+// Tracing is enabled by setting FCITX_KEYMAN_TRACE to the output file.
+class KeymanTracer {
+public:
+    static KeymanTracer &global();
+
+    // Read once at startup, so a disabled span costs only this load.
+    static bool enabled() { return enabled_; }
+    void addEvent(const char *name, uint64_t start, uint64_t end,
+                  std::string detail);
+    // Write all the events collected so far to the output file.
+    void flush();
+
+private:
+    KeymanTracer();
+
+    static const bool enabled_;
+
+    struct Event {
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+        uint64_t thread;
+        std::string detail;
+    };
+
+    std::string path_;
+    std::mutex mutex_;
+    std::vector<Event> events_;
+};
+
+class KeymanTraceScope {
+public:
+    // detail is only copied if tracing is enabled.
+    KeymanTraceScope(const char *name, std::string_view detail = {})
+        : name_(name) {
+        if (KeymanTracer::enabled()) {
+            detail_ = detail;
+            start_ = keymanNow();
+        }
+    }
+    ~KeymanTraceScope() {
+        if (start_) {
+            KeymanTracer::global().addEvent(name_, start_, keymanNow(),
+                                            std::move(detail_));
+        }
+    }
+
+    KeymanTraceScope(const KeymanTraceScope &) = delete;
+    KeymanTraceScope &operator=(const KeymanTraceScope &) = delete;
+
+private:
+    const char *name_;
+    std::string detail_;
+    uint64_t start_ = 0;
+};
+
+} // namespace fcitx
+
+#define KEYMAN_TRACE_CONCAT_IMPL(a, b) a##b
+#define KEYMAN_TRACE_CONCAT(a, b) KEYMAN_TRACE_CONCAT_IMPL(a, b)
+#define KEYMAN_TRACE_SCOPE(...)                                                \
+    ::fcitx::KeymanTraceScope KEYMAN_TRACE_CONCAT(keymanTraceScope,            \
+                                                  __LINE__)(__VA_ARGS__)
+
+#endif // _FCITX5_KEYMAN_TRACE_H_
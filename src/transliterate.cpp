@@ -0,0 +1,387 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+
+// fcitx5-keyman-transliterate types key sequences with a Keyman keyboard
+// offline, e.g. to prepare a corpus. Each input line is a record
+// "context<TAB>keys", or only "keys", where keys use the syntax of Keyman
+// tests, e.g. "[K_A][SHIFT K_B]". One line with the text before the cursor is
+// written for each record, in input order. Backslash, tab and newlines in the
+// output are escaped as \\, \t, \r and \n.
+//
+// Records are processed in chunks by several threads. Every thread loads the
+// keyboard on its own, since keyman core keeps the processing state in
+// km_core_keyboard and a keyboard can not be used by two threads at once.
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/log.h>
+#include <fcitx-utils/standardpath.h>
+#include <fcitx-utils/stringutils.h>
+#include <keyman_core_api.h>
+#include "keymanlog.h"
+#include "kmpmetadata.h"
+#include "optionstore.h"
+#include "transliterator.h"
+
+FCITX_DEFINE_LOG_CATEGORY(keyman, "keyman");
+
+namespace fcitx {
+
+namespace {
+
+// Records per chunk, large enough that the locking is not noticeable.
+constexpr size_t chunkSize = 256;
+// Chunks queued or done but not written yet, per thread.
+constexpr size_t chunksPerThread = 4;
+
+struct TransliterateChunk {
+    // Line number of the first record.
+    size_t firstLine = 0;
+    std::vector<std::string> records;
+    std::string output;
+    size_t invalid = 0;
+    bool done = false;
+};
+
+// Find the kmx file of a keyboard like KeymanEngine::listInputMethods does.
+std::string findKmx(const std::string &id) {
+    std::set<std::string> keymapDirs;
+    StandardPath::global().scanFiles(
+        StandardPath::Type::Data, "keyman",
+        [&keymapDirs](const std::string &path, const std::string &dir, bool) {
+            if (fs::isdir(stringutils::joinPath(dir, path))) {
+                keymapDirs.insert(path);
+            }
+            return true;
+        });
+    for (const auto &keymapDir : keymapDirs) {
+        auto kmpJsonFiles = StandardPath::global().openAll(
+            StandardPath::Type::Data,
+            stringutils::joinPath("keyman", keymapDir, "kmp.json"), O_RDONLY);
+        for (const auto &kmpJsonFile : kmpJsonFiles) {
+            try {
+                KmpMetadata metadata(kmpJsonFile.fd());
+                if (metadata.keyboards().count(id)) {
+                    return stringutils::joinPath(
+                        fs::dirName(kmpJsonFile.path()),
+                        stringutils::concat(id, ".kmx"));
+                }
+            } catch (...) {
+            }
+        }
+    }
+    return {};
+}
+
+void appendEscaped(std::string &output, const std::string &text) {
+    for (const char c : text) {
+        switch (c) {
+        case '\\':
+            output.append("\\\\");
+            break;
+        case '\t':
+            output.append("\\t");
+            break;
+        case '\r':
+            output.append("\\r");
+            break;
+        case '\n':
+            output.append("\\n");
+            break;
+        default:
+            output.push_back(c);
+            break;
+        }
+    }
+    output.push_back('\n');
+}
+
+class TransliteratePipeline {
+public:
+    TransliteratePipeline(std::string kmxPath, const KeymanOptions *options,
+                          size_t threads)
+        : kmxPath_(std::move(kmxPath)), options_(options),
+          maxChunks_(threads * chunksPerThread) {
+        for (size_t i = 0; i < threads; i++) {
+            threads_.emplace_back(&TransliteratePipeline::work, this);
+        }
+    }
+
+    ~TransliteratePipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        workAvailable_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Return false if a thread failed to load the keyboard.
+    bool run(FILE *input, FILE *output) {
+        size_t lineNumber = 0;
+        auto chunk = std::make_shared<TransliterateChunk>();
+        char *buffer = nullptr;
+        size_t bufferSize = 0;
+        ssize_t length;
+        while ((length = getline(&buffer, &bufferSize, input)) >= 0) {
+            lineNumber++;
+            if (chunk->records.empty()) {
+                chunk->firstLine = lineNumber;
+            }
+            std::string_view record(buffer, length);
+            if (!record.empty() && record.back() == '\n') {
+                record.remove_suffix(1);
+            }
+            chunk->records.emplace_back(record);
+            if (chunk->records.size() == chunkSize) {
+                if (!submit(std::move(chunk), output)) {
+                    free(buffer);
+                    return false;
+                }
+                chunk = std::make_shared<TransliterateChunk>();
+            }
+        }
+        free(buffer);
+        if (!chunk->records.empty() && !submit(std::move(chunk), output)) {
+            return false;
+        }
+        return drain(output, 0);
+    }
+
+    size_t invalid() const { return invalid_; }
+
+private:
+    bool submit(std::shared_ptr<TransliterateChunk> chunk, FILE *output) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(chunk);
+            inFlight_.push_back(std::move(chunk));
+        }
+        workAvailable_.notify_one();
+        return drain(output, maxChunks_ - 1);
+    }
+
+    // Write the finished chunks in order, until at most maxInFlight are left.
+    bool drain(FILE *output, size_t maxInFlight) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!inFlight_.empty()) {
+            if (failed_) {
+                return false;
+            }
+            auto &front = inFlight_.front();
+            if (!front->done) {
+                if (inFlight_.size() <= maxInFlight) {
+                    break;
+                }
+                chunkDone_.wait(lock);
+                continue;
+            }
+            auto chunk = std::move(front);
+            inFlight_.pop_front();
+            lock.unlock();
+            std::fwrite(chunk->output.data(), 1, chunk->output.size(),
+                        output);
+            invalid_ += chunk->invalid;
+            lock.lock();
+        }
+        return !failed_;
+    }
+
+    void work() {
+        km_core_keyboard *keyboard = nullptr;
+        if (km_core_keyboard_load(kmxPath_.data(), &keyboard) !=
+            KM_CORE_STATUS_OK) {
+            fail();
+            return;
+        }
+        {
+            KeymanTransliterator transliterator(keyboard, options_);
+            if (transliterator.valid()) {
+                process(transliterator, keyboard);
+            } else {
+                fail();
+            }
+        }
+        km_core_keyboard_dispose(keyboard);
+    }
+
+    void process(KeymanTransliterator &transliterator,
+                 km_core_keyboard *keyboard) {
+        std::vector<KeymanKeyStroke> keys;
+        std::unique_ptr<KeymanTransliterator> fresh;
+        auto *current = &transliterator;
+        while (true) {
+            std::shared_ptr<TransliterateChunk> chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                workAvailable_.wait(
+                    lock, [this]() { return stop_ || !pending_.empty(); });
+                if (pending_.empty()) {
+                    return;
+                }
+                chunk = std::move(pending_.front());
+                pending_.pop_front();
+            }
+            for (size_t i = 0; i < chunk->records.size(); i++) {
+                std::string_view record = chunk->records[i];
+                std::string_view context;
+                if (const auto tab = record.find('\t');
+                    tab != std::string_view::npos) {
+                    context = record.substr(0, tab);
+                    record = record.substr(tab + 1);
+                }
+                if (!keymanParseKeys(record, keys)) {
+                    FCITX_KEYMAN_WARN() << "Invalid keys at line "
+                                        << chunk->firstLine + i;
+                    chunk->invalid++;
+                    chunk->output.push_back('\n');
+                    continue;
+                }
+                appendEscaped(chunk->output,
+                              current->run(context, keys.data(), keys.size()));
+                if (current->optionChanged()) {
+                    // Do not leak the option to the next record.
+                    fresh = std::make_unique<KeymanTransliterator>(keyboard,
+                                                                   options_);
+                    current = fresh.get();
+                    if (!current->valid()) {
+                        fail();
+                        return;
+                    }
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                chunk->done = true;
+            }
+            chunkDone_.notify_one();
+        }
+    }
+
+    void fail() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            failed_ = true;
+        }
+        chunkDone_.notify_one();
+    }
+
+    const std::string kmxPath_;
+    const KeymanOptions *options_;
+    const size_t maxChunks_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable chunkDone_;
+    // Chunks that are not picked up by a thread yet.
+    std::deque<std::shared_ptr<TransliterateChunk>> pending_;
+    // Chunks that are not written yet, in input order.
+    std::deque<std::shared_ptr<TransliterateChunk>> inFlight_;
+    size_t invalid_ = 0;
+    bool stop_ = false;
+    bool failed_ = false;
+};
+
+void usage(const char *argv0) {
+    std::fprintf(stderr,
+                 "Usage: %s [--threads=N] [--kmx=PATH] [KEYBOARD_ID] "
+                 "[INPUT]\n",
+                 argv0);
+}
+
+} // namespace
+
+} // namespace fcitx
+
+int main(int argc, char *argv[]) {
+    using namespace fcitx;
+    size_t threads = std::max(1U, std::thread::hardware_concurrency());
+    std::string kmx;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = std::max(1UL, std::strtoul(argv[i] + 10, nullptr, 10));
+        } else if (std::strncmp(argv[i], "--kmx=", 6) == 0) {
+            kmx = argv[i] + 6;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (kmx.empty()) {
+        if (args.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+        kmx = findKmx(args.front());
+        if (kmx.empty()) {
+            std::fprintf(stderr, "Keyboard %s is not found.\n",
+                         args.front().data());
+            return 1;
+        }
+        args.erase(args.begin());
+    }
+    if (args.size() > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    FILE *input = stdin;
+    if (!args.empty() && args[0] != "-") {
+        input = std::fopen(args[0].data(), "r");
+        if (!input) {
+            std::fprintf(stderr, "Failed to open %s.\n", args[0].data());
+            return 1;
+        }
+    }
+
+    // Use the options that the user set for the keyboard in fcitx, without
+    // creating or migrating the store of fcitx.
+    KeymanOptionStore optionStore(KeymanOptionStoreMode::ReadOnly);
+    auto id = fs::baseName(kmx);
+    if (stringutils::endsWith(id, ".kmx")) {
+        id.resize(id.size() - 4);
+    }
+    const auto *options = optionStore.options(id);
+
+    bool success;
+    size_t invalid;
+    {
+        TransliteratePipeline pipeline(kmx, options, threads);
+        success = pipeline.run(input, stdout);
+        invalid = pipeline.invalid();
+    }
+    if (input != stdin) {
+        std::fclose(input);
+    }
+    if (!success) {
+        std::fprintf(stderr, "Failed to load %s.\n", kmx.data());
+        return 1;
+    }
+    if (invalid) {
+        std::fprintf(stderr, "%zu records have invalid keys.\n", invalid);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "transliterator.h"
+#include <algorithm>
+#include <utility>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx-utils/utf8.h>
+#include <keyman_core_api_vkeys.h>
+#include "coreutils.h"
+#include "keymanlog.h"
+
+namespace fcitx {
+
+namespace {
+
+#define KEYMAN_VKEY(NAME) {#NAME, KM_CORE_VKEY_##NAME}
+
+const std::pair<std::string_view, km_kpb_virtual_key> virtualKeys[] = {
+    KEYMAN_VKEY(A),       KEYMAN_VKEY(B),       KEYMAN_VKEY(C),
+    KEYMAN_VKEY(D),       KEYMAN_VKEY(E),       KEYMAN_VKEY(F),
+    KEYMAN_VKEY(G),       KEYMAN_VKEY(H),       KEYMAN_VKEY(I),
+    KEYMAN_VKEY(J),       KEYMAN_VKEY(K),       KEYMAN_VKEY(L),
+    KEYMAN_VKEY(M),       KEYMAN_VKEY(N),       KEYMAN_VKEY(O),
+    KEYMAN_VKEY(P),       KEYMAN_VKEY(Q),       KEYMAN_VKEY(R),
+    KEYMAN_VKEY(S),       KEYMAN_VKEY(T),       KEYMAN_VKEY(U),
+    KEYMAN_VKEY(V),       KEYMAN_VKEY(W),       KEYMAN_VKEY(X),
+    KEYMAN_VKEY(Y),       KEYMAN_VKEY(Z),       KEYMAN_VKEY(0),
+    KEYMAN_VKEY(1),       KEYMAN_VKEY(2),       KEYMAN_VKEY(3),
+    KEYMAN_VKEY(4),       KEYMAN_VKEY(5),       KEYMAN_VKEY(6),
+    KEYMAN_VKEY(7),       KEYMAN_VKEY(8),       KEYMAN_VKEY(9),
+    KEYMAN_VKEY(SPACE),   KEYMAN_VKEY(BKSP),    KEYMAN_VKEY(ENTER),
+    KEYMAN_VKEY(TAB),     KEYMAN_VKEY(ESC),     KEYMAN_VKEY(BKQUOTE),
+    KEYMAN_VKEY(HYPHEN),  KEYMAN_VKEY(EQUAL),   KEYMAN_VKEY(LBRKT),
+    KEYMAN_VKEY(RBRKT),   KEYMAN_VKEY(BKSLASH), KEYMAN_VKEY(COLON),
+    KEYMAN_VKEY(QUOTE),   KEYMAN_VKEY(COMMA),   KEYMAN_VKEY(PERIOD),
+    KEYMAN_VKEY(SLASH),   KEYMAN_VKEY(oE2),     KEYMAN_VKEY(NP0),
+    KEYMAN_VKEY(NP1),     KEYMAN_VKEY(NP2),     KEYMAN_VKEY(NP3),
+    KEYMAN_VKEY(NP4),     KEYMAN_VKEY(NP5),     KEYMAN_VKEY(NP6),
+    KEYMAN_VKEY(NP7),     KEYMAN_VKEY(NP8),     KEYMAN_VKEY(NP9),
+    KEYMAN_VKEY(NPDOT),   KEYMAN_VKEY(NPMINUS), KEYMAN_VKEY(NPPLUS),
+    KEYMAN_VKEY(NPSTAR),
+};
+
+#undef KEYMAN_VKEY
+
+// Keyman core does not tell the left and right keys apart for shift, and the
+// engine sends the left keys for the generic names.
+const std::pair<std::string_view, uint16_t> modifierNames[] = {
+    {"SHIFT", KM_CORE_MODIFIER_SHIFT},  {"LSHIFT", KM_CORE_MODIFIER_SHIFT},
+    {"RSHIFT", KM_CORE_MODIFIER_SHIFT}, {"CTRL", KM_CORE_MODIFIER_LCTRL},
+    {"LCTRL", KM_CORE_MODIFIER_LCTRL},  {"RCTRL", KM_CORE_MODIFIER_RCTRL},
+    {"ALT", KM_CORE_MODIFIER_LALT},     {"LALT", KM_CORE_MODIFIER_LALT},
+    {"RALT", KM_CORE_MODIFIER_RALT},    {"CAPS", KM_CORE_MODIFIER_CAPS},
+};
+
+} // namespace
+
+km_kpb_virtual_key keymanVirtualKey(std::string_view name) {
+    if (!stringutils::startsWith(name, "K_")) {
+        return 0;
+    }
+    name.remove_prefix(2);
+    for (const auto &[vkName, vk] : virtualKeys) {
+        if (vkName == name) {
+            return vk;
+        }
+    }
+    return 0;
+}
+
+bool keymanParseKeys(std::string_view str,
+                     std::vector<KeymanKeyStroke> &keys) {
+    keys.clear();
+    str = stringutils::trimView(str);
+    while (!str.empty()) {
+        const auto end = str.find(']');
+        if (str.front() != '[' || end == std::string_view::npos) {
+            return false;
+        }
+        auto key = str.substr(1, end - 1);
+        str = stringutils::trimView(str.substr(end + 1));
+        KeymanKeyStroke stroke;
+        while (true) {
+            const auto space = key.find(' ');
+            const auto token = key.substr(0, space);
+            if (space == std::string_view::npos) {
+                stroke.vk = keymanVirtualKey(token);
+                break;
+            }
+            key = stringutils::trimView(key.substr(space + 1));
+            bool found = false;
+            for (const auto &[name, modifier] : modifierNames) {
+                if (name == token) {
+                    stroke.modifiers |= modifier;
+                    found = true;
+                }
+            }
+            if (!found) {
+                return false;
+            }
+        }
+        if (!stroke.vk) {
+            return false;
+        }
+        keys.push_back(stroke);
+    }
+    return true;
+}
+
+KeymanTransliterator::KeymanTransliterator(km_core_keyboard *keyboard,
+                                           const KeymanOptions *options) {
+    if (keymanCreateState(keyboard, &state_) != KM_CORE_STATUS_OK) {
+        FCITX_KEYMAN_ERROR() << "problem creating km_core_state for "
+                                "transliteration";
+        state_ = nullptr;
+        return;
+    }
+    if (options) {
+        updateKeyboardOptions(state_, *options);
+    }
+}
+
+KeymanTransliterator::~KeymanTransliterator() {
+    if (state_) {
+        km_core_state_dispose(state_);
+    }
+}
+
+const std::string &KeymanTransliterator::run(std::string_view context,
+                                             const KeymanKeyStroke *keys,
+                                             size_t count) {
+    text_.clear();
+    output_.clear();
+    // Clear first, so dead keys left by the previous text are not kept.
+    km_core_state_context_clear(state_);
+    const auto utf16 = utf8ToUTF16(context);
+    if (utf16.size() > 1) {
+        km_core_state_context_set_if_needed(
+            state_, reinterpret_cast<const km_core_cp *>(utf16.data()));
+        for (const auto c : utf8::MakeUTF8CharRange(context)) {
+            text_.push_back(c);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        process(keys[i], true);
+        process(keys[i], false);
+    }
+    for (const auto c : text_) {
+        output_.append(utf8::UCS4ToUTF8(c));
+    }
+    return output_;
+}
+
+void KeymanTransliterator::process(const KeymanKeyStroke &key,
+                                   bool isKeyDown) {
+    km_core_process_event(state_, key.vk, key.modifiers, isKeyDown, 0);
+    const auto *actions = km_core_state_get_actions(state_);
+    size_t deleteCount = actions->code_points_to_delete;
+    bool backspace = isKeyDown && key.vk == KM_CORE_VKEY_BKSP &&
+                     actions->emit_keystroke;
+    if (isKeyDown && key.vk == KM_CORE_VKEY_BKSP && deleteCount == 1) {
+        // The engine passes it to the application, see
+        // KeymanEngine::keyEvent.
+        backspace = true;
+        deleteCount = 0;
+    }
+    text_.resize(text_.size() - std::min(deleteCount, text_.size()));
+    for (size_t n = 0; actions->output && actions->output[n]; n++) {
+        text_.push_back(actions->output[n]);
+    }
+    if (backspace && !text_.empty()) {
+        text_.pop_back();
+    }
+    if (actions->persist_options && actions->persist_options[0].scope) {
+        optionChanged_ = true;
+    }
+}
+
+} // namespace fcitx
@@ -0,0 +1,69 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_TRANSLITERATOR_H_
+#define _FCITX5_KEYMAN_TRANSLITERATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <keyman_core_api.h>
+#include "optionstore.h"
+
+namespace fcitx {
+
+struct KeymanKeyStroke {
+    uint16_t vk = 0;
+    // KM_CORE_MODIFIER_*.
+    uint16_t modifiers = 0;
+};
+
+// Virtual key of a Keyman key name like "K_A", 0 if it is unknown.
+km_kpb_virtual_key keymanVirtualKey(std::string_view name);
+
+// Parse keys in the syntax of Keyman tests, e.g. "[K_A][SHIFT K_B]". Return
+// false if it is not valid.
+bool keymanParseKeys(std::string_view str, std::vector<KeymanKeyStroke> &keys);
+
+// A km_core_state that is not attached to any input context, used to type
+// keys offline. The text is edited like an application with surrounding text
+// would do.
+//
+// A keyboard may only be used by one thread at a time, since keyman core
+// keeps the processing state in km_core_keyboard.
+class KeymanTransliterator {
+public:
+    KeymanTransliterator(km_core_keyboard *keyboard,
+                         const KeymanOptions *options);
+    ~KeymanTransliterator();
+    KeymanTransliterator(const KeymanTransliterator &) = delete;
+    KeymanTransliterator &operator=(const KeymanTransliterator &) = delete;
+
+    bool valid() const { return state_; }
+
+    // Type keys after context, return the text before the cursor. The
+    // returned reference is valid until the next call.
+    const std::string &run(std::string_view context,
+                           const KeymanKeyStroke *keys, size_t count);
+
+    // Whether the keyboard asked to persist an option, the state should not
+    // be reused for unrelated text.
+    bool optionChanged() const { return optionChanged_; }
+
+private:
+    void process(const KeymanKeyStroke &key, bool isKeyDown);
+
+    km_core_state *state_ = nullptr;
+    std::vector<km_core_usv> text_;
+    std::string output_;
+    bool optionChanged_ = false;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_TRANSLITERATOR_H_
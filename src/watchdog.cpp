@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "watchdog.h"
+#include "keymanlog.h"
+
+namespace fcitx {
+
+const char *keymanCoreCallName(KeymanCoreCall call) {
+    switch (call) {
+    case KeymanCoreCall::KeyboardLoad:
+        return "km_core_keyboard_load";
+    case KeymanCoreCall::StateCreate:
+        return "km_core_state_create";
+    case KeymanCoreCall::ContextSet:
+        return "km_core_state_context_set_if_needed";
+    case KeymanCoreCall::ProcessEvent:
+        return "km_core_process_event";
+    }
+    return "";
+}
+
+bool KeymanWatchdog::check(const std::string &keyboard, KeymanCoreCall call,
+                           uint16_t vk, size_t contextLength, uint64_t start,
+                           uint64_t end) {
+    const auto duration = end - start;
+    const bool slow = threshold_ && duration >= threshold_;
+    auto iter = keyboards_.find(keyboard);
+    if (iter == keyboards_.end()) {
+        if (!slow) {
+            // Only keep the state of keyboards that have been slow.
+            return false;
+        }
+        iter = keyboards_.emplace(keyboard, KeyboardState()).first;
+    }
+    auto &state = iter->second;
+    const bool wasFlagged = state.flagged;
+    state.calls++;
+    if (slow) {
+        state.slowCalls++;
+        if (state.slowCalls >= slowFlagCount) {
+            state.flagged = true;
+        }
+
+        if (log_.size() >= logCapacity) {
+            log_.pop_front();
+        }
+        KeymanSlowCall &entry = log_.emplace_back();
+        entry.timestamp = start;
+        entry.duration = duration;
+        entry.keyboard = keyboard;
+        entry.call = call;
+        entry.vk = vk;
+        entry.contextLength = contextLength;
+
+        if (state.lastWarning && end - state.lastWarning < warningInterval) {
+            state.suppressed++;
+        } else {
+            FCITX_KEYMAN_WARN()
+                << "Keyboard " << keyboard << " is slow: "
+                << keymanCoreCallName(call) << " took " << duration / 1000000
+                << "ms, vk=" << vk << " context length=" << contextLength
+                << ", " << state.suppressed << " similar warnings suppressed.";
+            state.lastWarning = end;
+            state.suppressed = 0;
+        }
+    }
+    if (state.calls >= windowSize) {
+        state.flagged = state.slowCalls >= slowFlagCount;
+        state.calls = 0;
+        state.slowCalls = 0;
+    }
+    return wasFlagged != state.flagged;
+}
+
+bool KeymanWatchdog::isSlow(const std::string &keyboard) const {
+    auto iter = keyboards_.find(keyboard);
+    return iter != keyboards_.end() && iter->second.flagged;
+}
+
+void KeymanWatchdog::forget(const std::string &keyboard) {
+    keyboards_.erase(keyboard);
+}
+
+} // namespace fcitx
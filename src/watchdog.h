@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_WATCHDOG_H_
+#define _FCITX5_KEYMAN_WATCHDOG_H_
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+namespace fcitx {
+
+enum class KeymanCoreCall {
+    KeyboardLoad,
+    StateCreate,
+    ContextSet,
+    ProcessEvent,
+};
+
+const char *keymanCoreCallName(KeymanCoreCall call);
+
+struct KeymanSlowCall {
+    // CLOCK_MONOTONIC in nanoseconds.
+    uint64_t timestamp = 0;
+    uint64_t duration = 0;
+    std::string keyboard;
+    KeymanCoreCall call = KeymanCoreCall::ProcessEvent;
+    uint16_t vk = 0;
+    uint32_t contextLength = 0;
+};
+
+// Keep track of keyman core calls that are slower than the threshold.
+//
+// A keyboard is flagged as slow when it has slowFlagCount slow calls within
+// a window of windowSize calls, and unflagged after a window with fewer slow
+// calls. Warnings are logged at most once per warningInterval per keyboard.
+class KeymanWatchdog {
+public:
+    static constexpr size_t logCapacity = 128;
+    static constexpr uint32_t windowSize = 200;
+    static constexpr uint32_t slowFlagCount = 10;
+    static constexpr uint64_t warningInterval = 30000000000ULL;
+
+    void setThreshold(uint64_t threshold) { threshold_ = threshold; }
+    uint64_t threshold() const { return threshold_; }
+
+    // Return true if the keyboard becomes flagged or unflagged.
+    bool check(const std::string &keyboard, KeymanCoreCall call, uint16_t vk,
+               size_t contextLength, uint64_t start, uint64_t end);
+    bool isSlow(const std::string &keyboard) const;
+    // Discard the history of a keyboard, e.g. it is replaced by a new
+    // version.
+    void forget(const std::string &keyboard);
+    // Slow calls from the oldest to the newest.
+    const auto &log() const { return log_; }
+
+private:
+    struct KeyboardState {
+        uint32_t calls = 0;
+        uint32_t slowCalls = 0;
+        bool flagged = false;
+        uint64_t lastWarning = 0;
+        uint64_t suppressed = 0;
+    };
+
+    uint64_t threshold_ = 0;
+    std::deque<KeymanSlowCall> log_;
+    std::unordered_map<std::string, KeyboardState> keyboards_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_WATCHDOG_H_
@@ -0,0 +1,184 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include "worker.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include "keymanlog.h"
+#include "stats.h"
+
+namespace fcitx {
+
+namespace {
+
+// Copy a zero terminated string, including the trailing zero.
+std::vector<km_core_cp> copyString(const km_core_cp *str) {
+    const auto *end = str;
+    while (*end) {
+        ++end;
+    }
+    return {str, end + 1};
+}
+
+} // namespace
+
+void KeymanActions::assign(const km_core_actions *actions) {
+    deleteCount = actions->code_points_to_delete;
+    output.clear();
+    for (size_t n = 0; actions->output && actions->output[n]; n++) {
+        output.push_back(actions->output[n]);
+    }
+    persistOptions.clear();
+    for (size_t i = 0; actions->persist_options[i].scope; i++) {
+        const auto *key = actions->persist_options[i].key;
+        const auto *value = actions->persist_options[i].value;
+        if (key && value) {
+            persistOptions.emplace_back(copyString(key), copyString(value));
+        }
+    }
+    alert = actions->do_alert;
+    emitKeystroke = actions->emit_keystroke;
+}
+
+KeymanWorker::KeymanWorker(EventLoop *loop, std::function<void()> callback)
+    : shared_(std::make_shared<Shared>()), callback_(std::move(callback)) {
+    shared_->resultEvent.give(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (!shared_->resultEvent.isValid()) {
+        FCITX_KEYMAN_ERROR() << "Failed to create eventfd for keyman worker.";
+        return;
+    }
+    event_ = loop->addIOEvent(shared_->resultEvent.fd(), IOEventFlag::In,
+                              [this](EventSourceIO *, int fd, IOEventFlags) {
+                                  drainEvent(fd);
+                                  callback_();
+                                  return true;
+                              });
+    thread_ = std::thread(&KeymanWorker::run, shared_);
+}
+
+KeymanWorker::~KeymanWorker() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    bool stuck;
+    {
+        std::lock_guard<std::mutex> lock(shared_->mutex);
+        shared_->quit = true;
+        stuck = shared_->processing;
+    }
+    shared_->requestAvailable.notify_one();
+    if (stuck) {
+        FCITX_KEYMAN_ERROR()
+            << "Keyman worker is stuck, leaving it to finish by itself.";
+        thread_.detach();
+    } else {
+        thread_.join();
+    }
+}
+
+uint64_t KeymanWorker::submit(KeymanWorkerRequest request) {
+    if (!thread_.joinable()) {
+        return 0;
+    }
+    request.sequence = nextSequence_;
+    {
+        std::lock_guard<std::mutex> lock(shared_->mutex);
+        shared_->requests.push_back(std::move(request));
+    }
+    shared_->requestAvailable.notify_one();
+    return nextSequence_++;
+}
+
+bool KeymanWorker::idle() const {
+    return shared_->completed.load(std::memory_order_acquire) + 1 ==
+           nextSequence_;
+}
+
+bool KeymanWorker::wait(uint64_t timeout) {
+    struct pollfd pfd;
+    pfd.fd = shared_->resultEvent.fd();
+    pfd.events = POLLIN;
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    if (ppoll(&pfd, 1, &ts, nullptr) <= 0) {
+        return false;
+    }
+    drainEvent(pfd.fd);
+    return true;
+}
+
+bool KeymanWorker::pop(KeymanWorkerResult &result) {
+    return shared_->results.pop(result);
+}
+
+void KeymanWorker::drainEvent(int fd) {
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    }
+}
+
+void KeymanWorker::run(std::shared_ptr<Shared> shared) {
+    KeymanWorkerRequest request;
+    KeymanWorkerResult result;
+    auto notify = [&shared]() {
+        uint64_t value = 1;
+        if (write(shared->resultEvent.fd(), &value, sizeof(value)) < 0) {
+            FCITX_KEYMAN_ERROR() << "Failed to notify keyman result.";
+        }
+    };
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    while (true) {
+        shared->requestAvailable.wait(lock, [&shared]() {
+            return shared->quit || !shared->requests.empty();
+        });
+        if (shared->requests.empty()) {
+            break;
+        }
+        request = std::move(shared->requests.front());
+        shared->requests.pop_front();
+        // Nobody waits for the result after quit.
+        const bool process =
+            request.type == KeymanWorkerRequest::Type::Process &&
+            !shared->quit;
+        shared->processing = process;
+        lock.unlock();
+        switch (request.type) {
+        case KeymanWorkerRequest::Type::Process:
+            if (!process) {
+                break;
+            }
+            result.sequence = request.sequence;
+            result.start = keymanNow();
+            km_core_process_event(request.state, request.vk,
+                                  request.modifiers, request.isKeyDown, 0);
+            result.end = keymanNow();
+            result.actions.assign(km_core_state_get_actions(request.state));
+            // There is at most one process request at a time, so there is
+            // always space for the result.
+            shared->results.push(std::move(result));
+            break;
+        case KeymanWorkerRequest::Type::DisposeState:
+            km_core_state_dispose(request.state);
+            break;
+        case KeymanWorkerRequest::Type::DisposeKeyboard:
+            km_core_keyboard_dispose(request.keyboard);
+            break;
+        }
+        shared->completed.store(request.sequence, std::memory_order_release);
+        lock.lock();
+        shared->processing = false;
+        // Wake up the main thread for a result, or once all the requests
+        // are done.
+        if (process || shared->requests.empty()) {
+            notify();
+        }
+    }
+}
+
+} // namespace fcitx
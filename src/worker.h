@@ -0,0 +1,148 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#ifndef _FCITX5_KEYMAN_WORKER_H_
+#define _FCITX5_KEYMAN_WORKER_H_
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/unixfd.h>
+#include <keyman_core_api.h>
+
+namespace fcitx {
+
+// Bounded lock free queue with a single producer and a single consumer.
+template <typename T, size_t Capacity>
+class KeymanSpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+public:
+    bool push(T &&value) {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots_[tail & (Capacity - 1)] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value) {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots_[head & (Capacity - 1)]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    // Keep the indices on different cache lines.
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::array<T, Capacity> slots_;
+};
+
+// Copy of km_core_actions that outlives the next call to the state.
+struct KeymanActions {
+    unsigned int deleteCount = 0;
+    std::vector<km_core_usv> output;
+    // Key and value with the trailing zero.
+    std::vector<std::pair<std::vector<km_core_cp>, std::vector<km_core_cp>>>
+        persistOptions;
+    bool alert = false;
+    bool emitKeystroke = false;
+
+    void assign(const km_core_actions *actions);
+};
+
+struct KeymanWorkerRequest {
+    enum class Type {
+        Process,
+        // Dispose the state or keyboard after earlier requests are done.
+        DisposeState,
+        DisposeKeyboard,
+    };
+    Type type = Type::Process;
+    uint64_t sequence = 0;
+    km_core_state *state = nullptr;
+    km_core_keyboard *keyboard = nullptr;
+    uint16_t vk = 0;
+    uint16_t modifiers = 0;
+    bool isKeyDown = false;
+};
+
+struct KeymanWorkerResult {
+    uint64_t sequence = 0;
+    // CLOCK_MONOTONIC of km_core_process_event.
+    uint64_t start = 0;
+    uint64_t end = 0;
+    KeymanActions actions;
+};
+
+// A thread that runs km_core_process_event. Requests are processed in the
+// order they are submitted, and each process request has a result with the
+// same sequence. Results are read on the main thread.
+class KeymanWorker {
+public:
+    static constexpr size_t capacity = 16;
+
+    // Called in the main thread when results are available, or when the
+    // worker becomes idle.
+    KeymanWorker(EventLoop *loop, std::function<void()> callback);
+    // Process requests that are not started are dropped, dispose requests
+    // are still done. The thread is detached if it is stuck in keyman core,
+    // and exits once the call returns.
+    ~KeymanWorker();
+
+    // Return the sequence of the request, 0 if the thread is not running.
+    // There must be at most one process request without a result.
+    uint64_t submit(KeymanWorkerRequest request);
+    // Whether all the submitted requests are done.
+    bool idle() const;
+    // Wait at most timeout nanoseconds for a result to be available.
+    bool wait(uint64_t timeout);
+    bool pop(KeymanWorkerResult &result);
+
+private:
+    // Owned together by the worker and the thread, so a detached thread can
+    // finish the call it is stuck in.
+    struct Shared {
+        UnixFD resultEvent;
+        std::mutex mutex;
+        std::condition_variable requestAvailable;
+        std::deque<KeymanWorkerRequest> requests;
+        bool quit = false;
+        bool processing = false;
+        std::atomic<uint64_t> completed{0};
+        KeymanSpscQueue<KeymanWorkerResult, capacity> results;
+    };
+
+    static void run(std::shared_ptr<Shared> shared);
+    static void drainEvent(int fd);
+
+    std::shared_ptr<Shared> shared_;
+    std::unique_ptr<EventSourceIO> event_;
+    std::function<void()> callback_;
+    uint64_t nextSequence_ = 1;
+    std::thread thread_;
+};
+
+} // namespace fcitx
+
+#endif // _FCITX5_KEYMAN_WORKER_H_
@@ -0,0 +1,422 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx-utils/utf8.h>
+#include <fcitx/event.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "kmpdata.h"
+#include "stats.h"
+#include "transliterator.h"
+
+// Run the tests of a keyboard through KeymanEngine::keyEvent, and report
+// whether the output matches and how long the key events take.
+//
+// Tests use the format of the Keyman Core baseline tests, comment lines that
+// are usually in the kmn source of the keyboard:
+//
+//   c Description: Optional description of the next test.
+//   c context: text before the cursor
+//   c keys: [K_A][SHIFT K_B][RALT K_C]
+//   c expected: the whole text after the keys
+//
+// Context and expected may use \uXXXX escapes.
+//
+// A file may contain several tests, each one ends with its expected line.
+
+using namespace fcitx;
+
+namespace {
+
+constexpr uint64_t defaultBudgetMs = 20;
+
+struct KeymanTestKey {
+    Key key;
+    // Modifier keys pressed before the key and released after it.
+    std::vector<Key> modifiers;
+};
+
+struct KeymanKeyboardTest {
+    std::string name;
+    std::string context;
+    std::string expected;
+    std::vector<KeymanTestKey> keys;
+    // Set if the test uses something that the engine does not support.
+    std::string unsupported;
+};
+
+struct KeymanKeyboardTestResult {
+    std::string name;
+    enum class Status { Passed, Failed, Skipped, OverBudget } status;
+    std::string message;
+    uint64_t events = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
+
+const char *statusName(KeymanKeyboardTestResult::Status status) {
+    switch (status) {
+    case KeymanKeyboardTestResult::Status::Passed:
+        return "PASS";
+    case KeymanKeyboardTestResult::Status::Failed:
+        return "FAIL";
+    case KeymanKeyboardTestResult::Status::Skipped:
+        return "SKIP";
+    case KeymanKeyboardTestResult::Status::OverBudget:
+        return "SLOW";
+    }
+    return "";
+}
+
+struct KeymanTestModifier {
+    // KM_CORE_MODIFIER_*.
+    uint16_t modifier;
+    Key key;
+    KeyState state;
+};
+
+// X11 key codes of the modifier keys, in the order they are pressed.
+const KeymanTestModifier modifierKeys[] = {
+    {KM_CORE_MODIFIER_SHIFT, Key(FcitxKey_Shift_L, KeyStates(), 50),
+     KeyState::Shift},
+    {KM_CORE_MODIFIER_LCTRL, Key(FcitxKey_Control_L, KeyStates(), 37),
+     KeyState::Ctrl},
+    {KM_CORE_MODIFIER_RCTRL, Key(FcitxKey_Control_R, KeyStates(), 105),
+     KeyState::Ctrl},
+    {KM_CORE_MODIFIER_LALT, Key(FcitxKey_Alt_L, KeyStates(), 64),
+     KeyState::Alt},
+    {KM_CORE_MODIFIER_RALT, Key(FcitxKey_ISO_Level3_Shift, KeyStates(), 108),
+     KeyState::Mod5},
+};
+
+// X11 key code of a virtual key, 0 if the engine can not produce it.
+int keycodeFromVirtualKey(km_kpb_virtual_key vk) {
+    for (int keycode = 1; keycode < 256; keycode++) {
+        if (keycode_to_vk[keycode] == vk) {
+            return keycode + 8;
+        }
+    }
+    return 0;
+}
+
+// Turn a key parsed by keymanParseKeys into the fcitx keys to send, set
+// unsupported if the engine can not produce it.
+KeymanTestKey testKey(const KeymanKeyStroke &stroke,
+                      std::string &unsupported) {
+    KeymanTestKey result;
+    KeyStates states;
+    uint16_t remaining = stroke.modifiers;
+    for (const auto &item : modifierKeys) {
+        if (!(stroke.modifiers & item.modifier)) {
+            continue;
+        }
+        result.modifiers.push_back(
+            Key(item.key.sym(), states, item.key.code()));
+        states |= item.state;
+        remaining &= ~item.modifier;
+    }
+    if (remaining) {
+        // Caps lock is not passed to keyman core by the engine.
+        unsupported = "modifier CAPS";
+    }
+    if (const int keycode = keycodeFromVirtualKey(stroke.vk)) {
+        const auto sym = stroke.vk == KM_CORE_VKEY_BKSP ? FcitxKey_BackSpace
+                                                        : FcitxKey_None;
+        result.key = Key(sym, states, keycode);
+    } else {
+        unsupported = stringutils::concat("key ", stroke.vk);
+    }
+    return result;
+}
+
+// Expand \uXXXX escapes.
+std::string unescape(std::string_view str) {
+    std::string result;
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '\\' && i + 1 < str.size() &&
+            (str[i + 1] == 'u' || str[i + 1] == 'U')) {
+            size_t end = i + 2;
+            while (end < str.size() && end < i + 8 &&
+                   std::isxdigit(static_cast<unsigned char>(str[end]))) {
+                end++;
+            }
+            if (end - i - 2 >= 4) {
+                result.append(utf8::UCS4ToUTF8(std::strtoul(
+                    std::string(str.substr(i + 2, end - i - 2)).data(),
+                    nullptr, 16)));
+                i = end - 1;
+                continue;
+            }
+        }
+        result.push_back(str[i]);
+    }
+    return result;
+}
+
+std::vector<KeymanKeyboardTest> parseTests(const std::string &path) {
+    std::vector<KeymanKeyboardTest> tests;
+    std::ifstream file(path);
+    std::string line;
+    KeymanKeyboardTest test;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        auto trimmed = stringutils::trimView(line);
+        if (trimmed.size() < 2 ||
+            (trimmed[0] != 'c' && trimmed[0] != 'C') || trimmed[1] != ' ') {
+            continue;
+        }
+        trimmed = stringutils::trimView(trimmed.substr(2));
+        const auto colon = trimmed.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        auto keyword = std::string(trimmed.substr(0, colon));
+        for (auto &c : keyword) {
+            c = std::tolower(static_cast<unsigned char>(c));
+        }
+        const auto value = stringutils::trimView(trimmed.substr(colon + 1));
+        if (keyword == "description") {
+            test.name = std::string(value);
+        } else if (keyword == "context") {
+            test.context = unescape(value);
+        } else if (keyword == "keys") {
+            std::vector<KeymanKeyStroke> strokes;
+            if (!keymanParseKeys(value, strokes)) {
+                test.unsupported = "invalid keys";
+                continue;
+            }
+            for (const auto &stroke : strokes) {
+                test.keys.push_back(testKey(stroke, test.unsupported));
+            }
+        } else if (keyword == "expected") {
+            test.expected = unescape(value);
+            if (test.name.empty()) {
+                test.name =
+                    stringutils::concat(fs::baseName(path), ":", lineNumber);
+            }
+            tests.push_back(std::move(test));
+            test = KeymanKeyboardTest();
+        } else if (keyword == "option" || keyword == "capslock") {
+            test.unsupported = keyword;
+        }
+    }
+    return tests;
+}
+
+class KeymanKeyboardTestRunner {
+public:
+    KeymanKeyboardTestRunner(Instance &instance, KeymanEngine &engine,
+                             const InputMethodEntry &entry, uint64_t budget)
+        : instance_(instance), engine_(engine), entry_(entry),
+          budget_(budget) {}
+
+    KeymanKeyboardTestResult run(const KeymanKeyboardTest &test) {
+        KeymanKeyboardTestResult result;
+        result.name = test.name;
+        if (!test.unsupported.empty()) {
+            result.status = KeymanKeyboardTestResult::Status::Skipped;
+            result.message = "unsupported " + test.unsupported;
+            return result;
+        }
+        FakeInputContext ic(instance_.inputContextManager(), true);
+        ic.surroundingText().setText(test.context, utf8::length(test.context),
+                                     utf8::length(test.context));
+        InputContextEvent event(&ic, EventType::InputContextSwitchInputMethod);
+        engine_.activate(entry_, event);
+        for (const auto &key : test.keys) {
+            for (const auto &modifier : key.modifiers) {
+                send(ic, modifier, false, result);
+            }
+            send(ic, key.key, false, result);
+            send(ic, key.key, true, result);
+            for (auto iter = key.modifiers.rbegin();
+                 iter != key.modifiers.rend(); ++iter) {
+                // The state of release includes the modifier itself.
+                send(ic,
+                     Key(iter->sym(), key.key.states(), iter->code()), true,
+                     result);
+            }
+        }
+        const auto &text = ic.surroundingText().text();
+        if (text != test.expected) {
+            result.status = KeymanKeyboardTestResult::Status::Failed;
+            result.message = stringutils::concat("got \"", text,
+                                                 "\", expected \"",
+                                                 test.expected, "\"");
+        } else if (result.max > budget_) {
+            result.status = KeymanKeyboardTestResult::Status::OverBudget;
+            result.message = "key event over the budget";
+        } else {
+            result.status = KeymanKeyboardTestResult::Status::Passed;
+        }
+        return result;
+    }
+
+private:
+    void send(FakeInputContext &ic, const Key &key, bool isRelease,
+              KeymanKeyboardTestResult &result) {
+        KeyEvent event(&ic, key, isRelease);
+        const auto start = keymanNow();
+        engine_.keyEvent(entry_, event);
+        const auto duration = keymanNow() - start;
+        ic.applyKey(event);
+        result.events++;
+        result.total += duration;
+        result.max = std::max(result.max, duration);
+    }
+
+    Instance &instance_;
+    KeymanEngine &engine_;
+    const InputMethodEntry &entry_;
+    uint64_t budget_;
+};
+
+// Quote a string for JSON output.
+std::string jsonString(std::string_view str) {
+    std::string result = "\"";
+    for (const char c : str) {
+        if (c == '"' || c == '\\') {
+            result.push_back('\\');
+            result.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            result.append(escaped);
+        } else {
+            result.push_back(c);
+        }
+    }
+    result.push_back('"');
+    return result;
+}
+
+void usage(const char *argv0) {
+    std::fprintf(stderr,
+                 "Usage: %s [--json] [--keyboard=ID] [--budget-ms=MS] "
+                 "PACKAGE_DIR TEST_FILE...\n",
+                 argv0);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    bool json = false;
+    std::string keyboard;
+    uint64_t budgetMs = defaultBudgetMs;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (std::strncmp(argv[i], "--keyboard=", 11) == 0) {
+            keyboard = argv[i] + 11;
+        } else if (keymanParseOption(argv[i], "--budget-ms", budgetMs)) {
+            continue;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.size() < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    KeymanBenchmarkEnvironment environment;
+    environment.addPackage(paths[0]);
+    auto &engine = environment.createEngine("fcitx5-keyman-keyboard-test");
+    auto &instance = environment.instance();
+    const auto &entries = environment.listInputMethods();
+    if (entries.empty()) {
+        std::fprintf(stderr, "No keyboard in %s.\n", paths[0].data());
+        return 1;
+    }
+
+    bool failed = false;
+    if (!json) {
+        std::printf("%-40s %6s %8s %10s %10s\n", "test", "result", "events",
+                    "total_us", "max_us");
+    }
+    for (size_t i = 1; i < paths.size(); i++) {
+        // Use the keyboard with the same name as the test file by default.
+        auto id = keyboard;
+        if (id.empty()) {
+            id = fs::baseName(paths[i]);
+            id = id.substr(0, id.find('.'));
+        }
+        const auto *entry = environment.findEntry(id);
+        if (!entry) {
+            std::string ids;
+            for (const auto &item : entries) {
+                ids.append(" ").append(item.uniqueName().substr(7));
+            }
+            std::fprintf(stderr,
+                         "No keyboard %s for %s, pass --keyboard=ID with one "
+                         "of:%s\n",
+                         id.data(), paths[i].data(), ids.data());
+            failed = true;
+            continue;
+        }
+        // Load the kmx file first, so loading is not counted as latency.
+        auto *data = engine.keyboards().at(id).get();
+        data->load();
+        if (!data->ready()) {
+            std::fprintf(stderr, "Failed to load keyboard %s.\n", id.data());
+            failed = true;
+            continue;
+        }
+
+        KeymanKeyboardTestRunner runner(instance, engine, *entry,
+                                        budgetMs * 1000000);
+        const auto tests = parseTests(paths[i]);
+        if (tests.empty()) {
+            std::fprintf(stderr, "No test in %s.\n", paths[i].data());
+            failed = true;
+            continue;
+        }
+        for (const auto &test : tests) {
+            const auto result = runner.run(test);
+            using Status = KeymanKeyboardTestResult::Status;
+            failed = failed || result.status == Status::Failed ||
+                     result.status == Status::OverBudget;
+            if (json) {
+                std::printf(
+                    "{\"keyboard\":%s,\"name\":%s,\"result\":\"%s\","
+                    "\"events\":%llu,\"total_ns\":%llu,\"max_ns\":%llu}\n",
+                    jsonString(id).data(), jsonString(result.name).data(),
+                    statusName(result.status),
+                    static_cast<unsigned long long>(result.events),
+                    static_cast<unsigned long long>(result.total),
+                    static_cast<unsigned long long>(result.max));
+            } else {
+                std::printf("%-40s %6s %8llu %10.1f %10.1f\n",
+                            result.name.data(), statusName(result.status),
+                            static_cast<unsigned long long>(result.events),
+                            result.total / 1000.0, result.max / 1000.0);
+            }
+            if (!result.message.empty()) {
+                std::fprintf(stderr, "%s: %s\n", result.name.data(),
+                             result.message.data());
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcitx-utils/eventdispatcher.h>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/log.h>
+#include <fcitx-utils/stringutils.h>
+#include <fcitx-utils/testing.h>
+#include <fcitx-utils/utf8.h>
+#include <fcitx/addonmanager.h>
+#include <fcitx/event.h>
+#include <fcitx/inputcontextmanager.h>
+#include <fcitx/inputmethodgroup.h>
+#include <fcitx/inputmethodmanager.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+#include "fixturekeys.h"
+#include "stats.h"
+#include "testfrontend_public.h"
+
+// Type scripted keys into several input contexts of an in-process fcitx, and
+// report the time from key event to committed string.
+
+using namespace fcitx;
+
+namespace {
+
+// Returned if the fixture keyboards are not built.
+constexpr int skipReturnCode = 77;
+// Half of the input contexts support surrounding text.
+constexpr int numInputContexts = 4;
+
+struct KeymanTestStep {
+    // See keymanFixtureKey.
+    char key;
+    // Expected commit string, empty if nothing is committed.
+    const char *commit;
+};
+
+struct KeymanTestScript {
+    const char *keyboard;
+    std::vector<KeymanTestStep> steps;
+};
+
+const KeymanTestScript scripts[] = {
+    {"fixture_simple",
+     {{'a', "α"}, {'s', "σ"}, {'d', "δ"}, {'f', "φ"}, {'\b', ""},
+      {'j', "ξ"}, {'k', "κ"}, {'<', ""}, {'l', "λ"}}},
+    {"fixture_deadkey",
+     {{'`', ""}, {'a', "à"}, {'`', ""}, {'e', "è"}, {'`', ""}, {'\b', ""},
+      {'o', "o"}, {'`', ""}, {'`', "`"}, {'`', ""}, {'u', "ù"}}},
+    {"fixture_longcontext",
+     {{'a', "a"}, {'b', "b"}, {'c', "c"}, {'d', "d"}, {'e', "e"},
+      {'f', "f"}, {'g', "g"}, {'h', "h"}, {'i', "i"}, {'j', "j"},
+      {'k', "k"}, {'l', "ABCDEFGHIJKL"}, {'a', "a"}, {'b', "b"},
+      {'c', "c"}, {'d', "d"}, {'e', "e"}, {'f', "f"}, {'g', "g"},
+      {'h', "h"}, {'l', "ł"}, {'v', "v"}, {'w', "w"}, {'x', "x"},
+      {'y', "y"}, {'z', "z"}, {'q', "ʠ"}}},
+};
+
+struct KeymanTestContext {
+    ICUUID uuid;
+    InputContext *ic;
+    // Text of the application, for surrounding text.
+    std::string text;
+};
+
+struct KeymanTestResult {
+    std::string name;
+    // Whole key event, including the delivery to the frontend.
+    KeymanLatencyHistogram keyEvent;
+    // From the key event to the committed string.
+    KeymanLatencyHistogram commit;
+};
+
+std::string fixtureKmx(const std::string &keyboard) {
+    return stringutils::joinPath(KEYMAN_FIXTURE_DATA_DIR, "keyman", keyboard,
+                                 stringutils::concat(keyboard, ".kmx"));
+}
+
+// Remove the last count characters.
+void removeLast(std::string &text, size_t count) {
+    const auto length = utf8::length(text);
+    count = std::min(count, length);
+    text.resize(utf8::ncharByteLength(text.begin(), length - count));
+}
+
+class KeymanTest {
+public:
+    KeymanTest(Instance *instance) : instance_(instance) {
+        commitHandler_ = instance_->watchEvent(
+            EventType::InputContextCommitString,
+            EventWatcherPhase::PreInputMethod, [this](Event &event) {
+                auto &commitEvent = static_cast<CommitStringEvent &>(event);
+                lastCommit_ = keymanNow();
+                committed_.append(commitEvent.text());
+            });
+    }
+
+    void run() {
+        auto *engine = static_cast<KeymanEngine *>(
+            instance_->addonManager().addon("keyman", true));
+        FCITX_ASSERT(engine);
+        auto *testfrontend = instance_->addonManager().addon("testfrontend");
+        FCITX_ASSERT(testfrontend);
+        for (const auto &script : scripts) {
+            if (fs::isreg(fixtureKmx(script.keyboard))) {
+                runScript(engine, testfrontend, script);
+            }
+        }
+        print();
+    }
+
+private:
+    void runScript(KeymanEngine *engine, AddonInstance *testfrontend,
+                   const KeymanTestScript &script) {
+        const auto imName = stringutils::concat("keyman:", script.keyboard);
+        auto &imManager = instance_->inputMethodManager();
+        auto group = imManager.currentGroup();
+        group.inputMethodList().clear();
+        group.inputMethodList().push_back(InputMethodGroupItem(imName));
+        group.setDefaultInputMethod("");
+        imManager.setGroup(std::move(group));
+        FCITX_ASSERT(imManager.entry(imName)) << imName;
+
+        std::vector<KeymanTestContext> contexts;
+        for (int i = 0; i < numInputContexts; i++) {
+            auto uuid = testfrontend->call<ITestFrontend::createInputContext>(
+                "testkeyman");
+            auto *ic = instance_->inputContextManager().findByUUID(uuid);
+            FCITX_ASSERT(ic);
+            if (i % 2) {
+                ic->setCapabilityFlags(CapabilityFlag::SurroundingText);
+            }
+            contexts.push_back({uuid, ic, ""});
+        }
+
+        KeymanTestResult plain;
+        plain.name = stringutils::concat(script.keyboard, "/plain");
+        KeymanTestResult surrounding;
+        surrounding.name =
+            stringutils::concat(script.keyboard, "/surrounding");
+        // Focus out resets the context, so the whole script is typed into
+        // one input context at a time.
+        for (auto &context : contexts) {
+            const bool hasSurroundingText = context.ic->capabilityFlags().test(
+                CapabilityFlag::SurroundingText);
+            context.ic->focusIn();
+            for (const auto &step : script.steps) {
+                typeKey(engine, testfrontend, script.keyboard, context, step,
+                        hasSurroundingText ? surrounding : plain);
+            }
+            context.ic->focusOut();
+        }
+        results_.push_back(std::move(plain));
+        results_.push_back(std::move(surrounding));
+
+        for (const auto &context : contexts) {
+            testfrontend->call<ITestFrontend::destroyInputContext>(
+                context.uuid);
+        }
+    }
+
+    void typeKey(KeymanEngine *engine, AddonInstance *testfrontend,
+                 const std::string &keyboard, KeymanTestContext &context,
+                 const KeymanTestStep &step, KeymanTestResult &result) {
+        auto *ic = context.ic;
+        if (ic->capabilityFlags().test(CapabilityFlag::SurroundingText)) {
+            const auto cursor = utf8::length(context.text);
+            ic->surroundingText().setText(context.text, cursor, cursor);
+            ic->updateSurroundingText();
+        }
+        if (step.commit[0]) {
+            testfrontend->call<ITestFrontend::pushCommitExpectation>(
+                step.commit);
+        }
+        const auto deleted = surroundingTextDeleted(engine, keyboard);
+        lastCommit_ = 0;
+        committed_.clear();
+
+        KeyEvent event(ic, keymanFixtureKey(step.key));
+        const auto start = keymanNow();
+        ic->keyEvent(event);
+        const auto end = keymanNow();
+
+        result.keyEvent.record(end - start);
+        if (lastCommit_) {
+            result.commit.record(lastCommit_ - start);
+        }
+        FCITX_ASSERT(committed_ == step.commit)
+            << "Expected " << step.commit << " got " << committed_;
+
+        // Update the text like an application would.
+        removeLast(context.text,
+                   surroundingTextDeleted(engine, keyboard) - deleted);
+        context.text.append(committed_);
+        if (!event.accepted() && step.key == '\b') {
+            removeLast(context.text, 1);
+        }
+    }
+
+    static uint64_t surroundingTextDeleted(KeymanEngine *engine,
+                                           const std::string &keyboard) {
+        auto iter = engine->keyboards().find(keyboard);
+        FCITX_ASSERT(iter != engine->keyboards().end());
+        return iter->second->counters().value(
+            KeymanCounter::SurroundingTextDeleted);
+    }
+
+    void print() const {
+        std::printf("%-32s %6s %12s %12s %12s %12s\n", "scenario", "keys",
+                    "key p50", "key p99", "commit p50", "commit p99");
+        for (const auto &result : results_) {
+            std::printf(
+                "%-32s %6llu %10lluns %10lluns %10lluns %10lluns\n",
+                result.name.data(),
+                static_cast<unsigned long long>(result.keyEvent.count()),
+                static_cast<unsigned long long>(
+                    result.keyEvent.percentile(50)),
+                static_cast<unsigned long long>(
+                    result.keyEvent.percentile(99)),
+                static_cast<unsigned long long>(result.commit.percentile(50)),
+                static_cast<unsigned long long>(
+                    result.commit.percentile(99)));
+        }
+    }
+
+    Instance *instance_;
+    std::unique_ptr<HandlerTableEntry<EventHandler>> commitHandler_;
+    uint64_t lastCommit_ = 0;
+    std::string committed_;
+    std::vector<KeymanTestResult> results_;
+};
+
+} // namespace
+
+int main() {
+    bool hasFixture = false;
+    for (const auto &script : scripts) {
+        hasFixture = hasFixture || fs::isreg(fixtureKmx(script.keyboard));
+    }
+    if (!hasFixture) {
+        std::fprintf(stderr, "Fixture keyboards are not built.\n");
+        return skipReturnCode;
+    }
+
+    setupTestingEnvironment(TESTING_BINARY_DIR, {KEYMAN_ADDON_DIR},
+                            {TESTING_BINARY_DIR});
+    // Keyboards are located in XDG data directories.
+    setenv("XDG_DATA_HOME", KEYMAN_FIXTURE_DATA_DIR, 1);
+    setenv("XDG_DATA_DIRS", KEYMAN_FIXTURE_DATA_DIR, 1);
+    setenv("FCITX_CONFIG_HOME", TESTING_BINARY_DIR "/config", 1);
+
+    char arg0[] = "testkeyman";
+    char arg1[] = "--disable=all";
+    char arg2[] = "--enable=testfrontend,testui,keyman";
+    char *argv[] = {arg0, arg1, arg2};
+    Log::setLogRule("default=3");
+    Instance instance(FCITX_ARRAY_SIZE(argv), argv);
+    instance.addonManager().registerDefaultLoader(nullptr);
+    KeymanTest test(&instance);
+    EventDispatcher dispatcher;
+    dispatcher.attach(&instance.eventLoop());
+    dispatcher.schedule([&test, &dispatcher, &instance]() {
+        test.run();
+        dispatcher.detach();
+        instance.exit();
+    });
+    instance.exec();
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 Google LLC
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ */
+#include <malloc.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcitx/event.h>
+#include <fcitx/instance.h>
+#include "engine.h"
+#include "environment.h"
+#include "fakeinputcontext.h"
+#include "fixturekeys.h"
+#include "keymanmemory.h"
+#include "procstats.h"
+
+// Create and destroy input contexts, switch keyboards and type keys for a
+// long time, and fail if RSS or heap keeps growing after the warm up.
+
+using namespace fcitx;
+
+namespace {
+
+constexpr const char *fixtures[] = {"fixture_simple", "fixture_deadkey",
+                                    "fixture_longcontext"};
+constexpr int contextsPerRound = 8;
+constexpr int keysPerContext = 500;
+// Keys typed by the soak test, see keymanFixtureKey.
+constexpr char soakKeys[] = "abcdefghijklmnopqrstuvwxyz``\b<";
+// Reload the keyboard list every this many rounds.
+constexpr uint64_t listInterval = 50;
+
+struct SoakOptions {
+    uint64_t keys = 2000000;
+    unsigned seed = 1;
+    // Allowed growth after the warm up.
+    uint64_t rssBoundKb = 16384;
+    uint64_t heapBoundKb = 4096;
+};
+
+struct SoakSample {
+    uint64_t keys;
+    uint64_t rssKb;
+    uint64_t heapKb;
+};
+
+SoakSample sample(uint64_t keys) {
+#ifdef __GLIBC__
+    // Return the free memory, so RSS only counts what is in use.
+    malloc_trim(0);
+#endif
+    return {keys, keymanResidentKb(), keymanHeapUsage() / 1024};
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    SoakOptions options;
+    for (int i = 1; i < argc; i++) {
+        uint64_t seed = options.seed;
+        if (keymanParseOption(argv[i], "--keys", options.keys) ||
+            keymanParseOption(argv[i], "--rss-bound", options.rssBoundKb) ||
+            keymanParseOption(argv[i], "--heap-bound", options.heapBoundKb)) {
+            continue;
+        }
+        if (keymanParseOption(argv[i], "--seed", seed)) {
+            options.seed = seed;
+            continue;
+        }
+        std::fprintf(stderr,
+                     "Usage: %s [--keys=N] [--seed=N] [--rss-bound=KIB] "
+                     "[--heap-bound=KIB]\n",
+                     argv[0]);
+        return 1;
+    }
+    options.keys = std::max<uint64_t>(options.keys, 1);
+
+    KeymanBenchmarkEnvironment environment(KEYMAN_FIXTURE_DATA_DIR);
+    std::vector<std::string> keyboards;
+    for (const auto *fixture : fixtures) {
+        if (environment.fixtureBuilt(fixture)) {
+            keyboards.push_back(fixture);
+        }
+    }
+    if (keyboards.empty()) {
+        std::fprintf(stderr, "Fixture keyboards are not built.\n");
+        return keymanSkipReturnCode;
+    }
+
+    auto &engine = environment.createEngine("testsoak");
+    auto &instance = environment.instance();
+    environment.listInputMethods();
+    auto findEntry = [&environment](const std::string &id) {
+        const auto *entry = environment.findEntry(id);
+        FCITX_ASSERT(entry) << id;
+        return entry;
+    };
+
+    std::mt19937 random(options.seed);
+    const uint64_t warmUpKeys = options.keys / 10;
+    std::vector<SoakSample> samples;
+    SoakSample baseline{0, 0, 0};
+    uint64_t keys = 0;
+    for (uint64_t round = 0; keys < options.keys; round++) {
+        if (round % listInterval == listInterval - 1) {
+            // Entries are replaced, but the loaded keyboards are kept.
+            environment.listInputMethods();
+        }
+        std::vector<std::unique_ptr<FakeInputContext>> ics;
+        for (int i = 0; i < contextsPerRound; i++) {
+            ics.push_back(std::make_unique<FakeInputContext>(
+                instance.inputContextManager(), random() % 2));
+        }
+        for (auto &ic : ics) {
+            const auto *entry =
+                findEntry(keyboards[random() % keyboards.size()]);
+            InputContextEvent activate(
+                ic.get(), EventType::InputContextSwitchInputMethod);
+            engine.activate(*entry, activate);
+            for (int i = 0; i < keysPerContext; i++) {
+                if (random() % 100 == 0) {
+                    // Switch to another keyboard in the middle of typing.
+                    entry = findEntry(keyboards[random() % keyboards.size()]);
+                    engine.activate(*entry, activate);
+                }
+                if (random() % 200 == 0) {
+                    InputContextEvent reset(ic.get(),
+                                            EventType::InputContextReset);
+                    engine.reset(*entry, reset);
+                }
+                const auto key = keymanFixtureKey(
+                    soakKeys[random() % (sizeof(soakKeys) - 1)]);
+                for (const bool isRelease : {false, true}) {
+                    KeyEvent event(ic.get(), key, isRelease);
+                    engine.keyEvent(*entry, event);
+                    ic->applyKey(event);
+                }
+                keys++;
+            }
+        }
+        ics.clear();
+
+        if (keys < warmUpKeys) {
+            continue;
+        }
+        samples.push_back(sample(keys));
+        if (!baseline.keys) {
+            baseline = samples.back();
+        }
+    }
+
+    uint64_t maxRssKb = 0;
+    uint64_t maxHeapKb = 0;
+    for (const auto &item : samples) {
+        maxRssKb = std::max(maxRssKb, item.rssKb);
+        maxHeapKb = std::max(maxHeapKb, item.heapKb);
+    }
+    const auto &last = samples.back();
+    std::printf("keys: %llu, rounds sampled: %zu\n",
+                static_cast<unsigned long long>(keys), samples.size());
+    std::printf("rss KiB: baseline %llu, max %llu, last %llu\n",
+                static_cast<unsigned long long>(baseline.rssKb),
+                static_cast<unsigned long long>(maxRssKb),
+                static_cast<unsigned long long>(last.rssKb));
+    std::printf("heap KiB: baseline %llu, max %llu, last %llu\n",
+                static_cast<unsigned long long>(baseline.heapKb),
+                static_cast<unsigned long long>(maxHeapKb),
+                static_cast<unsigned long long>(last.heapKb));
+    if (maxRssKb > baseline.rssKb + options.rssBoundKb ||
+        maxHeapKb > baseline.heapKb + options.heapBoundKb) {
+        std::fprintf(stderr, "Memory grows beyond the bound after warm up.\n");
+        return 1;
+    }
+    return 0;
+}